@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parse.h"
+
+#define BATCH_CHUNK 4096
+
+static void batch_print_result(size_t base, batch_result_t *result);
+
+/**
+Parse a buffer of newline separated commands without dispatching them and
+without any terminal I/O. A line containing several commands (separated by
+"then" or a period) produces one result per command. Blank lines produce no
+results, and a line too long to parse whole produces a single PARSE_TOOLONG.
+
+Each result records the offset in the buffer at which parsing of the next
+command begins. If max_results is reached part way through a line, the
+offset stored in consumed points at the next unparsed command and parsing
+can resume from there.
+
+Returns the number of results written.
+*/
+size_t parse_batch(gamedata_t *gd, const char *buffer, size_t length,
+                   batch_result_t *results, size_t max_results, size_t *consumed) {
+    char line[MAX_INPUT_LENGTH];
+    input_t input;
+    size_t count = 0, pos = 0;
+
+    memset(&input, 0, sizeof(input_t));
+    while (pos < length && count < max_results) {
+        size_t line_start = pos;
+        size_t line_end = pos;
+        while (line_end < length && buffer[line_end] != '\n') {
+            ++line_end;
+        }
+        size_t next_line = line_end < length ? line_end + 1 : line_end;
+        size_t line_len = line_end - line_start;
+        int clipped = line_len > MAX_INPUT_LENGTH - 1;
+        if (clipped) {
+            line_len = MAX_INPUT_LENGTH - 1;
+        }
+        memcpy(line, &buffer[line_start], line_len);
+        line[line_len] = 0;
+
+        pos = next_line;
+        input.input = line;
+        input.next_cmd = 0;
+        input.cur_word = 0;
+        if (!tokenize(gd, &input)) {
+            continue;
+        }
+        if (clipped) {
+            input.too_long = TRUE;
+        }
+
+        while (count < max_results) {
+            int result = parse_command(gd, &input);
+            batch_result_t *here = &results[count++];
+            here->result = result;
+            here->action_func = input.action_func;
+            here->noun_count = input.noun_count;
+            for (int i = 0; i < PARSE_MAX_NOUNS; ++i) {
+                noun_t *noun = input.nouns[i];
+                if (!noun) {
+                    here->nouns[i] = NULL;
+                } else if (noun->ambig) {
+                    here->nouns[i] = OBJ_AMBIG;
+                } else {
+                    here->nouns[i] = noun->object;
+                }
+            }
+
+            const char *next_word = input.words[input.next_cmd].word;
+            if (result < 0 || input.next_cmd == 0 || !next_word) {
+                here->next_offset = next_line;
+                pos = next_line;
+                break;
+            }
+            here->next_offset = line_start + (next_word - line);
+            pos = here->next_offset;
+        }
+    }
+
+    for (int i = 0; i < PARSE_MAX_NOUNS; ++i) {
+        free_noun_list(input.nouns[i]);
+    }
+    if (consumed) {
+        *consumed = pos;
+    }
+    return count;
+}
+
+void batch_print_result(size_t base, batch_result_t *result) {
+    printf("%zu\t%d\t%s", base + result->next_offset, result->result,
+           result->action_func ? result->action_func->name : "-");
+    for (unsigned i = 0; i < result->noun_count && i < PARSE_MAX_NOUNS; ++i) {
+        if (result->nouns[i] == OBJ_AMBIG) {
+            printf("\tambig");
+        } else if (result->nouns[i]) {
+            printf("\tobj#%d", result->nouns[i]->id);
+        } else {
+            printf("\t-");
+        }
+    }
+    putchar('\n');
+}
+
+/**
+Parse every command in a file using parse_batch and report the throughput.
+If print_results is true, one tab separated line is also printed for each
+command giving the offset of the following command, the result code, the
+action function, and the nouns.
+
+Returns false if the file could not be read; returns true otherwise.
+*/
+int batch_run_file(gamedata_t *gd, const char *filename, int print_results) {
+    char *buffer = read_file(filename);
+    if (!buffer) {
+        fprintf(stderr, "Could not read batch file '%s'.\n", filename);
+        return FALSE;
+    }
+    size_t length = strlen(buffer);
+
+    batch_result_t *results = calloc(sizeof(batch_result_t), BATCH_CHUNK);
+    size_t total = 0, errors = 0, pos = 0;
+    size_t error_counts[7] = { 0 };
+    clock_t start = clock();
+    while (pos < length) {
+        size_t consumed = 0;
+        size_t count = parse_batch(gd, &buffer[pos], length - pos, results, BATCH_CHUNK, &consumed);
+        for (size_t i = 0; i < count; ++i) {
+            if (print_results) {
+                batch_print_result(pos, &results[i]);
+            }
+            if (results[i].result < 0) {
+                ++errors;
+                if (-results[i].result < 7) {
+                    ++error_counts[-results[i].result];
+                }
+            }
+        }
+        total += count;
+        if (consumed == 0) {
+            break;
+        }
+        pos += consumed;
+    }
+    double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("batch: %zu commands, %zu failed (ambig %zu, badnoun %zu, nonmatch %zu, "
+           "badtoken %zu, badword %zu, toolong %zu)\n",
+           total, errors, error_counts[-PARSE_AMBIG], error_counts[-PARSE_BADNOUN],
+           error_counts[-PARSE_NONMATCH], error_counts[-PARSE_BADTOKEN],
+           error_counts[-PARSE_BADWORD], error_counts[-PARSE_TOOLONG]);
+    printf("batch: %.3f s, %.0f commands/sec\n", elapsed,
+           elapsed > 0 ? total / elapsed : 0.0);
+
+    free(results);
+    free(buffer);
+    return TRUE;
+}
@@ -0,0 +1,991 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "parse.h"
+
+typedef struct BENCHMARK {
+    const char *name;
+    int default_size;
+    int (*func)(int size);
+    const char *description;
+} benchmark_t;
+
+static double bench_now();
+static void random_word(char *buffer, int length);
+static int levenshtein(const char *a, const char *b);
+static int bench_fuzzy(int size);
+static int bench_script(int size);
+static int bench_deep(int size);
+static int bench_room(int size);
+static int bench_count(int size);
+static int bench_image(int size);
+static int bench_lex(int size);
+static int bench_stream(int size);
+static int bench_load(int size);
+static int bench_rebuild(int size);
+static int bench_reload(int size);
+static int bench_world(int size);
+static void write_bench_object(FILE *fp, int i);
+static int bench_escape(int size);
+static void escape_quadratic(char *text);
+static long peak_memory();
+static long heap_in_use();
+static int room_list(program_t *prog, object_t *room, const char *func_name, int pass_child,
+                     char **output, size_t *length);
+
+static benchmark_t benchmarks[] = {
+    { "fuzzy", 100000, bench_fuzzy, "typo correction against a vocabulary of <size> words" },
+    { "script", 20000, bench_script, "<size> script-heavy turns in each script engine" },
+    { "deep", 200000, bench_deep, "list a container holding <size> objects with do-list-horz" },
+    { "room", 2000, bench_room, "list a room of <size> objects, recursively and with iteration builtins" },
+    { "count", 1000000, bench_count, "count to <size> in a tight arithmetic loop in each script engine" },
+    { "image", 100000, bench_image, "load the game with <size> extra objects from source and from an image" },
+    { "lex", 100, bench_lex, "tokenize <size> MB of source made from copies of the game files" },
+    { "stream", 100, bench_stream, "lex a <size> MB source file streamed and read whole" },
+    { "escape", 2000, bench_escape, "tokenize <size> 4 KB strings full of escapes" },
+    { "load", 10000, bench_load, "load the game from source with <size> extra objects" },
+    { "rebuild", 300, bench_rebuild, "load <size> source files without, into and from the load cache" },
+    { "reload", 20000, bench_reload, "reload game2.dat into a running game with up to <size> extra objects" },
+    { "world", 20000, bench_world, "load a generated world of <size> objects, timing each phase" },
+    { NULL }
+};
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void random_word(char *buffer, int length) {
+    for (int i = 0; i < length; ++i) {
+        buffer[i] = 'a' + rand() % 26;
+    }
+    buffer[length] = 0;
+}
+
+/* Straightforward dynamic programming edit distance, used as the baseline
+ * the bit-parallel matcher is compared against. */
+int levenshtein(const char *a, const char *b) {
+    int la = strlen(a), lb = strlen(b);
+    int row[128];
+    for (int j = 0; j <= lb; ++j) row[j] = j;
+    for (int i = 1; i <= la; ++i) {
+        int diag = row[0];
+        row[0] = i;
+        for (int j = 1; j <= lb; ++j) {
+            int up = row[j];
+            int best = diag + (a[i-1] != b[j-1]);
+            if (up + 1 < best) best = up + 1;
+            if (row[j-1] + 1 < best) best = row[j-1] + 1;
+            row[j] = best;
+            diag = up;
+        }
+    }
+    return row[lb];
+}
+
+int bench_fuzzy(int size) {
+    const int query_count = 10000;
+    const int brute_count = 50;
+    char word[32];
+
+    srand(1);
+    vocabulary_t *vocab = vocab_create();
+    for (int i = 0; i < size; ++i) {
+        random_word(word, 3 + rand() % 10);
+        vocab_raw_add(vocab, word);
+    }
+    double start = bench_now();
+    vocab_build(vocab);
+    double build_time = bench_now() - start;
+
+    /* queries are vocabulary words with one random edit applied */
+    char (*queries)[32] = calloc(query_count, 32);
+    int vocab_size = 0;
+    while (vocab_word(vocab, vocab_size)) ++vocab_size;
+    for (int q = 0; q < query_count; ++q) {
+        const char *original = vocab_word(vocab, rand() % vocab_size);
+        int length = strlen(original);
+        int pos = rand() % length;
+        switch (rand() % 3) {
+            case 0:
+                strcpy(queries[q], original);
+                queries[q][pos] = 'a' + rand() % 26;
+                break;
+            case 1:
+                memcpy(queries[q], original, pos);
+                queries[q][pos] = 'a' + rand() % 26;
+                strcpy(&queries[q][pos + 1], &original[pos]);
+                break;
+            default:
+                memcpy(queries[q], original, pos);
+                strcpy(&queries[q][pos], &original[pos + 1]);
+        }
+    }
+
+    int found = 0;
+    double worst = 0;
+    start = bench_now();
+    for (int q = 0; q < query_count; ++q) {
+        double query_start = bench_now();
+        int max_distance = strlen(queries[q]) < 5 ? 1 : 2;
+        if (vocab_suggest(vocab, queries[q], max_distance, NULL) >= 0) {
+            ++found;
+        }
+        double elapsed = bench_now() - query_start;
+        if (elapsed > worst) worst = elapsed;
+    }
+    double fuzzy_time = bench_now() - start;
+
+    int brute_found = 0;
+    start = bench_now();
+    for (int q = 0; q < brute_count; ++q) {
+        int best = 1000;
+        for (int i = 0; i < vocab_size; ++i) {
+            int d = levenshtein(queries[q], vocab_word(vocab, i));
+            if (d < best) best = d;
+        }
+        if (best <= 2) ++brute_found;
+    }
+    double brute_time = bench_now() - start;
+
+    printf("fuzzy: %d words, index built in %.3f ms\n", vocab_size, build_time * 1e3);
+    printf("fuzzy: %d queries, %.1f us/query (worst %.1f us), %d corrected uniquely\n",
+           query_count, fuzzy_time / query_count * 1e6, worst * 1e6, found);
+    printf("fuzzy: brute force dynamic programming %.1f us/query (%d/%d within range)\n",
+           brute_time / brute_count * 1e6, brute_found, brute_count);
+
+    free(queries);
+    vocab_free(vocab);
+    return TRUE;
+}
+
+int bench_script(int size) {
+    static const char *commands[] = { "look", "i", "x table", "n", "look", "s", NULL };
+    static const char *engine_names[] = { "tree", "vm" };
+
+    program_t *prog = load_data();
+    if (!prog) {
+        fprintf(stderr, "script: could not load game data\n");
+        return FALSE;
+    }
+    FILE *sink = fopen("/dev/null", "w");
+    int saved_engine = script_engine;
+    for (int engine = ENGINE_TREE; engine <= ENGINE_VM; ++engine) {
+        gamedata_t *gd = session_create(prog);
+        if (!gd) {
+            break;
+        }
+        gd->out = sink;
+        script_engine = engine;
+        alloc_counts_t allocs_before = list_allocs;
+        double start = bench_now();
+        for (int i = 0; i < size; ++i) {
+            game_turn(gd, commands[i % 6]);
+        }
+        double elapsed = bench_now() - start;
+        printf("script: %-4s %d turns, %.2f us/turn, %.1f nodes and %.1f strings allocated/turn\n",
+               engine_names[engine], size, elapsed / size * 1e6,
+               (double)(list_allocs.nodes - allocs_before.nodes) / size,
+               (double)(list_allocs.strings - allocs_before.strings) / size);
+        session_free(gd);
+    }
+    script_engine = saved_engine;
+    fclose(sink);
+    program_free(prog);
+    return TRUE;
+}
+
+int bench_deep(int size) {
+    program_t *prog = load_data();
+    if (!prog) {
+        fprintf(stderr, "deep: could not load game data\n");
+        return FALSE;
+    }
+    symbol_t *symbol = symbol_get(prog->symbols, "do-list-horz");
+    if (!symbol || symbol->type != SYM_FUNCTION) {
+        fprintf(stderr, "deep: game data does not define do-list-horz\n");
+        program_free(prog);
+        return FALSE;
+    }
+    int name_prop = property_number(prog, "#name");
+    object_t *sack = object_create(prog, prog->root);
+    for (int i = 0; i < size; ++i) {
+        object_t *pebble = object_create(prog, sack);
+        object_property_add_string(pebble, name_prop, str_dupl("pebble"));
+    }
+
+    gamedata_t *gd = session_create(prog);
+    if (!gd) {
+        program_free(prog);
+        return FALSE;
+    }
+    char *output = NULL;
+    size_t length = 0;
+    gd->out = open_memstream(&output, &length);
+    svalue_t container = value_object(session_object(gd, sack));
+    double start = bench_now();
+    svalue_t result = list_run_function(gd, symbol->d.ptr, 1, &container);
+    double elapsed = bench_now() - start;
+    value_free(result);
+    fclose(gd->out);
+    printf("deep: listed %d objects in %.3f s (%zu bytes of output)\n", size, elapsed, length);
+
+    free(output);
+    session_free(gd);
+    program_free(prog);
+    return TRUE;
+}
+
+/* The recursive room listing game2.dat used before the object iteration
+ * builtins existed, kept as the baseline for the room benchmark. */
+static const char *recursive_listing =
+    "(function old-next-visible-obj (after-obj)\n"
+    "    (if (sibling after-obj)\n"
+    "        (if (prop-get (sibling after-obj) #no-display)\n"
+    "            (old-next-visible-obj (sibling after-obj))\n"
+    "            (sibling after-obj))))\n"
+    "(function old-do-list-horz (for-obj)\n"
+    "    (proc\n"
+    "        (if (prop-get for-obj #no-display)\n"
+    "            (set \"for-obj\" (old-next-visible-obj for-obj)))\n"
+    "        (if for-obj\n"
+    "            (proc\n"
+    "                (say for-obj)\n"
+    "                (if (child for-obj)\n"
+    "                    (proc\n"
+    "                        (say \" (containing \")\n"
+    "                        (old-do-list-horz (child for-obj))\n"
+    "                        (say \")\")))\n"
+    "                (set \"next-obj\" (old-next-visible-obj for-obj))\n"
+    "                (if next-obj\n"
+    "                    (proc\n"
+    "                        (say \", \")\n"
+    "                        (if (not (old-next-visible-obj next-obj))\n"
+    "                            (say \"and \"))\n"
+    "                        (old-do-list-horz next-obj))))\n"
+    "            (say \"nothing\"))))\n";
+
+/* Run one listing of the room in a new session, printing its cost. */
+int room_list(program_t *prog, object_t *room, const char *func_name, int pass_child,
+              char **output, size_t *length) {
+    static const char *engine_names[] = { "tree", "vm" };
+    symbol_t *symbol = symbol_get(prog->symbols, func_name);
+    gamedata_t *gd = session_create(prog);
+    if (!symbol || symbol->type != SYM_FUNCTION || !gd) {
+        fprintf(stderr, "room: could not run %s\n", func_name);
+        if (gd) session_free(gd);
+        return FALSE;
+    }
+    gd->out = open_memstream(output, length);
+    object_t *container = session_object(gd, room);
+    svalue_t arg = value_object(pass_child ? container->first_child : container);
+    alloc_counts_t allocs_before = list_allocs;
+    double start = bench_now();
+    value_free(list_run_function(gd, symbol->d.ptr, 1, &arg));
+    double elapsed = bench_now() - start;
+    fclose(gd->out);
+    printf("room: %-4s %-16s %8.3f ms, %lu nodes and %lu strings allocated\n",
+           engine_names[script_engine], func_name, elapsed * 1e3,
+           list_allocs.nodes - allocs_before.nodes, list_allocs.strings - allocs_before.strings);
+    session_free(gd);
+    return TRUE;
+}
+
+int bench_room(int size) {
+    program_t *prog = load_data();
+    if (!prog) {
+        fprintf(stderr, "room: could not load game data\n");
+        return FALSE;
+    }
+    load_source(prog, recursive_listing);
+    optimize_program(prog);
+    vm_compile_program(prog, NULL);
+
+    /* every tenth object is hidden and every seventh holds two more */
+    int name_prop = property_number(prog, "#name");
+    int hidden_prop = property_number(prog, "#no-display");
+    object_t *room = object_create(prog, prog->root);
+    for (int i = 0; i < size; ++i) {
+        object_t *obj = object_create(prog, room);
+        object_property_add_string(obj, name_prop, str_dupl("rock"));
+        if (i % 10 == 0) {
+            object_property_add_integer(obj, hidden_prop, 1);
+        }
+        if (i % 7 == 0) {
+            for (int j = 0; j < 2; ++j) {
+                object_t *inner = object_create(prog, obj);
+                object_property_add_string(inner, name_prop, str_dupl("pebble"));
+            }
+        }
+    }
+
+    int success = TRUE;
+    int saved_engine = script_engine;
+    for (int engine = ENGINE_TREE; engine <= ENGINE_VM; ++engine) {
+        char *before = NULL, *after = NULL;
+        size_t before_length = 0, after_length = 0;
+        script_engine = engine;
+        if (!room_list(prog, room, "old-do-list-horz", TRUE, &before, &before_length)
+                || !room_list(prog, room, "do-list-horz", FALSE, &after, &after_length)) {
+            success = FALSE;
+        } else if (before_length != after_length || memcmp(before, after, before_length) != 0) {
+            printf("room: listings differ\n");
+            success = FALSE;
+        }
+        free(before);
+        free(after);
+    }
+    script_engine = saved_engine;
+    program_free(prog);
+    return success;
+}
+
+/* Counts up by recursion, which is a loop in the VM. The tree walker nests
+ * a call for each step, so the benchmark counts in short runs. */
+static const char *counter_loop =
+    "(function count-up (n limit)\n"
+    "    (if (lt n limit)\n"
+    "        (count-up (add n 1) limit)\n"
+    "        n))\n";
+
+#define COUNT_RUN 2000
+
+int bench_count(int size) {
+    static const char *engine_names[] = { "tree", "vm" };
+
+    program_t *prog = load_data();
+    if (!prog) {
+        fprintf(stderr, "count: could not load game data\n");
+        return FALSE;
+    }
+    load_source(prog, counter_loop);
+    vm_compile_program(prog, NULL);
+    symbol_t *symbol = symbol_get(prog->symbols, "count-up");
+
+    int success = TRUE;
+    int saved_engine = script_engine;
+    for (int engine = ENGINE_TREE; engine <= ENGINE_VM; ++engine) {
+        gamedata_t *gd = session_create(prog);
+        if (!gd) {
+            success = FALSE;
+            break;
+        }
+        script_engine = engine;
+        long total = 0;
+        alloc_counts_t allocs_before = list_allocs;
+        double start = bench_now();
+        for (int done = 0; done < size; done += COUNT_RUN) {
+            svalue_t args[2] = { value_int(0), value_int(size - done < COUNT_RUN ? size - done : COUNT_RUN) };
+            svalue_t result = list_run_function(gd, symbol->d.ptr, 2, args);
+            if (result.type == T_INTEGER) {
+                total += result.d.number;
+            }
+            value_free(result);
+        }
+        double elapsed = bench_now() - start;
+        printf("count: %-4s counted to %ld in %.3f s, %.1f ns/step, %.2f nodes allocated/step\n",
+               engine_names[engine], total, elapsed, elapsed / size * 1e9,
+               (double)(list_allocs.nodes - allocs_before.nodes) / size);
+        if (total != size) {
+            printf("count: expected %d\n", size);
+            success = FALSE;
+        }
+        session_free(gd);
+    }
+    script_engine = saved_engine;
+    program_free(prog);
+    return success;
+}
+
+int bench_image(int size) {
+    const char *filename = "bench-image.img";
+    double start = bench_now();
+    program_t *prog = load_data();
+    double source_time = bench_now() - start;
+    if (!prog) {
+        fprintf(stderr, "image: could not load game data\n");
+        return FALSE;
+    }
+    printf("image: loaded source with %d objects in %.3f ms\n",
+           prog->object_count, source_time * 1e3);
+
+    int name_prop = property_number(prog, "#name");
+    for (int i = 0; i < size; ++i) {
+        object_t *obj = object_create(prog, prog->root);
+        object_property_add_string(obj, name_prop, str_dupl("rock"));
+    }
+    start = bench_now();
+    int success = image_write(prog, filename);
+    double write_time = bench_now() - start;
+    int object_count = prog->object_count;
+    program_free(prog);
+    if (!success) {
+        fprintf(stderr, "image: could not write %s\n", filename);
+        return FALSE;
+    }
+
+    start = bench_now();
+    prog = image_load(filename);
+    double load_time = bench_now() - start;
+    if (!prog) {
+        fprintf(stderr, "image: could not load %s\n", filename);
+        remove(filename);
+        return FALSE;
+    }
+    gamedata_t *gd = session_create(prog);
+    if (gd) {
+        session_free(gd);
+    } else {
+        success = FALSE;
+    }
+    printf("image: wrote %d objects in %.3f ms, mapped them in %.3f ms (%.1f ns/object)\n",
+           object_count, write_time * 1e3, load_time * 1e3, load_time / object_count * 1e9);
+    program_free(prog);
+    remove(filename);
+    return success;
+}
+
+int bench_lex(int size) {
+    program_t *prog = load_data();
+    char *game = read_file("game.dat");
+    char *game2 = read_file("game2.dat");
+    if (!prog || !game || !game2) {
+        fprintf(stderr, "lex: could not load game data\n");
+        if (prog) program_free(prog);
+        free(game);
+        free(game2);
+        return FALSE;
+    }
+
+    size_t target = (size_t)size * 1024 * 1024;
+    size_t game_length = strlen(game), game2_length = strlen(game2);
+    char *source = malloc(target + game_length + game2_length + 1);
+    size_t length = 0;
+    while (length < target) {
+        memcpy(&source[length], game, game_length);
+        length += game_length;
+        memcpy(&source[length], game2, game2_length);
+        length += game2_length;
+    }
+    source[length] = 0;
+    free(game);
+    free(game2);
+
+    double start = bench_now();
+    token_buffer_t *tokens = tokenize_source(prog->vocab, source, 0);
+    double elapsed = bench_now() - start;
+    printf("lex: %.1f MB in %.3f s (%.1f MB/s), %zu tokens, %.1f MB of tokens\n",
+           length / 1048576.0, elapsed, length / 1048576.0 / elapsed, tokens->count,
+           tokens->count * sizeof(token_t) / 1048576.0);
+
+    token_buffer_free(tokens);
+    free(source);
+    program_free(prog);
+    return TRUE;
+}
+
+int bench_stream(int size) {
+    const char *filename = "bench-stream.dat";
+    program_t *prog = load_data();
+    char *game = read_file("game.dat");
+    char *game2 = read_file("game2.dat");
+    FILE *fp = fopen(filename, "wb");
+    if (!prog || !game || !game2 || !fp) {
+        fprintf(stderr, "stream: could not load game data\n");
+        if (prog) program_free(prog);
+        if (fp) fclose(fp);
+        free(game);
+        free(game2);
+        return FALSE;
+    }
+
+    size_t target = (size_t)size * 1024 * 1024;
+    size_t length = 0;
+    while (length < target) {
+        length += fwrite(game, 1, strlen(game), fp);
+        length += fwrite(game2, 1, strlen(game2), fp);
+    }
+    fclose(fp);
+    free(game);
+    free(game2);
+
+    /* the streamed pass goes first, since the peak never comes back down */
+    lexer_t lex;
+    size_t token_count[2] = { 0, 0 };
+    double elapsed[2];
+    long peak_growth[2];
+    for (int pass = 0; pass < 2; ++pass) {
+        long peak_before = peak_memory();
+        double start = bench_now();
+        char *source = NULL;
+        if (pass == 0) {
+            lexer_open(&lex, prog->vocab, filename, 0);
+        } else {
+            source = read_file(filename);
+            lexer_init(&lex, prog->vocab, source, 0);
+        }
+        while (lexer_next(&lex)) {
+            ++token_count[pass];
+        }
+        if (pass == 0) {
+            lexer_close(&lex);
+        }
+        elapsed[pass] = bench_now() - start;
+        peak_growth[pass] = peak_memory() - peak_before;
+        free(source);
+    }
+    remove(filename);
+
+    printf("stream: %.1f MB, %zu tokens\n", length / 1048576.0, token_count[0]);
+    printf("stream: streamed in %.3f s (%.1f MB/s), peak grew %ld KB\n",
+           elapsed[0], length / 1048576.0 / elapsed[0], peak_growth[0]);
+    printf("stream: read whole in %.3f s (%.1f MB/s), peak grew %ld KB\n",
+           elapsed[1], length / 1048576.0 / elapsed[1], peak_growth[1]);
+
+    program_free(prog);
+    return token_count[0] == token_count[1];
+}
+
+/* The escape decoder the lexer used to have, which rescans and shifts the
+ * rest of the string for every character, kept as the baseline for the
+ * escape benchmark. */
+void escape_quadratic(char *text) {
+    for (int i = 0; i < strlen(text); ++i) {
+        if (text[i] == '\\') {
+            int escape_char = text[i+1];
+            memmove(&text[i], &text[i+1], strlen(text) - i);
+            if (escape_char == 'n') {
+                text[i] = '\n';
+            }
+        }
+    }
+}
+
+int bench_escape(int size) {
+    static const char *pieces[] = {
+        "The wind howls through the broken shutters.\\n",
+        "\\tA \\\"ghost\\\" story, told twice\\\\thrice.\\n",
+        "Caf\\u00e9 au lait costs \\u20ac3.\\n",
+        NULL
+    };
+    const int string_size = 4096;
+    const int baseline_count = 20;
+
+    /* each string is a source line: a quote, escaped text and a quote */
+    size_t length = 0;
+    char *source = malloc((size_t)size * (string_size + 128) + 1);
+    for (int i = 0; i < size; ++i) {
+        size_t line_start = length;
+        source[length++] = '"';
+        for (int p = 0; length - line_start < string_size; p = pieces[p + 1] ? p + 1 : 0) {
+            size_t piece_length = strlen(pieces[p]);
+            memcpy(&source[length], pieces[p], piece_length);
+            length += piece_length;
+        }
+        source[length++] = '"';
+        source[length++] = '\n';
+    }
+    source[length] = 0;
+
+    /* the baseline decodes copies of the first few strings */
+    char *line_end = strchr(source, '\n');
+    size_t line_length = line_end - source;
+    char *copy = malloc(line_length);
+    double start = bench_now();
+    for (int i = 0; i < baseline_count; ++i) {
+        memcpy(copy, &source[1], line_length - 2);
+        copy[line_length - 2] = 0;
+        escape_quadratic(copy);
+    }
+    double baseline = (bench_now() - start) / baseline_count;
+    free(copy);
+
+    start = bench_now();
+    token_buffer_t *tokens = tokenize_source(NULL, source, 0);
+    double elapsed = bench_now() - start;
+    size_t decoded = 0;
+    for (size_t i = 0; i < tokens->count; ++i) {
+        decoded += tokens->tokens[i].length;
+    }
+    printf("escape: %zu strings, %.1f MB of source decoded to %.1f MB in %.3f s (%.1f MB/s)\n",
+           tokens->count, length / 1048576.0, decoded / 1048576.0, elapsed,
+           length / 1048576.0 / elapsed);
+    printf("escape: %.1f us/string, against %.1f us/string decoding with rescans\n",
+           elapsed / tokens->count * 1e6, baseline * 1e6);
+
+    token_buffer_free(tokens);
+    free(source);
+    return TRUE;
+}
+
+/* The peak resident size of the process, in kilobytes. */
+long peak_memory() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* The heap currently allocated, in kilobytes, or -1 if it can't be found. */
+long heap_in_use() {
+#ifdef __GLIBC__
+    struct mallinfo2 info = mallinfo2();
+    return (long)((info.uordblks + info.hblkhd) / 1024);
+#else
+    return -1;
+#endif
+}
+
+/* Write the source for the ith object of a synthetic world: rooms of ten
+ * items each, in a chain leading back to the entryway. Each room comes with
+ * a function. */
+void write_bench_object(FILE *fp, int i) {
+    if (i % 10 == 0) {
+        char south[32] = "entryway";
+        if (i > 0) {
+            sprintf(south, "bench-room-%d", i / 10 - 1);
+        }
+        fprintf(fp, "(object room bench-room-%d -\n"
+                    "    name \"Room %d\"\n"
+                    "    description \"A featureless room, one of many just like it.\"\n"
+                    "    south %s)\n",
+                i / 10, i / 10, south);
+        fprintf(fp, "(function bench-weight-%d (item)\n"
+                    "    (if (lt (prop-get item weight) %d) (add 1 2) (mul 3 4)))\n",
+                i / 10, i % 7);
+    }
+    fprintf(fp, "(object - bench-item-%d bench-room-%d\n"
+                "    name \"item %d\"\n"
+                "    vocab ( <item> <thing> )\n"
+                "    weight %d\n"
+                "    junk (%d \"loose\" bench-room-%d))\n",
+            i, i / 10, i, i % 7, i, i / 10);
+}
+
+#define LOAD_FILES 16
+
+int bench_load(int size) {
+    char filenames[LOAD_FILES][32];
+    FILE *files[LOAD_FILES];
+    const char *filelist[LOAD_FILES + 3] = { "game.dat", "game2.dat" };
+    for (int i = 0; i < LOAD_FILES; ++i) {
+        sprintf(filenames[i], "bench-load-%d.dat", i);
+        filelist[i + 2] = filenames[i];
+        files[i] = fopen(filenames[i], "w");
+        if (!files[i]) {
+            fprintf(stderr, "load: could not write %s\n", filenames[i]);
+            while (i > 0) {
+                fclose(files[--i]);
+                remove(filenames[i]);
+            }
+            return FALSE;
+        }
+    }
+    filelist[LOAD_FILES + 2] = NULL;
+
+    /* rooms of ten objects are dealt out between the files */
+    for (int i = 0; i < size; ++i) {
+        write_bench_object(files[i / 10 % LOAD_FILES], i);
+    }
+    long source_size = 0;
+    for (int i = 0; i < LOAD_FILES; ++i) {
+        source_size += ftell(files[i]);
+        fclose(files[i]);
+    }
+
+    long heap_before = heap_in_use();
+    long peak_before = peak_memory();
+    double start = bench_now();
+    program_t *prog = load_files(filelist);
+    double elapsed = bench_now() - start;
+    long peak_after = peak_memory();
+    long heap_after = heap_in_use();
+
+    /* reading and building the files, alone, on one thread and on the pool */
+    int saved_threads = load_threads;
+    double build_time[2];
+    for (int pass = 0; pass < 2 && prog; ++pass) {
+        load_threads = pass == 0 ? 1 : saved_threads;
+        program_t *unlinked = program_create();
+        start = bench_now();
+        if (!load_sources(unlinked, filelist, NULL)) {
+            program_free(prog);
+            prog = NULL;
+        }
+        build_time[pass] = bench_now() - start;
+        program_free(unlinked);
+    }
+    load_threads = saved_threads;
+    for (int i = 0; i < LOAD_FILES; ++i) {
+        remove(filenames[i]);
+    }
+    if (!prog) {
+        fprintf(stderr, "load: could not load game data\n");
+        return FALSE;
+    }
+
+    printf("load: %.1f MB of source, %d objects and %d functions in %.3f s (%.2f us/object)\n",
+           source_size / 1048576.0, prog->object_count, prog->function_count,
+           elapsed, elapsed / prog->object_count * 1e6);
+    printf("load: loaded program holds %.1f MB; peak resident size grew by %.1f MB\n",
+           (heap_after - heap_before) / 1024.0, (peak_after - peak_before) / 1024.0);
+    printf("load: %d files read and built in %.3f s on one thread, %.3f s on %ld threads\n",
+           LOAD_FILES + 2, build_time[0], build_time[1],
+           saved_threads > 0 ? saved_threads : sysconf(_SC_NPROCESSORS_ONLN));
+    program_free(prog);
+    return TRUE;
+}
+
+#define REBUILD_OBJECTS 20    /* objects in each file; a multiple of ten */
+
+int bench_rebuild(int size) {
+    const char *cache_dir = "bench-rebuild-cache";
+    char (*filenames)[32] = calloc(size, 32);
+    const char **filelist = calloc(size + 3, sizeof(char*));
+    filelist[0] = "game.dat";
+    filelist[1] = "game2.dat";
+    int success = TRUE;
+    for (int f = 0; f < size; ++f) {
+        sprintf(filenames[f], "bench-rebuild-%d.dat", f);
+        filelist[f + 2] = filenames[f];
+        FILE *fp = fopen(filenames[f], "w");
+        if (!fp) {
+            fprintf(stderr, "rebuild: could not write %s\n", filenames[f]);
+            success = FALSE;
+            break;
+        }
+        for (int i = 0; i < REBUILD_OBJECTS; ++i) {
+            write_bench_object(fp, f * REBUILD_OBJECTS + i);
+        }
+        fclose(fp);
+    }
+
+    static const char *passes[] = {
+        "without a cache", "filling the cache", "from the cache", "after changing one file"
+    };
+    double times[4];
+    const char *saved_cache_dir = load_cache_dir;
+    for (int pass = 0; pass < 4 && success; ++pass) {
+        load_cache_dir = pass == 0 ? NULL : cache_dir;
+        if (pass == 3) {
+            FILE *fp = fopen(filenames[size / 2], "a");
+            if (fp) {
+                fprintf(fp, "// edited\n");
+                fclose(fp);
+            }
+        }
+        double start = bench_now();
+        program_t *prog = load_files(filelist);
+        times[pass] = bench_now() - start;
+        if (!prog) {
+            fprintf(stderr, "rebuild: could not load game data %s\n", passes[pass]);
+            success = FALSE;
+        } else {
+            program_free(prog);
+        }
+    }
+    load_cache_dir = saved_cache_dir;
+
+    for (int f = 0; f < size; ++f) {
+        remove(filenames[f]);
+    }
+    DIR *dir = opendir(cache_dir);
+    if (dir) {
+        struct dirent *entry;
+        char path[300];
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] != '.') {
+                snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+                remove(path);
+            }
+        }
+        closedir(dir);
+        rmdir(cache_dir);
+    }
+    free(filenames);
+    free(filelist);
+
+    if (success) {
+        printf("rebuild: %d files of %d objects each\n", size, REBUILD_OBJECTS);
+        for (int pass = 0; pass < 4; ++pass) {
+            printf("rebuild: loaded %-24s in %.3f s\n", passes[pass], times[pass]);
+        }
+    }
+    return success;
+}
+
+#define RELOADS 50
+
+/* Time reloading game2.dat into a running game whose world has a tenth of
+ * size extra objects and then size of them; a reload should cost the same
+ * however big the world is. */
+int bench_reload(int size) {
+    const char *filename = "bench-reload.dat";
+    const char *filelist[] = { "game.dat", "game2.dat", filename, NULL };
+    FILE *null_out = fopen("/dev/null", "w");
+    int success = TRUE;
+    for (int pass = 0; pass < 2 && success; ++pass) {
+        int objects = pass == 0 ? size / 10 : size;
+        FILE *fp = fopen(filename, "w");
+        if (!fp) {
+            fprintf(stderr, "reload: could not write %s\n", filename);
+            success = FALSE;
+            break;
+        }
+        for (int i = 0; i < objects; ++i) {
+            write_bench_object(fp, i);
+        }
+        fclose(fp);
+
+        double start = bench_now();
+        program_t *prog = load_files(filelist);
+        double load_time = bench_now() - start;
+        gamedata_t *gd = prog ? session_create(prog) : NULL;
+        if (!gd) {
+            fprintf(stderr, "reload: could not load game data\n");
+            if (prog) program_free(prog);
+            success = FALSE;
+            break;
+        }
+        gd->out = null_out;
+
+        /* a turn between reloads lets the replaced definitions be freed */
+        double reload_time = 0;
+        int functions = 0, actions = 0;
+        for (int i = 0; i < RELOADS && success; ++i) {
+            game_turn(gd, "i");
+            start = bench_now();
+            success = reload_file(prog, "game2.dat", &functions, &actions);
+            reload_time += bench_now() - start;
+        }
+        game_turn(gd, "look");
+        if (success) {
+            printf("reload: %d objects loaded in %.3f s; game2.dat reloaded in %.3f ms "
+                   "(%d functions, %d grammar lines)\n",
+                   prog->object_count, load_time, reload_time / RELOADS * 1e3, functions, actions);
+        }
+        session_free(gd);
+        program_free(prog);
+    }
+    remove(filename);
+    fclose(null_out);
+    return success;
+}
+
+int bench_world(int size) {
+    const char *dir = "bench-world";
+    world_spec_t spec;
+    world_spec_default(&spec, size);
+    double start = bench_now();
+    char *manifest = world_generate(&spec, dir);
+    double generate_time = bench_now() - start;
+    char **filelist = manifest ? read_manifest(manifest) : NULL;
+    if (!filelist) {
+        fprintf(stderr, "world: could not write a world to %s\n", dir);
+        free(manifest);
+        return FALSE;
+    }
+    int file_count = 0;
+    long source_size = 0;
+    for (int i = 0; filelist[i]; ++i) {
+        struct stat info;
+        if (stat(filelist[i], &info) == 0) {
+            source_size += info.st_size;
+        }
+        ++file_count;
+    }
+
+    const char *saved_manifest = load_manifest;
+    load_manifest = manifest;
+    long heap_before = heap_in_use();
+    long peak_before = peak_memory();
+    start = bench_now();
+    program_t *prog = load_data();
+    double elapsed = bench_now() - start;
+    long peak_after = peak_memory();
+    long heap_after = heap_in_use();
+    load_manifest = saved_manifest;
+
+    /* the world's own files are removed; the game's are listed first */
+    for (int i = 0; filelist[i]; ++i) {
+        if (strncmp(filelist[i], dir, strlen(dir)) == 0) {
+            remove(filelist[i]);
+        }
+        free(filelist[i]);
+    }
+    free(filelist);
+    remove(manifest);
+    rmdir(dir);
+    free(manifest);
+    if (!prog) {
+        fprintf(stderr, "world: could not load the world\n");
+        return FALSE;
+    }
+
+    int action_count = 0;
+    for (action_t *action = prog->actions; action; action = action->next) {
+        ++action_count;
+    }
+    printf("world: %d rooms of %d items, %d deep: %.1f MB of source in %d files, written in %.3f s\n",
+           spec.rooms, spec.items_per_room, spec.depth, source_size / 1048576.0,
+           file_count, generate_time);
+    printf("world: %d objects, %d functions and %d actions loaded in %.3f s (%.2f us/object)\n",
+           prog->object_count, prog->function_count, action_count, elapsed,
+           elapsed / prog->object_count * 1e6);
+    const char *phase_names[] = { "build", "merge", "vocab", "link", "optimize", "compile" };
+    double phase_times[] = { load_times.build, load_times.merge, load_times.vocab,
+                             load_times.link, load_times.optimize, load_times.compile };
+    for (int i = 0; i < 6; ++i) {
+        printf("world:   %-8s %8.3f s  %5.1f%%\n",
+               phase_names[i], phase_times[i], phase_times[i] / elapsed * 100);
+    }
+    printf("world: loaded program holds %.1f MB (%.0f bytes/object); peak resident size grew by %.1f MB\n",
+           (heap_after - heap_before) / 1024.0,
+           (heap_after - heap_before) * 1024.0 / prog->object_count,
+           (peak_after - peak_before) / 1024.0);
+
+    heap_before = heap_in_use();
+    start = bench_now();
+    gamedata_t *gd = session_create(prog);
+    elapsed = bench_now() - start;
+    heap_after = heap_in_use();
+    if (gd) {
+        printf("world: a session is made in %.3f s and holds %.1f MB (%.0f bytes/object)\n",
+               elapsed, (heap_after - heap_before) / 1024.0,
+               (heap_after - heap_before) * 1024.0 / prog->object_count);
+        session_free(gd);
+    }
+    program_free(prog);
+    return gd != NULL;
+}
+
+/**
+Run a named benchmark. A size of 0 uses the benchmark's default size.
+
+Returns false if no benchmark has the given name; returns true otherwise.
+*/
+int bench_run(const char *name, int size) {
+    for (int i = 0; benchmarks[i].name; ++i) {
+        if (strcmp(benchmarks[i].name, name) == 0) {
+            return benchmarks[i].func(size > 0 ? size : benchmarks[i].default_size);
+        }
+    }
+
+    fprintf(stderr, "Unknown benchmark '%s'. Available benchmarks:\n", name);
+    for (int i = 0; benchmarks[i].name; ++i) {
+        fprintf(stderr, "   %-12s %s (default %d)\n", benchmarks[i].name,
+                benchmarks[i].description, benchmarks[i].default_size);
+    }
+    return FALSE;
+}
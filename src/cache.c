@@ -0,0 +1,154 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parse.h"
+
+/* The load cache keeps a loaded game as a game image, so that if none of
+ * its source files have changed since the last load the image can be mapped
+ * instead. Nothing is tokenized, parsed, linked or optimized again; only
+ * the bytecode is made afresh, as for any image.
+ *
+ * A game has one image in the cache directory, named after a hash of the
+ * names of its source files. The image's header records a hash of what the
+ * files held when they were loaded, taken from the bytes the lexer read, so
+ * a file changed part way through a load can never be cached as unchanged.
+ * Any change to a file means the game is loaded from source and its image
+ * replaced. */
+
+static char *cache_path(const char *dir, const char **filelist);
+
+/**
+Continue a hash made by hash_bytes over more data.
+*/
+uint64_t hash_update(uint64_t hash, const char *data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+Hash a block of data (64 bit FNV-1a). Used to tell whether a game's source
+files have changed since it was cached.
+*/
+uint64_t hash_bytes(const char *data, size_t length) {
+    return hash_update(0xcbf29ce484222325ULL, data, length);
+}
+
+/**
+Hash a file's contents as hash_bytes would, reading it a chunk at a time.
+
+Returns false if the file could not be read.
+*/
+int hash_file(const char *filename, uint64_t *hash) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        debug_out("hash_file: could not open file '%s'\n", filename);
+        return FALSE;
+    }
+    char chunk[65536];
+    size_t count;
+    *hash = 0xcbf29ce484222325ULL;
+    while ((count = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        *hash = hash_update(*hash, chunk, count);
+    }
+    int success = !ferror(fp);
+    fclose(fp);
+    return success;
+}
+
+/**
+Combine the hashes of a game's source files, taken as hash_file or load_file
+would, into the hash a cached image of the game is recorded with.
+*/
+uint64_t cache_source_hash(const char **filelist, const uint64_t *hashes) {
+    uint64_t hash = hash_bytes(NULL, 0);
+    for (int i = 0; filelist[i]; ++i) {
+        hash = hash_update(hash, filelist[i], strlen(filelist[i]) + 1);
+        hash = hash_update(hash, (const char*)&hashes[i], sizeof(hashes[i]));
+    }
+    return hash;
+}
+
+/* The path of the cached image of a game with these source files. The name
+ * depends only on the file names, so a newer image replaces an older one. */
+static char *cache_path(const char *dir, const char **filelist) {
+    uint64_t hash = hash_bytes(NULL, 0);
+    for (int i = 0; filelist[i]; ++i) {
+        hash = hash_update(hash, filelist[i], strlen(filelist[i]) + 1);
+    }
+    char *path = malloc(strlen(dir) + 32);
+    sprintf(path, "%s/%016llx.image", dir, (unsigned long long)hash);
+    return path;
+}
+
+/**
+Load a game from its cached image, if every one of its source files is as
+it was when the image was written.
+
+Returns the program, or NULL if there is no image or it is out of date.
+*/
+program_t *cache_load(const char *dir, const char **filelist) {
+    char *path = cache_path(dir, filelist);
+    uint64_t cached_hash;
+    if (!image_source_hash(path, &cached_hash)) {
+        free(path);
+        return NULL;
+    }
+
+    int file_count = 0;
+    while (filelist[file_count]) {
+        ++file_count;
+    }
+    uint64_t *hashes = calloc(sizeof(uint64_t), file_count + 1);
+    int hashed = TRUE;
+    for (int i = 0; i < file_count && hashed; ++i) {
+        hashed = hash_file(filelist[i], &hashes[i]);
+    }
+    program_t *prog = NULL;
+    if (hashed && cache_source_hash(filelist, hashes) == cached_hash) {
+        prog = image_load(path);
+    }
+    TRACE(TRACE_LOADER, TRACE_INFO, "cache_load: %s is %s\n", path,
+          prog ? "up to date" : "out of date");
+    free(hashes);
+    free(path);
+    return prog;
+}
+
+/**
+Save a loaded game as its cached image, replacing any older one. The
+program's source_hash must be the cache_source_hash of its files as they
+were loaded. The image is written under another name and then renamed, so
+a load running at the same time sees either the old image or the new one.
+
+Returns true on success and false if the image could not be saved.
+*/
+int cache_store(const char *dir, const char **filelist, program_t *prog) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        debug_out("cache_store: could not make directory %s\n", dir);
+        return FALSE;
+    }
+    char *path = cache_path(dir, filelist);
+    char *temp = malloc(strlen(path) + 32);
+    sprintf(temp, "%s.%ld", path, (long)getpid());
+    int success = image_write(prog, temp);
+    if (success && rename(temp, path) != 0) {
+        debug_out("cache_store: could not rename %s to %s\n", temp, path);
+        success = FALSE;
+    }
+    if (!success) {
+        remove(temp);
+    }
+    free(temp);
+    free(path);
+    return success;
+}
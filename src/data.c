@@ -6,15 +6,170 @@
 
 static void symbol_add_core(symboltable_t *table, symbol_t *symbol);
 
-gamedata_t *gamedata_create() {
+program_t *program_create() {
+    program_t *prog = calloc(sizeof(program_t), 1);
+    prog->vocab = vocab_create();
+    prog->symbols = symboltable_create();
+    prog->next_property_id = 1;
+    prog->root = object_create(prog, NULL);
+    prog->reload = reload_create();
+    add_builtin_property(prog, "#internal-name", OBJPROP_INTERNAL_NAME);
+    add_builtin_property(prog, "#prototype", OBJPROP_PROTOTYPE);
+    return prog;
+}
+
+void program_free(program_t *prog) {
+    reload_free(prog);
+    if (prog->image) {
+        image_free(prog);
+        return;
+    }
+    objectloop_free(prog->root);
+    free(prog->objects);
+
+    while (prog->actions) {
+        action_t *next = prog->actions->next;
+        free(prog->actions);
+        prog->actions = next;
+    }
+
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        symbol_t *symbol = prog->symbols->buckets[i];
+        while (symbol) {
+            if (symbol->type == SYM_FUNCTION) {
+                function_t *func = symbol->d.ptr;
+                free((void*)func->name);
+                if (func->arg_list) list_free(func->arg_list);
+                if (func->body) list_free(func->body);
+                vm_free(func->code);
+                free(func);
+            }
+            symbol = symbol->next;
+        }
+    }
+    symboltable_free(prog->symbols);
+    vocab_free(prog->vocab);
+    free(prog);
+}
+
+/**
+Create a new session from a loaded program. The session gets its own copy
+of every object in the program's template world; everything else in the
+program (vocabulary, grammar, symbols, and functions) is shared read-only.
+String values and arrays in object properties are shared with the template
+until they are replaced, except arrays that refer to objects, which are
+copied.
+
+Returns the new session, or NULL if the program does not define a valid
+gameinfo object and player.
+*/
+gamedata_t *session_create(program_t *prog) {
     gamedata_t *gd = calloc(sizeof(gamedata_t), 1);
-    gd->root = object_create(NULL);
-    gd->symbols = symboltable_create();
-    add_builtin_property(gd, "#internal-name", OBJPROP_INTERNAL_NAME);
-    add_builtin_property(gd, "#prototype", OBJPROP_PROTOTYPE);
+    gd->program = prog;
+    gd->symbols = prog->symbols;
+    gd->out = stdout;
+    gd->world_epoch = 1;
+    budget_start_turn(gd);
+    reload_session_add(gd);
+
+    gd->objects = calloc(sizeof(object_t*), prog->object_count);
+    gd->object_block = calloc(sizeof(object_t), prog->object_count);
+    for (int i = 0; i < prog->object_count; ++i) {
+        gd->objects[i] = &gd->object_block[i];
+        gd->objects[i]->id = i;
+    }
+
+    for (int i = 0; i < prog->object_count; ++i) {
+        object_t *template_obj = prog->objects[i];
+        object_t *obj = gd->objects[i];
+        obj->parent = session_object(gd, template_obj->parent);
+        obj->first_child = session_object(gd, template_obj->first_child);
+        obj->sibling = session_object(gd, template_obj->sibling);
+
+        property_t *last = NULL;
+        for (property_t *src = template_obj->properties; src; src = src->next) {
+            property_t *prop = calloc(sizeof(property_t), 1);
+            prop->id = src->id;
+            prop->value = src->value;
+            if (src->value.type == PT_OBJECT) {
+                prop->value.d.ptr = session_object(gd, src->value.d.ptr);
+            } else if (src->value.type == PT_ARRAY) {
+                value_t *items = src->value.d.ptr;
+                int has_objects = FALSE;
+                for (int j = 0; j < src->value.array_size; ++j) {
+                    has_objects |= items[j].type == PT_OBJECT;
+                }
+                if (has_objects) {
+                    /* arrays that refer to objects need the session's own */
+                    value_t *copy = malloc(sizeof(value_t) * src->value.array_size);
+                    for (int j = 0; j < src->value.array_size; ++j) {
+                        copy[j] = items[j];
+                        if (copy[j].type == PT_OBJECT) {
+                            copy[j].d.ptr = session_object(gd, items[j].d.ptr);
+                        }
+                    }
+                    prop->value.d.ptr = copy;
+                } else {
+                    prop->flags |= PF_SHARED;
+                }
+            }
+            if (last) {
+                last->next = prop;
+            } else {
+                obj->properties = prop;
+            }
+            last = prop;
+        }
+    }
+    gd->root = session_object(gd, prog->root);
+
+    gd->gameinfo = object_get_by_ident(gd, "gameinfo");
+    if (!gd->gameinfo) {
+        text_out("FATAL: no gameinfo object\n");
+        session_free(gd);
+        return NULL;
+    }
+
+    property_t *player_prop = object_property_get(gd->gameinfo, property_number(prog, "#player"));
+    if (!player_prop || player_prop->value.type != PT_OBJECT || !player_prop->value.d.ptr) {
+        text_out("FATAL: gameinfo does not define valid initial player object\n");
+        session_free(gd);
+        return NULL;
+    }
+    gd->player = player_prop->value.d.ptr;
     return gd;
 }
 
+void session_free(gamedata_t *gd) {
+    for (int i = 0; i < gd->program->object_count; ++i) {
+        property_t *cur = gd->objects[i]->properties;
+        while (cur) {
+            property_t *next = cur->next;
+            property_free(cur);
+            cur = next;
+        }
+    }
+    scheduler_session_release(gd);
+    reload_session_remove(gd);
+    if (gd->suspended_input) {
+        input_free(gd->suspended_input);
+    }
+    vm_stack_free(gd);
+    profile_free(gd);
+    free(gd->object_block);
+    free(gd->objects);
+    free(gd);
+}
+
+/**
+Translate an object from the program's template world (such as one stored in
+the symbol table or grammar) into the matching object in a session.
+*/
+object_t *session_object(gamedata_t *gd, object_t *template_obj) {
+    if (!template_obj) return NULL;
+    return gd->objects[template_obj->id];
+}
+
 unsigned hash_string(const char *text) {
     unsigned hash = 0x811c9dc5;
     size_t len = strlen(text);
@@ -35,6 +190,10 @@ void symboltable_free(symboltable_t *table) {
         symbol_t *cur = table->buckets[i], *next;
         while (cur) {
             next = cur->next;
+            if (cur->type == SYM_VALUE) {
+                value_free(*(svalue_t*)cur->d.ptr);
+                free(cur->d.ptr);
+            }
             free(cur->name);
             free(cur);
             cur = next;
@@ -44,33 +203,43 @@ void symboltable_free(symboltable_t *table) {
 }
 
 object_t *object_get_by_ident(gamedata_t *gd, const char *ident) {
-    symbol_t *symbol = symbol_get(gd->symbols, ident);
+    return session_object(gd, program_object_by_ident(gd->program, ident));
+}
+
+object_t *program_object_by_ident(program_t *prog, const char *ident) {
+    symbol_t *symbol = symbol_get(prog->symbols, ident);
     if (symbol && symbol->type == SYM_OBJECT) {
         return symbol->d.ptr;
     }
     return NULL;
 }
 
-int property_number(gamedata_t *gd, const char *name) {
-    static int next_id = 1;
-    symbol_t *symbol = symbol_get(gd->symbols, name);
-    if (!symbol && !gd->game_loaded) {
+/**
+Look up the number of a property. While the game is loading, unknown
+property names are assigned a new number; once loading is complete the
+symbol table is shared between sessions and is never modified.
+
+Returns the property number, or 0 if the property does not exist.
+*/
+int property_number(program_t *prog, const char *name) {
+    symbol_t *symbol = symbol_get(prog->symbols, name);
+    if (!symbol && !prog->game_loaded) {
         symbol = calloc(sizeof(symbol_t), 1);
         symbol->name = str_dupl(name);
         symbol->type = SYM_PROPERTY;
-        symbol->d.value = next_id++;
-        symbol_add_core(gd->symbols, symbol);
+        symbol->d.value = prog->next_property_id++;
+        symbol_add_core(prog->symbols, symbol);
     }
 
-    return symbol->d.value;
+    return symbol ? symbol->d.value : 0;
 }
 
-void add_builtin_property(gamedata_t *gd, const char *name, int pid) {
+void add_builtin_property(program_t *prog, const char *name, int pid) {
     symbol_t *symbol = calloc(sizeof(symbol_t), 1);
     symbol->name = str_dupl(name);
     symbol->type = SYM_PROPERTY;
     symbol->d.value = pid;
-    symbol_add_core(gd->symbols, symbol);
+    symbol_add_core(prog->symbols, symbol);
 }
 
 char *str_dupl(const char *text) {
@@ -96,7 +265,7 @@ void symbol_add_core(symboltable_t *table, symbol_t *symbol) {
 }
 
 void symbol_add_ptr(symboltable_t *table, const char *name, int type, void *value) {
-    symbol_t *symbol = calloc(sizeof(gamedata_t), 1);
+    symbol_t *symbol = calloc(sizeof(symbol_t), 1);
     symbol->name = str_dupl(name);
     symbol->type = type;
     symbol->d.ptr = value;
@@ -105,7 +274,7 @@ void symbol_add_ptr(symboltable_t *table, const char *name, int type, void *valu
 }
 
 void symbol_add_value(symboltable_t *table, const char *name, int type, int value) {
-    symbol_t *symbol = calloc(sizeof(gamedata_t), 1);
+    symbol_t *symbol = calloc(sizeof(symbol_t), 1);
     symbol->name = str_dupl(name);
     symbol->type = type;
     symbol->d.value = value;
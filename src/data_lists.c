@@ -3,6 +3,11 @@
 
 #include "parse.h"
 
+/* Allocations made for list nodes and their strings by the current thread.
+ * Sessions run on worker threads, so keeping these per thread lets a
+ * benchmark or profiler read them without locking. */
+__thread alloc_counts_t list_allocs;
+
 const char *symbol_types[] = {
     "object",
     "property",
@@ -11,20 +16,20 @@ const char *symbol_types[] = {
 };
 
 
-void dump_tokens(FILE *dest, token_t *tokens) {
-    token_t *cur = tokens;
-    while (cur) {
+void dump_tokens(FILE *dest, token_buffer_t *buffer) {
+    for (size_t i = 0; i < buffer->count; ++i) {
+        token_t *cur = &buffer->tokens[i];
+        const char *text = token_text(buffer, cur);
         fprintf(dest, "%d: ", cur->type);
         if (cur->type == T_STRING)
-            fprintf(dest, "~%s~", cur->text);
+            fprintf(dest, "~%.*s~", (int)cur->length, text);
         if (cur->type == T_ATOM)
-            fprintf(dest, "=%s=", cur->text);
+            fprintf(dest, "=%.*s=", (int)cur->length, text);
         if (cur->type == T_INTEGER)
             fprintf(dest, "%d", cur->number);
         if (cur->type == T_VOCAB)
-            fprintf(dest, "<%s>", cur->text);
-        fprintf(dest, " (%p - %p - %p)\n", (void*)cur->prev, (void*)cur, (void*)cur->next);
-        cur = cur->next;
+            fprintf(dest, "<%.*s>", (int)cur->length, text);
+        fprintf(dest, " (at %u)\n", cur->offset);
     }
 }
 
@@ -75,20 +80,21 @@ void dump_list(FILE *dest, list_t *list) {
  * Token manipulation
  * ****************************************************************************/
 
-void token_free(token_t *token) {
-    if (token->type == T_STRING || token->type == T_ATOM) {
-        free(token->text);
-    }
-    free(token);
+/**
+Get the start of a token's text in its buffer's source. Only strings and
+vocabulary words are zero terminated; use the token's length for atoms.
+*/
+const char *token_text(token_buffer_t *buffer, token_t *token) {
+    return buffer->source + token->offset;
 }
 
-void token_freelist(token_t *tokens) {
-    token_t *token = tokens;
-    while (token) {
-        token_t *next = token->next;
-        token_free(token);
-        token = next;
-    }
+/**
+Free a token buffer. The source it was read from belongs to the caller.
+*/
+void token_buffer_free(token_buffer_t *buffer) {
+    if (!buffer) return;
+    free(buffer->tokens);
+    free(buffer);
 }
 
 
@@ -106,12 +112,14 @@ void list_add(list_t *list, list_t *item) {
 }
 
 list_t *list_create() {
+    ++list_allocs.nodes;
     list_t *list = calloc(sizeof(list_t), 1);
     list->type = T_LIST;
     return list;
 }
 
 list_t *list_create_bool(int value) {
+    ++list_allocs.nodes;
     list_t *list = calloc(sizeof(list_t), 1);
     list->type = T_INTEGER;
     list->number = value ? 1 : 0;
@@ -119,6 +127,7 @@ list_t *list_create_bool(int value) {
 }
 
 list_t *list_create_false() {
+    ++list_allocs.nodes;
     list_t *list = calloc(sizeof(list_t), 1);
     list->type = T_INTEGER;
     list->number = 0;
@@ -126,6 +135,8 @@ list_t *list_create_false() {
 }
 
 list_t *list_create_string(const char *text) {
+    ++list_allocs.nodes;
+    ++list_allocs.strings;
     list_t *list = calloc(sizeof(list_t), 1);
     list->type = T_STRING;
     list->text = str_dupl(text);
@@ -133,6 +144,7 @@ list_t *list_create_string(const char *text) {
 }
 
 list_t *list_create_true() {
+    ++list_allocs.nodes;
     list_t *list = calloc(sizeof(list_t), 1);
     list->type = T_INTEGER;
     list->number = 1;
@@ -159,6 +171,7 @@ list_t *list_duplicate(list_t *old_list) {
             break;
         case T_STRING:
         case T_ATOM:
+            ++list_allocs.strings;
             new_list->text = str_dupl(old_list->text);
             break;
         case T_VOCAB:
@@ -229,3 +242,150 @@ int list_is_true(list_t *list) {
             return FALSE;
     }
 }
+
+
+/* ****************************************************************************
+ * Script values
+ * ****************************************************************************/
+svalue_t value_int(int number) {
+    svalue_t value;
+    value.type = T_INTEGER;
+    value.d.number = number;
+    return value;
+}
+
+svalue_t value_bool(int is_true) {
+    return value_int(is_true ? 1 : 0);
+}
+
+svalue_t value_false() {
+    return value_int(0);
+}
+
+svalue_t value_true() {
+    return value_int(1);
+}
+
+svalue_t value_object(object_t *object) {
+    svalue_t value;
+    value.type = T_OBJECT_REF;
+    value.d.ptr = object;
+    return value;
+}
+
+svalue_t value_function(function_t *function) {
+    svalue_t value;
+    value.type = T_FUNCTION_REF;
+    value.d.ptr = function;
+    return value;
+}
+
+svalue_t value_string(const char *text) {
+    return value_list(list_create_string(text));
+}
+
+/**
+Wrap a new heap node in a value. The value takes ownership of the node.
+*/
+svalue_t value_list(list_t *list) {
+    svalue_t value;
+    value.type = list->type;
+    value.d.list = list;
+    list->refs = 1;
+    return value;
+}
+
+/**
+Create a value for a node without copying it. Numbers and references are
+held in the value itself; anything else borrows the node, which must
+outlive the value.
+*/
+svalue_t value_from_list(list_t *list) {
+    svalue_t value;
+    switch(list->type) {
+        case T_INTEGER:
+            return value_int(list->number);
+        case T_OBJECT_REF:
+            return value_object(list->ptr);
+        case T_FUNCTION_REF:
+            return value_function(list->ptr);
+        default:
+            value.type = list->type;
+            value.d.list = list;
+            return value;
+    }
+}
+
+/**
+Create a new node holding a copy of a value, for storing it in a list.
+*/
+list_t *value_to_list(svalue_t value) {
+    list_t *list;
+    switch(value.type) {
+        case T_INTEGER:
+            list = list_create();
+            list->type = T_INTEGER;
+            list->number = value.d.number;
+            return list;
+        case T_OBJECT_REF:
+        case T_FUNCTION_REF:
+            list = list_create();
+            list->type = value.type;
+            list->ptr = value.d.ptr;
+            return list;
+        default:
+            return list_duplicate(value.d.list);
+    }
+}
+
+int value_is_heap(svalue_t value) {
+    return value.type != T_INTEGER && value.type != T_OBJECT_REF
+        && value.type != T_FUNCTION_REF;
+}
+
+/**
+Make another reference to a value. Values are immutable, so this never
+copies; shared heap nodes have their reference count increased.
+*/
+svalue_t value_copy(svalue_t value) {
+    if (value_is_heap(value) && value.d.list->refs > 0) {
+        ++value.d.list->refs;
+    }
+    return value;
+}
+
+void value_free(svalue_t value) {
+    if (value_is_heap(value) && value.d.list->refs > 0) {
+        if (--value.d.list->refs == 0) {
+            list_free(value.d.list);
+        }
+    }
+}
+
+int value_is_true(svalue_t value) {
+    switch(value.type) {
+        case T_INTEGER:
+            return value.d.number != 0;
+        case T_OBJECT_REF:
+        case T_FUNCTION_REF:
+            return TRUE;
+        default:
+            return list_is_true(value.d.list);
+    }
+}
+
+void dump_value(FILE *dest, svalue_t value) {
+    switch(value.type) {
+        case T_INTEGER:
+            fprintf(dest, "%d", value.d.number);
+            break;
+        case T_OBJECT_REF:
+            fprintf(dest, "object@%p", value.d.ptr);
+            break;
+        case T_FUNCTION_REF:
+            fprintf(dest, "function@%p", value.d.ptr);
+            break;
+        default:
+            dump_list(dest, value.d.list);
+    }
+}
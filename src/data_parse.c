@@ -1,34 +1,89 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "parse.h"
 
+/* Threads used to load source files, or 0 for one per processor. */
+int load_threads = 0;
+/* The manifest listing the game's source files. */
+const char *load_manifest = "game.manifest";
+/* Where to cache images of loaded games, or NULL for no cache. */
+const char *load_cache_dir = NULL;
+/* How long the phases of the last load took. */
+load_times_t load_times;
+
+/* Source files waiting to be loaded by a pool of threads. Each file is
+ * loaded into a program of its own, its "unit", so that the threads share
+ * nothing; the units are merged into the real program afterwards, in file
+ * order. */
+typedef struct LOAD_JOB {
+    const char **filelist;
+    program_t **units;
+    uint64_t *hashes;   /* of each file as it was read, if wanted */
+    int file_count;
+    int next_file;
+    pthread_mutex_t lock;
+} load_job_t;
+
+/* A name in a loaded object that fix_references still has to resolve. */
+#define LINK_PARENT     0
+#define LINK_PROTOTYPE  1
+#define LINK_VALUE      2
+typedef struct LINK_REF {
+    const char *name;
+    object_t *owner;    /* the object the name was found in */
+    value_t *value;     /* the value to patch, for LINK_VALUE */
+    int kind;
+    int order;          /* position in the table, to keep the sort stable */
+} link_ref_t;
 
-// tokenizing
-token_t *tokenize_source(char *file, int allow_new_vocab);
+typedef struct LINK_TABLE {
+    link_ref_t *refs;
+    int count, capacity;
+} link_table_t;
 
-// parsing
-static int parse_action(gamedata_t *gd, list_t *list);
-static list_t* parse_list(token_t **place);
-static int parse_object(gamedata_t *gd, list_t *list);
 
-static list_t* parse_file(const char *filename);
-static list_t *parse_tokens_to_lists(token_t *tokens);
-static int parse_lists_toplevel(gamedata_t *gd, list_t *lists);
-static int fix_references(gamedata_t *gd);
+static char *token_copy(lexer_t *lex);
+static int token_is(lexer_t *lex, const char *text);
+static list_t *parse_value(lexer_t *lex);
+static list_t *parse_list(lexer_t *lex);
+
+static int load_action(program_t *prog, lexer_t *lex);
+static int load_constant(program_t *prog, lexer_t *lex);
+static int load_function(program_t *prog, lexer_t *lex);
+static int load_object(program_t *prog, lexer_t *lex);
+static int load_property(object_t *obj, int p_num, lexer_t *lex);
+static int load_form(program_t *prog, lexer_t *lex);
+static int load_forms(program_t *prog, lexer_t *lex);
+static double load_clock();
+static void *load_worker(void *data);
+static void merge_unit(program_t *prog, program_t *unit, source_file_t *source);
+static int fix_references(program_t *prog);
+static void link_add(link_table_t *table, const char *name, object_t *owner,
+                     value_t *value, int kind);
+static void link_value(program_t *prog, link_table_t *table, object_t *owner, value_t *value);
+static int link_ref_compare(const void *a, const void *b);
+static int link_symbol_compare(const void *a, const void *b);
+static int link_patch(program_t *prog, link_ref_t *ref, symbol_t *symbol);
+static void link_tree(program_t *prog);
 
 
 /* ****************************************************************************
  * Dumping data to a stream (for debugging)
  * ****************************************************************************/
-void dump_symbol_table(FILE *fp, gamedata_t *gd) {
+void dump_symbol_table(FILE *fp, program_t *prog) {
     fprintf(fp, "======================================================\n");
     fprintf(fp, "Symbol Name                       Type      Value\n");
     fprintf(fp, "------------------------------------------------------\n");
     for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
-        symbol_t *symbol = gd->symbols->buckets[i];
+        symbol_t *symbol = prog->symbols->buckets[i];
         while (symbol) {
             fprintf(fp, "%-32s  %-8s  %p\n", symbol->name, symbol_types[symbol->type], symbol->d.ptr);
             symbol = symbol->next;
@@ -39,77 +94,143 @@ void dump_symbol_table(FILE *fp, gamedata_t *gd) {
 
 
 /* ****************************************************************************
- * Parse functions
+ * Reading tokens
  * ****************************************************************************/
-int parse_action(gamedata_t *gd, list_t *list) {
-    if (list->type != T_LIST || list->child == NULL || list->child->type != T_ATOM
-            || strcmp(list->child->text,"action") || list->child->next == NULL) {
-        return 0;
+
+/* Copy the text of the current token into a new string. */
+char *token_copy(lexer_t *lex) {
+    return str_dupl_left(lex->source + lex->token.offset, lex->token.length);
+}
+
+/* Returns true if the current token's text is exactly text. */
+int token_is(lexer_t *lex, const char *text) {
+    return strlen(text) == lex->token.length
+        && memcmp(lex->source + lex->token.offset, text, lex->token.length) == 0;
+}
+
+/* Read one value, either a single token or a whole list, starting at the
+ * current token. */
+list_t *parse_value(lexer_t *lex) {
+    token_t *cur = &lex->token;
+    if (cur->type == T_OPEN) {
+        return parse_list(lex);
+    }
+    if (cur->type == T_END) {
+        text_out("Unexpected end of tokens\n");
+        return NULL;
+    }
+    if (cur->type == T_CLOSE) {
+        text_out("Unexpected ')'\n");
+        return NULL;
     }
 
-    list_t *cur = list->child->next;
-    action_t *act = calloc(sizeof(action_t), 1);
-    if (cur->type == T_ATOM) {
-        act->action_code = 0;
-        act->action_name = str_dupl(cur->text);
+    list_t *item = list_create();
+    item->type = cur->type;
+    if (cur->type == T_INTEGER) {
+        item->number = cur->number;
     } else {
+        item->text = token_copy(lex);
+    }
+    lexer_next(lex);
+    return item;
+}
+
+list_t* parse_list(lexer_t *lex) {
+    if (lex->token.type != T_OPEN) {
+        text_out("Expected '('\n");
+        return NULL;
+    }
+    lexer_next(lex);
+
+    list_t *list = list_create();
+    while (lex->token.type != T_CLOSE) {
+        list_t *item = parse_value(lex);
+        if (!item) {
+            list_free(list);
+            return NULL;
+        }
+        list_add(list, item);
+    }
+    lexer_next(lex);
+    return list;
+}
+
+
+/* ****************************************************************************
+ * Loading top level forms
+ *
+ * Each form is built straight into the program as its tokens are read. The
+ * loaders below are called with the token after the form's keyword current
+ * and stop at the form's closing bracket, which load_form checks for.
+ * ****************************************************************************/
+int load_action(program_t *prog, lexer_t *lex) {
+    if (lex->token.type != T_ATOM) {
         text_out("Action number must be atom.\n");
         return 0;
     }
+    action_t *act = calloc(sizeof(action_t), 1);
+    act->action_code = 0;
+    act->action_name = token_copy(lex);
+    lexer_next(lex);
 
-    cur = cur->next;
-    if (!cur) {
+    if (lex->token.type == T_CLOSE) {
         text_out("Action has no grammar.\n");
         return 0;
     }
 
     int pos = 0;
-    list_t *sub;
-    while (cur) {
-        switch(cur->type) {
+    while (lex->token.type != T_CLOSE && lex->token.type != T_END) {
+        if (pos >= GT_MAX_TOKENS) {
+            text_out("Action grammar may have at most %d tokens.\n", GT_MAX_TOKENS);
+            return 0;
+        }
+        switch(lex->token.type) {
             case T_VOCAB:
                 act->grammar[pos].type = GT_WORD;
-                act->grammar[pos].ptr = str_dupl(cur->text);
+                act->grammar[pos].ptr = token_copy(lex);
                 ++pos;
                 break;
             case T_ATOM:
-                if (strcmp(cur->text, "noun") == 0) {
+                if (token_is(lex, "noun")) {
                     act->grammar[pos].type = GT_NOUN;
                     ++pos;
-                } else if (strcmp(cur->text, "any") == 0) {
+                } else if (token_is(lex, "any")) {
                     act->grammar[pos].type = GT_ANY;
                     ++pos;
-                } else if (strcmp(cur->text, "scope") == 0) {
+                } else if (token_is(lex, "scope")) {
                     act->grammar[pos].type = GT_SCOPE;
-                    cur = cur->next;
-                    if (!cur || cur->type != T_ATOM) {
+                    lexer_next(lex);
+                    if (lex->token.type != T_ATOM) {
                         text_out("scope grammar token must be followed by object name.\n");
                         return 0;
                     }
-                    act->grammar[pos].ptr = str_dupl(cur->text);
+                    act->grammar[pos].ptr = token_copy(lex);
                     ++pos;
                 } else {
-                    text_out("Unrecognized grammar token '%s'.\n", cur->text);
+                    text_out("Unrecognized grammar token '%.*s'.\n",
+                             (int)lex->token.length, lex->source + lex->token.offset);
                     return 0;
                 }
                 break;
-            case T_LIST:
-                sub = cur->child;
-                while (sub) {
-                    switch (sub->type) {
-                        case T_VOCAB:
-                            act->grammar[pos].type = GT_WORD;
-                            act->grammar[pos].ptr = str_dupl(sub->text);
-                            if (sub->next) {
-                                act->grammar[pos].flags |= GF_ALT;
-                            }
-                            ++pos;
-                            break;
-                        default:
-                            text_out("Only vocab values permitted in action sub-statement. (%d)\n", sub->type);
-                            return 0;
+            case T_OPEN:
+                lexer_next(lex);
+                while (lex->token.type != T_CLOSE) {
+                    if (lex->token.type != T_VOCAB) {
+                        text_out("Only vocab values permitted in action sub-statement. (%d)\n",
+                                 lex->token.type);
+                        return 0;
+                    }
+                    if (pos >= GT_MAX_TOKENS) {
+                        text_out("Action grammar may have at most %d tokens.\n", GT_MAX_TOKENS);
+                        return 0;
+                    }
+                    act->grammar[pos].type = GT_WORD;
+                    act->grammar[pos].ptr = token_copy(lex);
+                    lexer_next(lex);
+                    if (lex->token.type != T_CLOSE) {
+                        act->grammar[pos].flags |= GF_ALT;
                     }
-                    sub = sub->next;
+                    ++pos;
                 }
                 break;
             case T_STRING:
@@ -117,480 +238,918 @@ int parse_action(gamedata_t *gd, list_t *list) {
                 text_out("Integer and string values not permitted in action statement.\n");
                 return 0;
             default:
-                text_out("Bad token type %d in action definition.\n", cur->type);
+                text_out("Bad token type %d in action definition.\n", lex->token.type);
         }
-        cur = cur->next;
+        lexer_next(lex);
     }
-    action_add(gd, act);
+    action_add(prog, act);
 
     return 1;
 }
 
-int parse_constant(gamedata_t *gd, list_t *list) {
-    if (list->type != T_LIST || list->child == NULL || list->child->type != T_ATOM
-            || strcmp(list->child->text,"constant") || list->child->next == NULL) {
-        return 0;
-    }
-
-    list_t *cur = list->child->next;
-    if (cur->type != T_ATOM) {
+int load_constant(program_t *prog, lexer_t *lex) {
+    if (lex->token.type != T_ATOM) {
         text_out("Constant name must be atom.\n");
         return 0;
     }
-    char *name = cur->text;
-    cur = cur->next;
-    if (!cur) {
+    char *name = token_copy(lex);
+    lexer_next(lex);
+    if (lex->token.type == T_CLOSE) {
         text_out("Constant has no value.\n");
+        free(name);
         return 0;
     }
-    if (cur->next) {
-        text_out("Constant may have only one value.\n");
+    if (lex->token.type != T_INTEGER) {
+        text_out("Constant has unsupported value type.\n");
+        free(name);
         return 0;
     }
-    switch(cur->type) {
-        case T_INTEGER:
-            symbol_add_value(gd->symbols, name, SYM_CONSTANT, cur->number);
-            break;
-        default:
-            text_out("Constant has unsopported value tyoe.\n");
+    symbol_add_value(prog->symbols, name, SYM_CONSTANT, lex->token.number);
+    free(name);
+    lexer_next(lex);
+    if (lex->token.type != T_CLOSE) {
+        text_out("Constant may have only one value.\n");
+        return 0;
     }
 
     return 1;
 }
 
-list_t* parse_list(token_t **place) {
-    token_t *cur = *place;
-
-    if (cur->type != T_OPEN) {
-        text_out("Expected '('\n");
-        return NULL;
-    }
-    cur = cur->next;
-
-    list_t *list = list_create();
-    while (cur && cur->type != T_CLOSE) {
-        if (cur->type == T_OPEN) {
-            list_t *sublist = parse_list(&cur);
-            list_add(list, sublist);
-        } else {
-            if (cur->type == T_INTEGER) {
-                list_t *item = calloc(sizeof(list_t), 1);
-                item->type = T_INTEGER;
-                item->number = cur->number;
-                list_add(list, item);
-            } else if (cur->type == T_ATOM) {
-                list_t *item = calloc(sizeof(list_t), 1);
-                item->type = T_ATOM;
-                item->text = str_dupl(cur->text);
-                list_add(list, item);
-            } else if (cur->type == T_STRING) {
-                list_t *item = calloc(sizeof(list_t), 1);
-                item->type = T_STRING;
-                item->text = str_dupl(cur->text);
-                list_add(list, item);
-            } else if (cur->type == T_VOCAB) {
-                list_t *item = calloc(sizeof(list_t), 1);
-                item->type = T_VOCAB;
-                item->text = str_dupl(cur->text);
-                list_add(list, item);
-            }
-            cur = cur->next;
-        }
-
-    }
-    if (cur == NULL) {
-        text_out("Unexpected end of tokens\n");
-        *place = cur;
-        return NULL;
-    }
-    cur = cur->next;
-
-    *place = cur;
-    return list;
-}
-
-int parse_function(gamedata_t *gd, list_t *list) {
-    if (list->type != T_LIST || list->child == NULL || list->child->type != T_ATOM
-            || strcmp(list->child->text,"function") || list->child->next == NULL) {
-        return 0;
-    }
-
-    list_t *cur = list->child->next;
-    function_t *func = calloc(sizeof(function_t), 1);
-    if (cur->type != T_ATOM) {
+int load_function(program_t *prog, lexer_t *lex) {
+    if (lex->token.type != T_ATOM) {
         text_out("Function name must be atom.\n");
         return 0;
     }
-    func->name = str_dupl(cur->text);
-    symbol_add_ptr(gd->symbols, func->name, SYM_FUNCTION, (void*)func);
+    function_t *func = calloc(sizeof(function_t), 1);
+    func->id = prog->function_count++;
+    func->name = token_copy(lex);
+    symbol_add_ptr(prog->symbols, func->name, SYM_FUNCTION, (void*)func);
+    lexer_next(lex);
 
-    cur = cur->next;
-    if (!cur || cur->type != T_LIST) {
+    if (lex->token.type != T_OPEN) {
         text_out("Function has no argument list. (Use empty list if no arguments.)\n");
         return 0;
     }
-    list_t *c_arg = cur->child;
-    while (c_arg) {
+    func->arg_list = parse_list(lex);
+    if (!func->arg_list) {
+        return 0;
+    }
+    for (list_t *c_arg = func->arg_list->child; c_arg; c_arg = c_arg->next) {
         if (c_arg->type != T_ATOM) {
-            text_out("parse_function: arguments to function %s must be atoms.\n", func->name);
+            text_out("load_function: arguments to function %s must be atoms.\n", func->name);
         }
-        c_arg = c_arg->next;
     }
-    func->arg_list = list_duplicate(cur);
 
-    cur = cur->next;
-    func->body = list_duplicate(cur);
+    if (lex->token.type != T_CLOSE) {
+        func->body = parse_value(lex);
+        if (!func->body) {
+            return 0;
+        }
+    }
+    if (lex->token.type != T_CLOSE) {
+        text_out("Function %s may have only one body.\n", func->name);
+        return 0;
+    }
     return 1;
 }
 
 #define MAX_PROPERTY_NAME 64
-int parse_object(gamedata_t *gd, list_t *list) {
-    if (list->type != T_LIST || list->child == NULL || list->child->type != T_ATOM
-            || strcmp(list->child->text,"object")) {
-        return 0;
+int load_object(program_t *prog, lexer_t *lex) {
+    char *names[3];     /* prototype, name and parent */
+    for (int i = 0; i < 3; ++i) {
+        if (lex->token.type != T_ATOM) {
+            text_out("Object prototype, name, and parent must be atom.\n");
+            while (i > 0) free(names[--i]);
+            return 0;
+        }
+        names[i] = token_is(lex, "-") ? NULL : token_copy(lex);
+        lexer_next(lex);
     }
 
-    object_t *obj = object_create(gd->root);
-    list_t *prototype_name = list->child->next;
-    list_t *prop = prototype_name->next;
-    list_t *val  = prop->next;
-    if (prototype_name->type != T_ATOM || prop->type != T_ATOM || val->type != T_ATOM) {
-        text_out("Object prototype, name, and parent must be atom.\n");
-        return 0;
-    }
-    if (strcmp(prototype_name->text, "-") != 0) {
-        obj->prototype_name = str_dupl(prototype_name->text);
-    }
-    if (strcmp(prop->text, "-") != 0) {
-        object_property_add_string(obj, OBJPROP_INTERNAL_NAME, str_dupl(prop->text));
-        symbol_add_ptr(gd->symbols, prop->text, SYM_OBJECT, obj);
+    object_t *obj = object_create(prog, prog->root);
+    obj->prototype_name = names[0];
+    if (names[1]) {
+        object_property_add_string(obj, OBJPROP_INTERNAL_NAME, names[1]);
+        symbol_add_ptr(prog->symbols, names[1], SYM_OBJECT, obj);
     }
-    if (strcmp(val->text, "-") != 0) {
-        obj->parent_name = str_dupl(val->text);
-    }
-    prop = val->next;
+    obj->parent_name = names[2];
 
-    if (prop) val = prop->next;
     char full_prop_name[MAX_PROPERTY_NAME] = { '#' };
-    while (prop) {
-        if (val == NULL) {
+    while (lex->token.type != T_CLOSE && lex->token.type != T_END) {
+        if (lex->token.type != T_ATOM) {
+            text_out("Property name must be atom.\n");
+            return 0;
+        }
+        size_t length = lex->token.length;
+        if (length > MAX_PROPERTY_NAME - 2) {
+            length = MAX_PROPERTY_NAME - 2;
+        }
+        memcpy(&full_prop_name[1], lex->source + lex->token.offset, length);
+        full_prop_name[length + 1] = 0;
+        lexer_next(lex);
+
+        if (lex->token.type == T_CLOSE || lex->token.type == T_END) {
             text_out("Found property without value.\n");
             return 0;
         }
-        if (prop->type != T_ATOM) {
-            text_out("Property name must be atom.\n");
+        if (!load_property(obj, property_number(prog, full_prop_name), lex)) {
             return 0;
         }
+    }
+
+    return 1;
+}
 
-        strncpy(&full_prop_name[1], prop->text, MAX_PROPERTY_NAME-2);
-        int p_num = property_number(gd, full_prop_name);
-        if (val->type == T_STRING) {
-            object_property_add_string(obj, p_num, str_dupl(val->text));
-        } else if (val->type == T_ATOM) {
-            object_property_add_string(obj, p_num, str_dupl(val->text));
-            property_t *p = object_property_get(obj, p_num);
+/* Read a property's value, a single token or a list of them, and add it to
+ * an object. Names and vocabulary words are kept as text until
+ * fix_references. */
+int load_property(object_t *obj, int p_num, lexer_t *lex) {
+    property_t *p;
+    switch (lex->token.type) {
+        case T_STRING:
+            object_property_add_string(obj, p_num, token_copy(lex));
+            break;
+        case T_ATOM:
+            object_property_add_string(obj, p_num, token_copy(lex));
+            p = object_property_get(obj, p_num);
             p->value.type = PT_TMPNAME;
-        } else if (val->type == T_VOCAB) {
-            object_property_add_string(obj, p_num, str_dupl(val->text));
-            property_t *p = object_property_get(obj, p_num);
+            break;
+        case T_VOCAB:
+            object_property_add_string(obj, p_num, token_copy(lex));
+            p = object_property_get(obj, p_num);
             p->value.type = PT_TMPVOCAB;
-        } else if (val->type == T_INTEGER) {
-            object_property_add_integer(obj, p_num, val->number);
-        } else if (val->type == T_LIST) {
-            object_property_add_array(obj, p_num, list_size(val));
-            property_t *p = object_property_get(obj, p_num);
-            value_t *arr = p->value.d.ptr;
-            list_t *cur = val->child;
-            int counter = 0;
-            while (cur) {
-                switch(cur->type) {
+            break;
+        case T_INTEGER:
+            object_property_add_integer(obj, p_num, lex->token.number);
+            break;
+        case T_OPEN: {
+            /* the size isn't known until the closing bracket, so gather the
+             * items first */
+            value_t items[16], *arr = items;
+            int count = 0, capacity = 16;
+            lexer_next(lex);
+            while (lex->token.type != T_CLOSE) {
+                if (lex->token.type == T_END) {
+                    text_out("Unexpected end of tokens\n");
+                    if (arr != items) free(arr);
+                    return 0;
+                }
+                if (lex->token.type == T_OPEN) {
+                    text_out("Nested lists are not permitted in object properties.\n");
+                    list_free(parse_list(lex));
+                    continue;
+                }
+                if (count >= capacity) {
+                    capacity *= 2;
+                    if (arr == items) {
+                        arr = malloc(sizeof(value_t) * capacity);
+                        memcpy(arr, items, sizeof(items));
+                    } else {
+                        arr = realloc(arr, sizeof(value_t) * capacity);
+                    }
+                }
+                value_t *val = &arr[count++];
+                memset(val, 0, sizeof(value_t));
+                switch (lex->token.type) {
                     case T_INTEGER:
-                        arr[counter].type = PT_INTEGER;
-                        arr[counter].d.num = cur->number;
+                        val->type = PT_INTEGER;
+                        val->d.num = lex->token.number;
                         break;
                     case T_VOCAB:
-                        arr[counter].type = PT_TMPVOCAB;
-                        arr[counter].d.ptr = str_dupl(cur->text);
+                        val->type = PT_TMPVOCAB;
+                        val->d.ptr = token_copy(lex);
                         break;
                     case T_STRING:
-                        arr[counter].type = PT_STRING;
-                        arr[counter].d.ptr = str_dupl(cur->text);
+                        val->type = PT_STRING;
+                        val->d.ptr = token_copy(lex);
                         break;
                     case T_ATOM:
-                        arr[counter].type = PT_TMPNAME;
-                        arr[counter].d.ptr = str_dupl(cur->text);
-                        break;
-                    case T_LIST:
-                        text_out("Nested lists are not permitted in object properties.\n");
+                        val->type = PT_TMPNAME;
+                        val->d.ptr = token_copy(lex);
                         break;
                     default:
-                        text_out("WARNING: unhandled array value type %d.\n", cur->type);
+                        text_out("WARNING: unhandled array value type %d.\n", lex->token.type);
                 }
-                ++counter;
-                cur = cur->next;
+                lexer_next(lex);
             }
-        } else {
-            text_out("WARNING: unhandled property type %d.\n", val->type);
-        }
+            object_property_add_array(obj, p_num, count);
+            p = object_property_get(obj, p_num);
+            memcpy(p->value.d.ptr, arr, sizeof(value_t) * count);
+            if (arr != items) free(arr);
+            break; }
+        default:
+            text_out("WARNING: unhandled property type %d.\n", lex->token.type);
+    }
+    lexer_next(lex);
+    return 1;
+}
 
-        prop = val->next;
-        if (prop) {
-            val = prop->next;
-        } else {
-            val = NULL;
-        }
+int load_form(program_t *prog, lexer_t *lex) {
+    if (lex->token.type != T_OPEN) {
+        debug_out("load_form: expected list at top level.\n");
+        return 0;
+    }
+    lexer_next(lex);
+    if (lex->token.type == T_CLOSE) {
+        debug_out("load_form: empty list found at top level.\n");
+        return 0;
+    }
+    if (lex->token.type != T_ATOM) {
+        debug_out("load_form: list must start with atom.\n");
+        return 0;
     }
 
+    int (*loader)(program_t*, lexer_t*);
+    if (token_is(lex, "object")) {
+        loader = load_object;
+    } else if (token_is(lex, "action")) {
+        loader = load_action;
+    } else if (token_is(lex, "constant")) {
+        loader = load_constant;
+    } else if (token_is(lex, "function")) {
+        loader = load_function;
+    } else {
+        debug_out("load_form: unknown top level construct %.*s.\n",
+                  (int)lex->token.length, lex->source + lex->token.offset);
+        return 0;
+    }
+    lexer_next(lex);
+    if (!loader(prog, lex)) {
+        return 0;
+    }
+
+    if (lex->token.type != T_CLOSE) {
+        text_out("Unexpected end of tokens\n");
+        return 0;
+    }
+    lexer_next(lex);
     return 1;
 }
 
+int load_forms(program_t *prog, lexer_t *lex) {
+    lexer_next(lex);
+    while (lex->token.type != T_END) {
+        if (!load_form(prog, lex)) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-/* ****************************************************************************
- * Parsing source files
- * ****************************************************************************/
-token_t *master_token_list = NULL;
+/**
+Load the forms in a piece of source text into a program that has already
+been loaded. Vocabulary words must already be known; the program's
+functions are not optimized or compiled again.
+
+Returns true on success and false if the text could not be loaded.
+*/
+int load_source(program_t *prog, const char *text) {
+    lexer_t lex;
+    char *work_text = str_dupl(text);
+    lexer_init(&lex, prog->vocab, work_text, 0);
+    int success = load_forms(prog, &lex);
+    free(work_text);
+    return success;
+}
+
+/**
+Load the forms in a source file into a program that is still being loaded.
+The file is read a chunk at a time as it is lexed, so it is never held in
+memory all at once. If hash is not NULL, it is set to the hash_bytes of the
+contents that were read, which on success is the whole file as loaded.
+
+Returns true on success and false if the file could not be read or loaded.
+*/
+int load_file(program_t *prog, const char *filename, uint64_t *hash) {
+    TRACE(TRACE_LOADER, TRACE_INFO, "load_file: loading %s\n", filename);
+
+    lexer_t lex;
+    if (!lexer_open(&lex, prog->vocab, filename, 1)) {
+        return FALSE;
+    }
+    if (hash) {
+        *hash = hash_bytes(NULL, 0);
+        lex.hash = hash;
+    }
+    int success = load_forms(prog, &lex);
+    lexer_close(&lex);
+
+    TRACE(TRACE_LOADER, TRACE_INFO, "load_file: completed %s\n", filename);
+    return success;
+}
+
+
+/**
+Read a manifest: the names of source files, one per line, in the order they
+are to be loaded. Blank lines and lines starting with // are skipped, and
+names are relative to the manifest's directory.
 
-gamedata_t* load_data() {
-    const char *filelist[] = {
-        "game.dat",
-        "game2.dat",
-        NULL
-    };
-    gamedata_t *gd = gamedata_create();
-    int found_error = FALSE;
+Returns a NULL terminated list of newly allocated names, or NULL on error.
+*/
+char **read_manifest(const char *filename) {
+    char *text = read_file(filename);
+    if (!text) {
+        debug_out("read_manifest: could not read manifest %s\n", filename);
+        return NULL;
+    }
+    const char *slash = strrchr(filename, '/');
+    int dir_length = slash ? slash - filename + 1 : 0;
 
-    vocab_raw_add("then");
-    vocab_raw_add("the");
-    vocab_raw_add("a");
-    vocab_raw_add("an");
-    vocab_raw_add(".");
-    vocab_raw_add(",");
-    vocab_raw_add(":");
-    vocab_raw_add(";");
+    int count = 0, capacity = 16;
+    char **filelist = malloc(sizeof(char*) * capacity);
+    char *line = text;
+    while (line) {
+        char *end = strchr(line, '\n');
+        char *next = end ? end + 1 : NULL;
+        if (!end) {
+            end = line + strlen(line);
+        }
+        while (line < end && isspace((unsigned char)*line)) {
+            ++line;
+        }
+        while (end > line && isspace((unsigned char)end[-1])) {
+            --end;
+        }
+        if (end > line && strncmp(line, "//", 2) != 0) {
+            if (count + 1 >= capacity) {
+                capacity *= 2;
+                filelist = realloc(filelist, sizeof(char*) * capacity);
+            }
+            int prefix = line[0] == '/' ? 0 : dir_length;
+            char *name = malloc(prefix + (end - line) + 1);
+            memcpy(name, filename, prefix);
+            memcpy(name + prefix, line, end - line);
+            name[prefix + (end - line)] = 0;
+            filelist[count++] = name;
+        }
+        line = next;
+    }
+    filelist[count] = NULL;
+    free(text);
+    return filelist;
+}
 
-    for (int i = 0; filelist[i] != NULL; ++i) {
-        list_t *lists = parse_file(filelist[i]);
-        if (!lists) {
-            debug_out("load_data: failed parse %s (1)\n", filelist[i]);
-            found_error = TRUE;
-            continue;
+/* Load files from the job until none are left. */
+void *load_worker(void *data) {
+    load_job_t *job = data;
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int index = job->next_file++;
+        pthread_mutex_unlock(&job->lock);
+        if (index >= job->file_count) {
+            return NULL;
         }
 
-        if (!parse_lists_toplevel(gd, lists)) {
-            debug_out("load_data: failed parse %s (2)\n", filelist[i]);
-            found_error = TRUE;
-            continue;
+        program_t *unit = program_create();
+        if (!load_file(unit, job->filelist[index], job->hashes ? &job->hashes[index] : NULL)) {
+            program_free(unit);
+            unit = NULL;
         }
+        job->units[index] = unit;
+    }
+}
 
-        list_freelist(lists);
+/* Move everything a file loaded into the program, giving it the numbers it
+ * would have been given had the file been loaded into the program directly:
+ * new properties are numbered in the order the file first used them, and
+ * objects and functions are numbered after those already loaded. Lists the
+ * loader builds newest first (symbol buckets, the root's children and the
+ * actions) have the unit's list put in front. The file's actions are noted
+ * in its source record. */
+void merge_unit(program_t *prog, program_t *unit, source_file_t *source) {
+    reload_free(unit);
+    int property_count = unit->next_property_id;
+    symbol_t **properties = calloc(sizeof(symbol_t*), property_count);
+    int *property_map = calloc(sizeof(int), property_count);
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = unit->symbols->buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type == SYM_PROPERTY && symbol->d.value > 0) {
+                properties[symbol->d.value] = symbol;
+            }
+        }
     }
+    for (int i = 1; i < property_count; ++i) {
+        property_map[i] = property_number(prog, properties[i]->name);
+    }
+    free(properties);
 
-    if (found_error) {
-        free_data(gd);
-        return NULL;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        symbol_t *first = NULL, **tail = &first;
+        symbol_t *symbol = unit->symbols->buckets[i];
+        while (symbol) {
+            symbol_t *next = symbol->next;
+            if (symbol->type == SYM_PROPERTY) {
+                free(symbol->name);
+                free(symbol);
+            } else {
+                if (symbol->type == SYM_FUNCTION) {
+                    ((function_t*)symbol->d.ptr)->id += prog->function_count;
+                }
+                *tail = symbol;
+                tail = &symbol->next;
+            }
+            symbol = next;
+        }
+        *tail = prog->symbols->buckets[i];
+        prog->symbols->buckets[i] = first;
     }
+    prog->function_count += unit->function_count;
 
-    debug_out("load_data: finalizing loaded data\n");
-    vocab_build();
-    gd->game_loaded = TRUE;
-    if (!fix_references(gd)) {
-        debug_out("load_data: failed to update references\n");
-        free_data(gd);
-        return NULL;
+    for (int i = 1; i < unit->object_count; ++i) {
+        object_t *obj = unit->objects[i];
+        if (prog->object_count >= prog->object_capacity) {
+            prog->object_capacity = prog->object_capacity ? prog->object_capacity * 2 : 64;
+            prog->objects = realloc(prog->objects, sizeof(object_t*) * prog->object_capacity);
+        }
+        obj->id = prog->object_count++;
+        prog->objects[obj->id] = obj;
+        obj->parent = prog->root;
+        for (property_t *p = obj->properties; p; p = p->next) {
+            if (p->id > 0) {
+                p->id = property_map[p->id];
+            }
+        }
+    }
+    free(property_map);
+    if (unit->object_count > 1) {
+        /* the file's first object is the last of the root's children */
+        unit->objects[1]->sibling = prog->root->first_child;
+        prog->root->first_child = unit->root->first_child;
     }
 
-    debug_out("load_data: completed loading game data\n");
-    return gd;
+    if (unit->actions) {
+        action_t *last = unit->actions;
+        source->first_action = last;
+        source->action_count = 1;
+        while (last->next) {
+            last = last->next;
+            ++source->action_count;
+        }
+        last->next = prog->actions;
+        prog->actions = unit->actions;
+    }
+
+    vocab_merge(prog->vocab, unit->vocab);
+    vocab_free(unit->vocab);
+    free(unit->symbols);
+    free(unit->objects);
+    free(unit->root);
+    free(unit);
 }
 
-void free_data(gamedata_t *gd) {
-    objectloop_free(gd->root);
+/**
+Load source files into a program, without linking them. Files are read and
+built on a pool of load_threads threads, then merged in the order they are
+listed, so the result does not depend on how the threads were scheduled.
+If hashes is not NULL, hashes[i] is set to the hash_bytes of file i as it
+was read.
+
+Returns true on success and false if any file could not be loaded.
+*/
+int load_sources(program_t *prog, const char **filelist, uint64_t *hashes) {
+    load_job_t job;
+    job.filelist = filelist;
+    job.hashes = hashes;
+    job.file_count = 0;
+    while (filelist[job.file_count]) {
+        ++job.file_count;
+    }
+    job.units = calloc(sizeof(program_t*), job.file_count + 1);
+    job.next_file = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    double start = load_clock();
 
-    while (gd->actions) {
-        action_t *next = gd->actions->next;
-        free(gd->actions);
-        gd->actions = next;
+    int thread_count = load_threads > 0 ? load_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count > job.file_count) {
+        thread_count = job.file_count;
+    }
+    if (thread_count <= 1) {
+        load_worker(&job);
+    } else {
+        /* the threads that start share out all the files between them, so
+         * if none can be started the files are loaded here instead */
+        pthread_t threads[thread_count];
+        int started = 0;
+        for (int i = 0; i < thread_count; ++i) {
+            if (pthread_create(&threads[started], NULL, load_worker, &job) == 0) {
+                ++started;
+            }
+        }
+        if (started < thread_count) {
+            debug_out("load_sources: started %d of %d load threads\n", started, thread_count);
+        }
+        if (started == 0) {
+            load_worker(&job);
+        }
+        for (int i = 0; i < started; ++i) {
+            pthread_join(threads[i], NULL);
+        }
     }
+    pthread_mutex_destroy(&job.lock);
 
-    symboltable_free(gd->symbols);
-    free(gd);
+    double built = load_clock();
+    load_times.build = built - start;
+
+    int success = TRUE;
+    source_file_t **last_source = &prog->sources;
+    while (*last_source) {
+        last_source = &(*last_source)->next;
+    }
+    for (int i = 0; i < job.file_count; ++i) {
+        if (!job.units[i]) {
+            debug_out("load_data: failed to load %s\n", filelist[i]);
+            success = FALSE;
+        } else if (success) {
+            source_file_t *source = calloc(sizeof(source_file_t), 1);
+            source->name = str_dupl(filelist[i]);
+            *last_source = source;
+            last_source = &source->next;
+            merge_unit(prog, job.units[i], source);
+        } else {
+            program_free(job.units[i]);
+        }
+    }
+    free(job.units);
+    load_times.merge = load_clock() - built;
+    return success;
 }
 
-list_t* parse_string(const char *text) {
-    char *work_text = str_dupl(text);
-    token_t *tokens = tokenize_source(work_text, 0);
-    list_t *lists = parse_tokens_to_lists(tokens);
-    token_freelist(tokens);
-    free(work_text);
-    return lists;
+
+/* ****************************************************************************
+ * Loading source files
+ * ****************************************************************************/
+/**
+Load the game whose source files are listed in the manifest named by
+load_manifest.
+*/
+program_t* load_data() {
+    char **filelist = read_manifest(load_manifest);
+    if (!filelist) {
+        return NULL;
+    }
+    program_t *prog = load_files((const char**)filelist);
+    for (int i = 0; filelist[i]; ++i) {
+        free(filelist[i]);
+    }
+    free(filelist);
+    return prog;
 }
 
-list_t* parse_file(const char *filename) {
-    debug_out("parse_file: parsing %s\n", filename);
+/**
+Load a game from a NULL terminated list of source files, then link,
+optimize and compile it. If there is a load cache, the game is mapped from
+its cached image when none of the files have changed, and otherwise cached
+once it is loaded.
+
+Returns the new program, or NULL if any file could not be loaded.
+*/
+program_t* load_files(const char **filelist) {
+    memset(&load_times, 0, sizeof(load_times));
+    uint64_t *hashes = NULL;
+    if (load_cache_dir) {
+        program_t *cached = cache_load(load_cache_dir, filelist);
+        if (cached) {
+            return cached;
+        }
+        int file_count = 0;
+        while (filelist[file_count]) {
+            ++file_count;
+        }
+        hashes = calloc(sizeof(uint64_t), file_count + 1);
+    }
+
+    program_t *prog = program_create();
 
-    char *file = read_file(filename);
-    token_t *tokens = tokenize_source(file, 1);
-    list_t *lists = parse_tokens_to_lists(tokens);
-    token_freelist(tokens);
-    free(file);
+    vocab_raw_add(prog->vocab, "then");
+    vocab_raw_add(prog->vocab, "the");
+    vocab_raw_add(prog->vocab, "a");
+    vocab_raw_add(prog->vocab, "an");
+    vocab_raw_add(prog->vocab, ".");
+    vocab_raw_add(prog->vocab, ",");
+    vocab_raw_add(prog->vocab, ":");
+    vocab_raw_add(prog->vocab, ";");
 
-    debug_out("parse_file: completed %s\n", filename);
-    return lists;
+    if (!load_sources(prog, filelist, hashes)) {
+        program_free(prog);
+        free(hashes);
+        return NULL;
+    }
+
+    TRACE(TRACE_LOADER, TRACE_INFO, "load_data: finalizing loaded data\n");
+    double start = load_clock();
+    vocab_build(prog->vocab);
+    prog->game_loaded = TRUE;
+    double phase_end = load_clock();
+    load_times.vocab = phase_end - start;
+    start = phase_end;
+    if (!fix_references(prog)) {
+        debug_out("load_data: failed to update references\n");
+        program_free(prog);
+        free(hashes);
+        return NULL;
+    }
+    phase_end = load_clock();
+    load_times.link = phase_end - start;
+    start = phase_end;
+
+    int removed = optimize_program(prog);
+    TRACE(TRACE_LOADER, TRACE_INFO, "load_data: optimizer removed %d nodes\n", removed);
+    phase_end = load_clock();
+    load_times.optimize = phase_end - start;
+    start = phase_end;
+
+    int function_count = 0;
+    int compiled = vm_compile_program(prog, &function_count);
+    load_times.compile = load_clock() - start;
+    TRACE(TRACE_LOADER, TRACE_INFO, "load_data: compiled %d of %d functions to bytecode\n",
+          compiled, function_count);
+
+    if (hashes) {
+        prog->source_hash = cache_source_hash(filelist, hashes);
+        cache_store(load_cache_dir, filelist, prog);
+        free(hashes);
+    }
+    TRACE(TRACE_LOADER, TRACE_INFO, "load_data: completed loading game data\n");
+    return prog;
 }
 
-list_t *parse_tokens_to_lists(token_t *tokens) {
+/* The time, in seconds, for timing the phases of a load. */
+double load_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+Read the lists in a piece of script source, such as a line of player input.
+Vocabulary words become their vocabulary numbers.
+
+Returns the lists, linked through their next fields, or NULL on error.
+*/
+list_t* parse_string(vocabulary_t *vocab, const char *text) {
+    lexer_t lex;
+    char *work_text = str_dupl(text);
+    lexer_init(&lex, vocab, work_text, 0);
+    lexer_next(&lex);
+
     list_t *lists = NULL, *last_list = NULL;
-    token_t *list_pos = tokens;
-    while (list_pos) {
-        list_t *list = parse_list(&list_pos);
+    while (lex.token.type != T_END) {
+        list_t *list = parse_list(&lex);
         if (!list) {
-            return NULL;
+            if (lists) list_freelist(lists);
+            lists = NULL;
+            break;
         }
         if (lists) {
             last_list->next = list;
-            last_list = list;
         } else {
             lists = list;
-            last_list = list;
         }
+        last_list = list;
     }
+    free(work_text);
     return lists;
 }
 
-int parse_lists_toplevel(gamedata_t *gd, list_t *lists) {
-    list_t *clist = lists;
-    while (clist) {
-        if (clist->type != T_LIST) {
-            debug_out("parse_lists_toplevel: expected list at top level.\n");
-            return 0;
+/* Link a loaded program, in two passes. The first gathers every name the
+ * objects use into a table; vocabulary words, which need only the
+ * vocabulary, are resolved on the way. The second sorts the table and walks
+ * it alongside the sorted symbols, so each distinct name is looked up once,
+ * and patches the values where they are. Every name that can't be resolved
+ * is reported before giving up. */
+int fix_references(program_t *prog) {
+    link_table_t table = { NULL, 0, 0 };
+    for (int i = 1; i < prog->object_count; ++i) {
+        object_t *obj = prog->objects[i];
+        if (obj->parent_name) {
+            link_add(&table, obj->parent_name, obj, NULL, LINK_PARENT);
         }
-        if (clist->child == NULL) {
-            debug_out("parse_lists_toplevel: empty list found at top level.\n");
-            return 0;
+        if (obj->prototype_name) {
+            link_add(&table, obj->prototype_name, obj, NULL, LINK_PROTOTYPE);
         }
-        if (clist->child->type != T_ATOM) {
-            debug_out("parse_lists_toplevel: list must start with atom.\n");
-            return 0;
+        for (property_t *p = obj->properties; p; p = p->next) {
+            link_value(prog, &table, obj, &p->value);
         }
+    }
+    qsort(table.refs, table.count, sizeof(link_ref_t), link_ref_compare);
 
-        if (strcmp(clist->child->text, "object") == 0) {
-            if (!parse_object(gd, clist)) {
-                return 0;
-            }
-        } else if (strcmp(clist->child->text, "action") == 0) {
-            if (!parse_action(gd, clist)) {
-                return 0;
-            }
-        } else if (strcmp(clist->child->text, "constant") == 0) {
-            if (!parse_constant(gd, clist)) {
-                return 0;
+    int symbol_count = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = prog->symbols->buckets[i]; symbol; symbol = symbol->next) {
+            ++symbol_count;
+        }
+    }
+    symbol_t **symbols = malloc(sizeof(symbol_t*) * (symbol_count + 1));
+    symbol_count = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = prog->symbols->buckets[i]; symbol; symbol = symbol->next) {
+            symbols[symbol_count++] = symbol;
+        }
+    }
+    qsort(symbols, symbol_count, sizeof(symbol_t*), link_symbol_compare);
+
+    int errors = 0, distinct = 0, next_symbol = 0;
+    for (int i = 0; i < table.count; ) {
+        const char *name = table.refs[i].name;
+        int end = i + 1;
+        while (end < table.count && strcmp(table.refs[end].name, name) == 0) {
+            ++end;
+        }
+        while (next_symbol < symbol_count && strcmp(symbols[next_symbol]->name, name) < 0) {
+            ++next_symbol;
+        }
+        symbol_t *symbol = NULL;
+        if (next_symbol < symbol_count && strcmp(symbols[next_symbol]->name, name) == 0) {
+            symbol = symbols[next_symbol];
+            if (next_symbol + 1 < symbol_count
+                    && strcmp(symbols[next_symbol + 1]->name, name) == 0) {
+                /* a name defined twice means whichever the table finds */
+                symbol = symbol_get(prog->symbols, name);
             }
-        } else if (strcmp(clist->child->text, "function") == 0) {
-            if (!parse_function(gd, clist)) {
-                return 0;
+        }
+
+        /* patching frees the names of values, so the first failure is kept
+         * for the report */
+        link_ref_t *failed = NULL;
+        int failures = 0;
+        for (++distinct; i < end; ++i) {
+            if (!link_patch(prog, &table.refs[i], symbol)) {
+                if (!failed) failed = &table.refs[i];
+                ++failures;
             }
-        } else {
-            debug_out("parse_lists_toplevel: unknown top level construct %s.\n", clist->child->text);
-            return 0;
         }
+        if (failed) {
+            property_t *owner_name = object_property_get(failed->owner, OBJPROP_INTERNAL_NAME);
+            text_out("fix_references: undefined reference to %s in %s (%d use%s).\n",
+                     failed->name,
+                     owner_name ? (char*)owner_name->value.d.ptr : "an unnamed object",
+                     failures, failures == 1 ? "" : "s");
+            ++errors;
+        }
+    }
+    TRACE(TRACE_LOADER, TRACE_INFO, "fix_references: %d references to %d names, %d symbols\n",
+          table.count, distinct, symbol_count);
+    free(symbols);
+    free(table.refs);
 
-        clist = clist->next;
+    link_tree(prog);
+    for (int i = 1; i < prog->object_count; ++i) {
+        object_t *obj = prog->objects[i];
+        free((void*)obj->parent_name);
+        free((void*)obj->prototype_name);
+        obj->parent_name = obj->prototype_name = NULL;
     }
 
-    return 1;
+    for (action_t *cura = prog->actions; cura; cura = cura->next) {
+        if (!link_action(prog, cura)) {
+            ++errors;
+        }
+    }
+    return errors == 0;
 }
 
-int fix_references(gamedata_t *gd) {
-    object_t *curo = gd->root->first_child;
-    while (curo) {
-        object_t *next = curo->sibling;
-        if (curo->parent_name) {
-            object_t *parent = object_get_by_ident(gd, curo->parent_name);
-            if (!parent) {
-                debug_out("fix_references: unknown object name %s.\n", curo->parent_name);
-                return 0;
-            }
-            object_move(curo, parent);
-            free((void*)curo->parent_name);
-            curo->parent_name = NULL;
-        }
-        if (curo->prototype_name) {
-            object_t *prototype = object_get_by_ident(gd, curo->prototype_name);
-            if (!prototype) {
-                debug_out("fix_references: unknown object name %s.\n", curo->prototype_name);
-                return 0;
-            }
-            object_property_add_object(curo, OBJPROP_PROTOTYPE, prototype);
-            free((void*)curo->prototype_name);
-            curo->prototype_name = NULL;
+/* Add a name to the link table. */
+void link_add(link_table_t *table, const char *name, object_t *owner,
+              value_t *value, int kind) {
+    if (table->count >= table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 256;
+        table->refs = realloc(table->refs, sizeof(link_ref_t) * table->capacity);
+    }
+    link_ref_t *ref = &table->refs[table->count];
+    ref->name = name;
+    ref->owner = owner;
+    ref->value = value;
+    ref->kind = kind;
+    ref->order = table->count++;
+}
+
+/* Gather the names in a property value, including those in arrays, and
+ * turn vocabulary words into their numbers. */
+void link_value(program_t *prog, link_table_t *table, object_t *owner, value_t *value) {
+    if (value->type == PT_TMPNAME) {
+        link_add(table, value->d.ptr, owner, value, LINK_VALUE);
+    } else if (value->type == PT_TMPVOCAB) {
+        int vocab_num = vocab_index(prog->vocab, value->d.ptr);
+        free(value->d.ptr);
+        /* clear the whole union, so that no byte of the pointer is left
+         * for anything that copies the value as bytes */
+        memset(&value->d, 0, sizeof(value->d));
+        value->type = PT_INTEGER;
+        value->d.num = vocab_num;
+    } else if (value->type == PT_ARRAY) {
+        for (int i = 0; i < value->array_size; ++i) {
+            link_value(prog, table, owner, &((value_t*)value->d.ptr)[i]);
         }
+    }
+}
 
-        property_t *p = curo->properties;
-        while (p) {
-            property_t *next = p->next;
-            if (p->value.type == PT_TMPNAME) {
-                if (((char*)p->value.d.ptr)[0] == '#') {
-                    object_property_add_integer(curo, p->id, property_number(gd, p->value.d.ptr));
-                } else {
-                    object_t *obj = object_get_by_ident(gd, p->value.d.ptr);
-                    if (!obj) {
-                        text_out("fix_references: undefined reference to %s.\n", (char*)p->value.d.ptr);
-                        return 0;
-                    }
-                    object_property_add_object(curo, p->id, obj);
-                }
-            } else if (p->value.type == PT_TMPVOCAB) {
-                int vocab_num = vocab_index(p->value.d.ptr);
-                free(p->value.d.ptr);
-                object_property_add_integer(curo, p->id, vocab_num);
-            } else if (p->value.type == PT_ARRAY) {
-                for (int i = 0; i < p->value.array_size; ++i) {
-                    value_t *val = &((value_t*)p->value.d.ptr)[i];
-                    if (val->type == PT_TMPVOCAB) {
-                        int vocab_num = vocab_index(val->d.ptr);
-                        free(val->d.ptr);
-                        val->d.num = vocab_num;
-                        val->type = PT_INTEGER;
-                    }
-                }
+int link_ref_compare(const void *a, const void *b) {
+    const link_ref_t *left = a, *right = b;
+    int cmp = strcmp(left->name, right->name);
+    return cmp ? cmp : left->order - right->order;
+}
+
+int link_symbol_compare(const void *a, const void *b) {
+    return strcmp((*(symbol_t* const*)a)->name, (*(symbol_t* const*)b)->name);
+}
+
+/* Resolve one reference to the symbol its name was found as, or NULL if
+ * it wasn't. Names starting with # are property numbers, or 0 for a
+ * property that doesn't exist; any other name must be an object. A new
+ * parent is only noted in the object, for link_tree.
+ *
+ * Returns false if the name could not be resolved. */
+int link_patch(program_t *prog, link_ref_t *ref, symbol_t *symbol) {
+    if (ref->kind == LINK_VALUE && ref->name[0] == '#') {
+        int pid = symbol && symbol->type == SYM_PROPERTY ? symbol->d.value : 0;
+        free(ref->value->d.ptr);
+        memset(&ref->value->d, 0, sizeof(ref->value->d));
+        ref->value->type = PT_INTEGER;
+        ref->value->d.num = pid;
+        return TRUE;
+    }
+
+    if (!symbol || symbol->type != SYM_OBJECT) {
+        return FALSE;
+    }
+    object_t *obj = symbol->d.ptr;
+    switch (ref->kind) {
+        case LINK_PARENT:
+            if (obj != ref->owner) {
+                ref->owner->parent = obj;
             }
-            p = next;
+            break;
+        case LINK_PROTOTYPE:
+            object_property_add_object(ref->owner, OBJPROP_PROTOTYPE, obj);
+            break;
+        case LINK_VALUE:
+            free(ref->value->d.ptr);
+            ref->value->type = PT_OBJECT;
+            ref->value->d.ptr = obj;
+            break;
+    }
+    return TRUE;
+}
+
+/* Rebuild the object tree from the parents link_patch noted. Objects are
+ * left in the order moving them one at a time would leave them: those that
+ * stay in the root keep their places, and an object's children come in the
+ * order they were loaded. */
+void link_tree(program_t *prog) {
+    object_t *root = prog->root;
+    object_t **tail = &root->first_child;
+    for (object_t *obj = root->first_child; obj; obj = obj->sibling) {
+        if (obj->parent == root) {
+            *tail = obj;
+            tail = &obj->sibling;
         }
+    }
+    *tail = NULL;
 
-        curo = next;
+    for (int i = prog->object_count - 1; i > 0; --i) {
+        object_t *obj = prog->objects[i];
+        if (obj->parent != root) {
+            obj->sibling = obj->parent->first_child;
+            obj->parent->first_child = obj;
+        }
     }
+}
 
-    action_t *cura = gd->actions;
-    while (cura) {
-        if (cura->action_name) {
-            symbol_t *symbol = symbol_get(gd->symbols, cura->action_name);
-            if (!symbol) {
-                text_out("Action code contains unknown symbol %s.\n", cura->action_name);
-            }
-            if (symbol->type == SYM_FUNCTION) {
-                cura->action_func = symbol->d.ptr;
-                cura->action_code = 9999;
-            } else {
-                cura->action_code = symbol->d.value;
-            }
-            free((void*)cura->action_name);
-            cura->action_name = NULL;
-        }
-        for (int i = 0; i < GT_MAX_TOKENS; ++i) {
-            if (cura->grammar[i].type == GT_SCOPE) {
-                char *name = cura->grammar[i].ptr;
-                cura->grammar[i].ptr = object_get_by_ident(gd, name);
-                if (!cura->grammar[i].ptr) {
-                    text_out("Action scope contains unknown object %s.\n", name);
-                    return 0;
-                }
-                free(name);
-            } else if (cura->grammar[i].type == GT_WORD) {
-                cura->grammar[i].value = vocab_index(cura->grammar[i].ptr);
-                free(cura->grammar[i].ptr);
+/**
+Resolve the names in an action loaded from source: its action symbol, and
+the objects and vocabulary words in its grammar.
+
+Returns true on success and false if a name is not defined.
+*/
+int link_action(program_t *prog, action_t *action) {
+    if (action->action_name) {
+        symbol_t *symbol = symbol_get(prog->symbols, action->action_name);
+        if (!symbol) {
+            text_out("Action code contains unknown symbol %s.\n", action->action_name);
+            return 0;
+        }
+        if (symbol->type == SYM_FUNCTION) {
+            action->action_func = symbol->d.ptr;
+            action->action_code = 9999;
+        } else {
+            action->action_code = symbol->d.value;
+        }
+        free((void*)action->action_name);
+        action->action_name = NULL;
+    }
+    for (int i = 0; i < GT_MAX_TOKENS; ++i) {
+        if (action->grammar[i].type == GT_SCOPE) {
+            char *name = action->grammar[i].ptr;
+            action->grammar[i].ptr = program_object_by_ident(prog, name);
+            if (!action->grammar[i].ptr) {
+                text_out("Action scope contains unknown object %s.\n", name);
+                return 0;
             }
+            free(name);
+        } else if (action->grammar[i].type == GT_WORD) {
+            action->grammar[i].value = vocab_index(prog->vocab, action->grammar[i].ptr);
+            free(action->grammar[i].ptr);
         }
-        cura = cura->next;
     }
     return 1;
 }
@@ -1,4 +1,6 @@
 #include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,41 +8,119 @@
 #include "parse.h"
 
 
-static int escape_string(char *text);
+static void lexer_error(lexer_t *lex, int line, int column, const char *msg, ...);
+static char lexer_fill(lexer_t *lex, size_t pos);
+static void lex_string(lexer_t *lex);
 static int valid_identifier(int ch);
-static void token_add(token_t **tokens, token_t **last_ptr, token_t *token);
+static void token_add(token_buffer_t *buffer, token_t *token);
 
-token_t *tokenize_source(char *file, int allow_new_vocab);
+/* Bytes read from a file at a time by a lexer made with lexer_open. */
+#ifndef LEXER_CHUNK
+#define LEXER_CHUNK 65536
+#endif
 
+/* Positions in the lexer are offsets from the start of the whole source;
+ * only the part from base on is in memory. LEX_AT gets the byte at a
+ * position, reading more of the source if needed, and is zero at the end.
+ * LEX_PTR is the address of a byte that has already been read. */
+#define LEX_AT(lex, at) ((at) < (lex)->base + (lex)->length \
+                         ? (lex)->source[(at) - (lex)->base] : lexer_fill(lex, at))
+#define LEX_PTR(lex, at) (&(lex)->source[(at) - (lex)->base])
 
 
-int escape_string(char *text) {
-    int found_error = FALSE;
-    if (!text || text[0] == 0) {
-        return FALSE;
-    }
 
-    for (int i = 0; i < strlen(text); ++i) {
-        if (text[i] == '\\') {
-            int escape_char = text[i+1];
-            switch(escape_char) {
-                case 0:
-                    debug_out("escape_string: incomplete escape at end of string\n");
-                    found_error = TRUE;
-                    break;
-                case 'n':
-                    memmove(&text[i], &text[i+1], strlen(text) - i);
-                    text[i] = '\n';
-                    break;
+/* Report a problem in the source to the debug log, with its position. */
+void lexer_error(lexer_t *lex, int line, int column, const char *msg, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, msg);
+    vsnprintf(message, sizeof(message), msg, args);
+    va_end(args);
+    debug_out("%s:%d:%d: %s\n", lex->name ? lex->name : "<input>", line, column, message);
+}
+
+/* Read the string whose opening quote is at the lexer's position, decoding
+ * its escapes in a single pass. Decoded text is never longer than its
+ * source, so it is written into the source behind the read position and
+ * terminated where the closing quote was. */
+void lex_string(lexer_t *lex) {
+    size_t start = lex->pos + 1, pos = start, out = start;
+    int line = lex->line, column = start - lex->line_start;
+    char ch;
+
+    while (1) {
+        /* copy the run of plain text that has already been read in one go,
+         * without going back to the lexer for each byte */
+        char *file = lex->source;
+        size_t base = lex->base, end = base + lex->length;
+        while (pos < end && (ch = file[pos - base]) != '"' && ch != '\\' && ch != '\n' && ch) {
+            file[out++ - base] = ch;
+            ++pos;
+        }
+        if (!(ch = LEX_AT(lex, pos)) || ch == '"') {
+            break;
+        }
+        if (ch == '\n') {
+            ++lex->line;
+            lex->line_start = pos + 1;
+        } else if (ch == '\\') {
+            size_t escape = pos++;
+            ch = LEX_AT(lex, pos);
+            if (!ch) {
+                lexer_error(lex, lex->line, escape - lex->line_start + 1,
+                            "incomplete escape at end of file");
+                break;
+            }
+            switch (ch) {
+                case 'n':   ch = '\n';  break;
+                case 't':   ch = '\t';  break;
+                case '"':
+                case '\\':  break;
+                case 'u': {
+                    unsigned code = 0;
+                    int digits = 0;
+                    while (digits < 4 && isxdigit((unsigned char)LEX_AT(lex, pos + 1))) {
+                        int digit = (unsigned char)*LEX_PTR(lex, ++pos);
+                        code = code * 16
+                             + (isdigit(digit) ? digit - '0' : tolower(digit) - 'a' + 10);
+                        ++digits;
+                    }
+                    if (digits < 4 || code == 0 || (code >= 0xD800 && code <= 0xDFFF)) {
+                        lexer_error(lex, lex->line, escape - lex->line_start + 1,
+                                    "invalid escape \\u%.*s", digits, LEX_PTR(lex, pos + 1 - digits));
+                        ++pos;
+                        continue;
+                    }
+                    /* encoded as UTF-8, at most three bytes for six read */
+                    if (code < 0x80) {
+                        *LEX_PTR(lex, out++) = code;
+                    } else if (code < 0x800) {
+                        *LEX_PTR(lex, out++) = 0xC0 | (code >> 6);
+                        *LEX_PTR(lex, out++) = 0x80 | (code & 0x3F);
+                    } else {
+                        *LEX_PTR(lex, out++) = 0xE0 | (code >> 12);
+                        *LEX_PTR(lex, out++) = 0x80 | ((code >> 6) & 0x3F);
+                        *LEX_PTR(lex, out++) = 0x80 | (code & 0x3F);
+                    }
+                    ++pos;
+                    continue; }
                 default:
-                    memmove(&text[i], &text[i+1], strlen(text) - i);
-                    debug_out("escape_string: unrecognized escape \\%c\n", escape_char);
-                    found_error = TRUE;
-                }
+                    lexer_error(lex, lex->line, escape - lex->line_start + 1,
+                                "unrecognized escape \\%c", ch);
+            }
         }
+        *LEX_PTR(lex, out++) = ch;
+        ++pos;
+    }
+    if (!ch) {
+        lexer_error(lex, line, column, "unterminated string");
     }
+    *LEX_PTR(lex, out) = 0;
 
-    return found_error;
+    lex->token.type = T_STRING;
+    lex->token.offset = start - lex->base;
+    lex->token.length = out - start;
+    lex->pos = ch ? pos + 1 : pos;
 }
 
 int valid_identifier(int ch) {
@@ -50,93 +130,257 @@ int valid_identifier(int ch) {
     return 0;
 }
 
-void token_add(token_t **tokens, token_t **last_ptr, token_t *token) {
-    if (*last_ptr == NULL) {
-        *tokens = *last_ptr = token;
+/* Append a copy of a token to the buffer, growing it if needed. */
+void token_add(token_buffer_t *buffer, token_t *token) {
+    if (buffer->count >= buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        buffer->tokens = realloc(buffer->tokens, sizeof(token_t) * buffer->capacity);
     }
-    else {
-        (*last_ptr)->next = token;
-        *last_ptr = token;
+    buffer->tokens[buffer->count++] = *token;
+}
+
+/**
+Start reading tokens from source text, one at a time. The text is modified
+as it is read, as described for tokenize_source, and must be kept while the
+lexer's tokens are used. There is no current token until the first call to
+lexer_next.
+*/
+void lexer_init(lexer_t *lex, vocabulary_t *vocab, char *source, int allow_new_vocab) {
+    lex->vocab = vocab;
+    lex->source = source;
+    lex->stream = NULL;
+    lex->base = 0;
+    lex->pos = 0;
+    lex->keep = 0;
+    lex->length = source ? strlen(source) : 0;
+    lex->capacity = 0;
+    lex->allow_new_vocab = allow_new_vocab;
+    lex->name = NULL;
+    lex->hash = NULL;
+    lex->line = 1;
+    lex->line_start = 0;
+    memset(&lex->token, 0, sizeof(token_t));
+    lex->token.type = T_END;
+}
+
+/**
+Start reading tokens from a file, which is read a chunk at a time as the
+lexer needs it rather than all at once. Only the current token is kept in
+memory, so its text is only valid until the next call to lexer_next. Call
+lexer_close when done.
+
+Returns false if the file could not be opened.
+*/
+int lexer_open(lexer_t *lex, vocabulary_t *vocab, const char *filename, int allow_new_vocab) {
+    FILE *stream = fopen(filename, "rb");
+    if (!stream) {
+        debug_out("lexer_open: could not open file '%s'\n", filename);
+        return FALSE;
     }
+    lexer_init(lex, vocab, NULL, allow_new_vocab);
+    lex->stream = stream;
+    lex->capacity = LEXER_CHUNK;
+    lex->source = malloc(lex->capacity);
+    lex->source[0] = 0;
+    lex->name = filename;
+    return TRUE;
 }
 
-token_t *tokenize_source(char *file, int allow_new_vocab) {
-    if (!file) return NULL;
+/**
+Release a lexer made with lexer_open.
+*/
+void lexer_close(lexer_t *lex) {
+    if (lex->stream) {
+        fclose(lex->stream);
+        lex->stream = NULL;
+    }
+    if (lex->capacity) {
+        free(lex->source);
+        lex->source = NULL;
+        lex->capacity = 0;
+    }
+}
 
-    token_t *tokens = NULL, *last_ptr = NULL;
-    size_t pos = 0, filesize = strlen(file);
-    while (pos < filesize) {
-        if (file[pos] == '/' && pos+1 < filesize && file[pos+1] == '/') {
-            while (pos < filesize && file[pos] != '\n') {
-                ++pos;
+/* Get the byte at position pos of a lexer's source when it is past the part
+ * held in memory, reading more of a file if the lexer has one. Everything
+ * before the start of the token being read is dropped to make room, and the
+ * buffer only grows for a token longer than what remains. Returns zero at
+ * the end of the source. */
+char lexer_fill(lexer_t *lex, size_t pos) {
+    while (lex->stream && pos >= lex->base + lex->length) {
+        size_t drop = lex->keep - lex->base;
+        memmove(lex->source, lex->source + drop, lex->length - drop);
+        lex->length -= drop;
+        lex->base += drop;
+        /* grow if less than half a chunk is left once room is kept for the
+         * zero byte after the source */
+        if (lex->capacity - lex->length - 1 < (LEXER_CHUNK + 1) / 2) {
+            lex->capacity *= 2;
+            lex->source = realloc(lex->source, lex->capacity);
+        }
+        size_t count = fread(lex->source + lex->length, 1,
+                             lex->capacity - lex->length - 1, lex->stream);
+        if (lex->hash) {
+            *lex->hash = hash_update(*lex->hash, lex->source + lex->length, count);
+        }
+        lex->length += count;
+        lex->source[lex->length] = 0;
+        if (count == 0) {
+            fclose(lex->stream);
+            lex->stream = NULL;
+        }
+    }
+    if (pos >= lex->base + lex->length) {
+        return 0;
+    }
+    return lex->source[pos - lex->base];
+}
+
+/**
+Read the next token of the source into lex->token. Vocabulary words are added
+to the vocabulary if the lexer allows new vocabulary; otherwise they are read
+as integer tokens holding their vocabulary numbers.
+
+Returns false, leaving a token of type T_END, at the end of the source.
+*/
+int lexer_next(lexer_t *lex) {
+    size_t pos = lex->pos;
+    token_t *t = &lex->token;
+    t->number = 0;
+    char ch;
+
+    /* nothing before keep is needed again once it has been passed, so a
+     * buffer refill may drop it; it is moved on at each line and token */
+    while ((ch = LEX_AT(lex, pos))) {
+        if (ch == '/' && LEX_AT(lex, pos + 1) == '/') {
+            while ((ch = LEX_AT(lex, pos)) && ch != '\n') {
+                lex->keep = ++pos;
+            }
+            continue;
+        } else if (isspace((unsigned char)ch)) {
+            if (ch == '\n') {
+                ++lex->line;
+                lex->line_start = lex->keep = pos + 1;
             }
-        } else if (isspace(file[pos])) {
             ++pos;
-        } else if (file[pos] == '(') {
-            token_t *t = calloc(sizeof(token_t), 1);
+            continue;
+        }
+
+        size_t start = lex->keep = pos;
+        if (ch == '(') {
             t->type = T_OPEN;
-            token_add(&tokens, &last_ptr, t);
             ++pos;
-        } else if (file[pos] == ')') {
-            token_t *t = calloc(sizeof(token_t), 1);
+        } else if (ch == ')') {
             t->type = T_CLOSE;
-            token_add(&tokens, &last_ptr, t);
             ++pos;
-        } else if (isdigit(file[pos])) {
-            int start = pos;
-            char *token = &file[pos];
-            while (isdigit(file[pos])) {
+        } else if (isdigit((unsigned char)ch)
+                   || (ch == '-' && isdigit((unsigned char)LEX_AT(lex, pos + 1)))) {
+            /* read as strtol with base 0 would: 0x starts a hexadecimal
+             * literal, and any other leading zero an octal one, which ends
+             * at the first 8 or 9 */
+            int negative = ch == '-';
+            if (negative) ++pos;
+            int base = 10;
+            if (LEX_AT(lex, pos) == '0') {
+                char next = LEX_AT(lex, pos + 1);
+                if (next == 'x' || next == 'X') {
+                    base = 16;
+                    pos += 2;
+                } else {
+                    base = 8;
+                }
+            }
+            long limit = negative ? -(long)INT_MIN : INT_MAX;
+            long value = 0;
+            int in_range = TRUE, in_base = TRUE, digits = 0;
+            while (base == 16 ? isxdigit((unsigned char)(ch = LEX_AT(lex, pos)))
+                              : isdigit((unsigned char)(ch = LEX_AT(lex, pos)))) {
+                int digit = isdigit((unsigned char)ch) ? ch - '0' : tolower((unsigned char)ch) - 'a' + 10;
+                in_base = in_base && digit < base;
+                if (in_base && in_range) {
+                    value = value * base + digit;
+                    in_range = value <= limit;
+                }
+                ++digits;
                 ++pos;
             }
-            token_t *t = calloc(sizeof(token_t), 1);
+            if (digits == 0) {
+                lexer_error(lex, lex->line, start - lex->line_start + 1,
+                            "hexadecimal literal has no digits");
+            } else if (!in_range) {
+                lexer_error(lex, lex->line, start - lex->line_start + 1,
+                            "integer literal out of range");
+                value = limit;
+            }
             t->type = T_INTEGER;
-            char *tmp = str_dupl_left(token, pos - start);
-            t->number = strtol(tmp, 0, 0);
-            free(tmp);
-            token_add(&tokens, &last_ptr, t);
-        } else if (valid_identifier(file[pos])) {
-            int start = pos;
-            char *token = &file[pos];
-            while (valid_identifier(file[pos])) {
+            t->number = (int)(negative ? -value : value);
+        } else if (valid_identifier((unsigned char)ch)) {
+            while (valid_identifier((unsigned char)LEX_AT(lex, pos))) {
                 ++pos;
             }
-            token_t *t = calloc(sizeof(token_t), 1);
             t->type = T_ATOM;
-            t->text = str_dupl_left(token, pos - start);
-            token_add(&tokens, &last_ptr, t);
-        } else if (file[pos] == '"') {
-            ++pos;
-            char *token = &file[pos];
-            while (pos < filesize && file[pos] != '"') {
-                ++pos;
-            }
-            file[pos++] = 0;
-            escape_string(token);
-            token_t *t = calloc(sizeof(token_t), 1);
-            t->type = T_STRING;
-            t->text = str_dupl(token);
-            token_add(&tokens, &last_ptr, t);
-        } else if (file[pos] == '<') {
-            ++pos;
-            char *token = &file[pos];
-            while (pos < filesize && file[pos] != '>') {
+        } else if (ch == '"') {
+            lex->pos = pos;
+            lex_string(lex);
+            return TRUE;
+        } else if (ch == '<') {
+            start = ++pos;
+            while ((ch = LEX_AT(lex, pos)) && ch != '>') {
                 ++pos;
             }
-            file[pos++] = 0;
-            token_t *t = calloc(sizeof(token_t), 1);
-            if (allow_new_vocab) {
-                vocab_raw_add(token);
-                t->text = str_dupl(token);
-                t->type = T_VOCAB;
+            *LEX_PTR(lex, pos++) = 0;
+            t->type = T_VOCAB;
+            t->offset = start - lex->base;
+            t->length = pos - 1 - start;
+            if (lex->allow_new_vocab) {
+                vocab_raw_add(lex->vocab, LEX_PTR(lex, start));
             } else {
-                t->number = vocab_index(token);
+                t->number = vocab_index(lex->vocab, LEX_PTR(lex, start));
                 t->type = T_INTEGER;
             }
-            token_add(&tokens, &last_ptr, t);
+            lex->pos = pos;
+            return TRUE;
         } else {
-            text_out("Unexpected token '%c' (%d).\n", file[pos], file[pos]);
+            lexer_error(lex, lex->line, pos - lex->line_start + 1,
+                        "unexpected character '%c' (%d)", ch, ch);
             ++pos;
+            continue;
         }
+        t->offset = start - lex->base;
+        t->length = pos - start;
+        lex->pos = pos;
+        return TRUE;
+    }
+
+    lex->keep = pos;
+    t->type = T_END;
+    t->offset = pos - lex->base;
+    t->length = 0;
+    lex->pos = pos;
+    return FALSE;
+}
+
+/**
+Split source text into tokens all at once. The text is modified: strings
+have their escapes decoded, and their closing quotes (and the closing
+brackets of vocabulary words) are replaced by zero bytes. Tokens refer to the
+text, so it must be kept until the buffer is no longer needed.
+
+Returns a new token buffer, or NULL if file is NULL.
+*/
+token_buffer_t *tokenize_source(vocabulary_t *vocab, char *file, int allow_new_vocab) {
+    if (!file) return NULL;
+
+    lexer_t lex;
+    lexer_init(&lex, vocab, file, allow_new_vocab);
+    token_buffer_t *buffer = calloc(sizeof(token_buffer_t), 1);
+    buffer->source = file;
+    /* source text averages a token every few bytes */
+    buffer->capacity = lex.length / 4 + 16;
+    buffer->tokens = malloc(sizeof(token_t) * buffer->capacity);
+
+    while (lexer_next(&lex)) {
+        token_add(buffer, &lex.token);
     }
-    return tokens;
+    return buffer;
 }
@@ -1,58 +1,97 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "parse.h"
 
+/* budget_check runs at least this often when any limit is set */
+#define BUDGET_CHECK_INTERVAL 1024
+/* Calls to list_run_function may nest this deep. Each one recurses on the
+ * C stack, so this stops runaway recursion before the stack overflows. */
+#define SCRIPT_DEPTH_LIMIT 2500
+
+/* Limits applied to every turn; 0 means no limit. */
+long script_step_limit = 0;
+unsigned long script_alloc_limit = 0;
+/* Steps per scheduler slice for sessions started after this is set. */
+long script_slice_steps = 0;
+
+static void budget_stop(gamedata_t *gd, int code, const char *where);
+
+/* Builtins receive their arguments as an array of values owned by the
+ * caller and return a new value. Builtins that do not auto-evaluate get each
+ * argument unevaluated: the value's d.list points at the argument's node in
+ * the function body and must not be freed or kept. */
 typedef struct FUNCDEF {
     const char *name;
     int auto_evaluate;
-    list_t* (*func)(gamedata_t *gd, symboltable_t *locals, list_t *args);
+    svalue_t (*func)(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
 } funcdef_t;
 
-list_t *list_run_function(gamedata_t *gd, function_t *func, list_t *args);
-list_t *list_evaluate(gamedata_t *gd, symboltable_t *locals, list_t *list);
-static list_t *list_build_args_from(gamedata_t *gd, symboltable_t *locals, list_t *src, int evaluate);
 static int is_defined(gamedata_t *gd, symboltable_t *locals, list_t *atom);
-
-static list_t* builtin_add(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_sub(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_mul(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_div(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_dump_symbols(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_vocab(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_log(gamedata_t *gd, symboltable_t *locals, list_t *args);
+static svalue_t arith_apply(gamedata_t *gd, int op, int argc, svalue_t *argv);
+
+static svalue_t builtin_add(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_sub(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_mul(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_div(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_mod(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_lt(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_gt(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_le(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_ge(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_min(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_max(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_dump_symbols(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_vocab(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_log(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
 static void builtin_log_helper(gamedata_t *gd, symboltable_t *locals, list_t *list);
-static list_t* builtin_say(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_list(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_quote(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_if(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_prop_has(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_prop_get(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_proc(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_parent(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_bold(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_normal(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_reverse(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_prop_true(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_or(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_and(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_not(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_sibling(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_child(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_set(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_object_move(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_contains(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_contains_indirect(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_eq(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_is_object(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_is_string(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_is_number(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_is_function(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_is_list(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_type_name(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_prop_set(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_request_quit(gamedata_t *gd, symboltable_t *locals, list_t *args);
-static list_t* builtin_dump_obj(gamedata_t *gd, symboltable_t *locals, list_t *args);
+static void builtin_log_value(gamedata_t *gd, svalue_t value);
+static svalue_t builtin_say(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_list(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_quote(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_if(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_prop_has(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_prop_get(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_proc(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_parent(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_bold(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_normal(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_reverse(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_prop_true(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_or(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_and(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_not(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_sibling(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_child(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_set(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_object_move(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_contains(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_contains_indirect(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_eq(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_is_object(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_is_string(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_is_number(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_is_function(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_is_list(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_type_name(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_prop_set(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_request_quit(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_dump_obj(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_profile(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static int object_filter_args(gamedata_t *gd, const char *name, int argc, svalue_t *argv,
+                              int *pid, int *want);
+static svalue_t object_collect(gamedata_t *gd, const char *name, int descend, int argc, svalue_t *argv);
+static svalue_t object_count(gamedata_t *gd, const char *name, int descend, int argc, svalue_t *argv);
+static svalue_t builtin_children(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_descendants(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_count_children(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_count_descendants(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_first_child(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_next_sibling(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_for_each(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
+static svalue_t builtin_reload(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv);
 
 
 static funcdef_t builtin_funcs[] = {
@@ -60,6 +99,13 @@ static funcdef_t builtin_funcs[] = {
     { "sub", TRUE, builtin_sub },
     { "mul", TRUE, builtin_mul },
     { "div", TRUE, builtin_div },
+    { "mod", TRUE, builtin_mod },
+    { "lt", TRUE, builtin_lt },
+    { "gt", TRUE, builtin_gt },
+    { "le", TRUE, builtin_le },
+    { "ge", TRUE, builtin_ge },
+    { "min", TRUE, builtin_min },
+    { "max", TRUE, builtin_max },
     { "dump-symbols", TRUE, builtin_dump_symbols },
     { "vocab", TRUE, builtin_vocab },
     { "log", FALSE, builtin_log },
@@ -94,51 +140,86 @@ static funcdef_t builtin_funcs[] = {
     { "prop-set", TRUE, builtin_prop_set },
     { "request-quit", TRUE, builtin_request_quit },
     { "dump-obj", TRUE, builtin_dump_obj },
+    { "profile", TRUE, builtin_profile },
+    { "children", TRUE, builtin_children },
+    { "descendants", TRUE, builtin_descendants },
+    { "count-children", TRUE, builtin_count_children },
+    { "count-descendants", TRUE, builtin_count_descendants },
+    { "first-child", TRUE, builtin_first_child },
+    { "next-sibling", TRUE, builtin_next_sibling },
+    { "for-each", TRUE, builtin_for_each },
+    { "reload", TRUE, builtin_reload },
     { NULL }
 };
 
-object_t* list_to_object(list_t *list) {
-    if (!list) return NULL;
-    if (list->type != T_OBJECT_REF) return NULL;
-    return list->ptr;
+object_t* value_to_object(svalue_t value) {
+    if (value.type != T_OBJECT_REF) return NULL;
+    return value.d.ptr;
 }
 
-list_t *list_run_function_noargs(gamedata_t *gd, function_t *func) {
-    list_t *args = list_create();
-    list_t *result = list_run_function(gd, func, args);
-    list_free(args);
-    return result;
+svalue_t list_run_function_noargs(gamedata_t *gd, function_t *func) {
+    return list_run_function(gd, func, 0, NULL);
 }
 
-list_t *list_run_function(gamedata_t *gd, function_t *func, list_t *args) {
+/**
+Call a script function. The arguments belong to the caller and are not
+modified. The function's current definition is run; if the function is
+reloaded while it runs, this call finishes with the definition it began.
+*/
+svalue_t list_run_function(gamedata_t *gd, function_t *func, int argc, svalue_t *argv) {
+    script_budget_t *budget = &gd->budget;
+    func = function_current(func);
+    if (budget->depth >= SCRIPT_DEPTH_LIMIT) {
+        budget_stop(gd, SCRIPT_TOO_DEEP, func->name);
+    }
+    if (budget->error.code != SCRIPT_OK) {
+        return value_false();
+    }
+    if (script_engine == ENGINE_VM && func->code) {
+        ++budget->depth;
+        svalue_t result = vm_run_function(gd, func, argc, argv);
+        --budget->depth;
+        return result;
+    }
+
+    /* only the VM can be suspended */
+    budget->can_suspend = FALSE;
+    ++budget->depth;
+    if (gd->profiling) {
+        profile_enter_function(gd, func);
+    }
     symboltable_t *locals = symboltable_create();
 
     list_t *arg_name = func->arg_list->child;
-    list_t *cur_arg = args->child;
+    int cur_arg = 0;
     while (arg_name) {
-        if (cur_arg) {
-            symbol_add_ptr(locals, arg_name->text, SYM_LIST, cur_arg);
-            cur_arg = cur_arg->next;
+        if (cur_arg < argc) {
+            svalue_t *value = malloc(sizeof(svalue_t));
+            *value = value_copy(argv[cur_arg++]);
+            symbol_add_ptr(locals, arg_name->text, SYM_VALUE, value);
         } else {
             symbol_add_value(locals, arg_name->text, SYM_CONSTANT, 0);
         }
         arg_name = arg_name->next;
     }
 
-    list_t *result = list_run(gd, locals, func->body);
+    svalue_t result = list_run(gd, locals, func->body);
 
+    --budget->depth;
     symboltable_free(locals);
+    if (gd->profiling) {
+        profile_exit(gd);
+    }
     return result;
 }
 
-list_t *list_evaluate(gamedata_t *gd, symboltable_t *locals, list_t *list) {
+svalue_t list_evaluate(gamedata_t *gd, symboltable_t *locals, list_t *list) {
     symbol_t *symbol = NULL;
-    list_t *new_list;
     switch(list->type) {
         case T_STRING:
         case T_INTEGER:
         case T_VOCAB:
-            return list_duplicate(list);
+            return value_from_list(list);
         case T_ATOM:
             if (locals) {
                 symbol = symbol_get(locals, list->text);
@@ -147,56 +228,34 @@ list_t *list_evaluate(gamedata_t *gd, symboltable_t *locals, list_t *list) {
                 symbol = symbol_get(gd->symbols, list->text);
             }
             if (!symbol) {
-                debug_out("list_evaluate: undefined value %s\n", list->text);
-                return list_create_false();
+                gd_debug_out(gd, "list_evaluate: undefined value %s\n", list->text);
+                return value_false();
             }
             switch(symbol->type) {
+                case SYM_VALUE:
+                    return value_copy(*(svalue_t*)symbol->d.ptr);
                 case SYM_LIST:
-                    new_list = list_duplicate(symbol->d.ptr);
-                    return new_list;
+                    return value_from_list(symbol->d.ptr);
                 case SYM_OBJECT:
-                    new_list = list_create();
-                    new_list->type = T_OBJECT_REF;
-                    new_list->ptr = symbol->d.ptr;
-                    return new_list;
+                    return value_object(session_object(gd, symbol->d.ptr));
                 case SYM_FUNCTION:
-                    new_list = list_create();
-                    new_list->type = T_FUNCTION_REF;
-                    new_list->ptr = symbol->d.ptr;
-                    return new_list;
+                    return value_function(symbol->d.ptr);
                 case SYM_PROPERTY:
                 case SYM_CONSTANT:
-                    new_list = list_create();
-                    new_list->type = T_INTEGER;
-                    new_list->number = symbol->d.value;
-                    return new_list;
+                    return value_int(symbol->d.value);
                 default:
-                    debug_out("list atom evaluated to unhandled type %d\n", symbol->type);
-                    return list_create_false();
+                    gd_debug_out(gd, "list atom evaluated to unhandled type %d\n", symbol->type);
+                    return value_false();
             }
             break;
         case T_LIST:
             return list_run(gd, locals, list);
         default:
-            debug_out("Tried to evaluate list of unknown type %d\n", list->type);
-            return list_create_false();
+            gd_debug_out(gd, "Tried to evaluate list of unknown type %d\n", list->type);
+            return value_false();
     }
 }
 
-list_t *list_build_args_from(gamedata_t *gd, symboltable_t *locals, list_t *src, int evaluate) {
-    list_t *args = list_create();
-    list_t *iter = src;
-    while (iter) {
-        if (evaluate) {
-            list_add(args, list_evaluate(gd, locals, iter));
-        } else {
-            list_add(args, list_duplicate(iter));
-        }
-        iter = iter->next;
-    }
-    return args;
-}
-
 int is_defined(gamedata_t *gd, symboltable_t *locals, list_t *atom) {
     symbol_t *symbol = NULL;
     if (!atom || atom->type != T_ATOM) {
@@ -215,322 +274,607 @@ int is_defined(gamedata_t *gd, symboltable_t *locals, list_t *atom) {
 }
 
 
-list_t *list_run(gamedata_t *gd, symboltable_t *locals, list_t *list) {
+svalue_t list_run(gamedata_t *gd, symboltable_t *locals, list_t *list) {
     if (!gd || !list) {
-        return NULL;
+        return value_false();
     }
     if (!list->child) {
-        return list_create();
+        return value_list(list_create());
     }
     if (list->child->type != T_ATOM) {
-        debug_out("Tried to run list, but list did not start with atom.\n");
-        return NULL;
+        gd_debug_out(gd, "Tried to run list, but list did not start with atom.\n");
+        return value_false();
     }
     const char *name = list->child->text;
+    TRACE(TRACE_INTERPRETER, TRACE_DEBUG, "list_run: %s\n", name);
+    if (gd->budget.countdown-- <= 0 && budget_check(gd, name, FALSE) == BUDGET_ABORT) {
+        return value_false();
+    }
+
+    int argc = 0;
+    for (list_t *iter = list->child->next; iter; iter = iter->next) {
+        ++argc;
+    }
+    svalue_t argv[argc + 1];
 
     symbol_t *user_func = symbol_get(gd->symbols, name);
     if (user_func) {
         if (user_func->type != SYM_FUNCTION) {
-            debug_out("tried to run non-function %s\n", name);
-            return list_create_false();
+            gd_debug_out(gd, "tried to run non-function %s\n", name);
+            return value_false();
+        }
+        argc = 0;
+        for (list_t *iter = list->child->next; iter; iter = iter->next) {
+            argv[argc++] = list_evaluate(gd, locals, iter);
+        }
+        svalue_t result = value_false();
+        if (gd->budget.error.code == SCRIPT_OK) {
+            result = list_run_function(gd, (function_t*)user_func->d.ptr, argc, argv);
+        }
+        for (int i = 0; i < argc; ++i) {
+            value_free(argv[i]);
         }
-        list_t *args = list_build_args_from(gd, locals, list->child->next, TRUE);
-        list_t *result = list_run_function(gd, (function_t*)user_func->d.ptr, args);
-        list_free(args);
         return result;
     }
 
-    int result = -1;
-    for (int i = 0; builtin_funcs[i].name != NULL && result == -1; ++i) {
+    int builtin = builtin_lookup(name);
+    if (builtin == -1) {
+        gd_debug_out(gd, "tried to run non-existant function %s\n", name);
+        return value_false();
+    }
+
+    int evaluate = builtin_funcs[builtin].auto_evaluate;
+    argc = 0;
+    for (list_t *iter = list->child->next; iter; iter = iter->next) {
+        if (evaluate) {
+            argv[argc++] = list_evaluate(gd, locals, iter);
+        } else {
+            argv[argc].type = iter->type;
+            argv[argc++].d.list = iter;
+        }
+    }
+    if (evaluate && gd->budget.error.code != SCRIPT_OK) {
+        /* the turn was stopped while evaluating the arguments */
+        for (int i = 0; i < argc; ++i) {
+            value_free(argv[i]);
+        }
+        return value_false();
+    }
+    if (gd->profiling) {
+        profile_enter_builtin(gd, builtin);
+    }
+    svalue_t result = builtin_funcs[builtin].func(gd, locals, argc, argv);
+    if (gd->profiling) {
+        profile_exit(gd);
+    }
+    if (evaluate) {
+        for (int i = 0; i < argc; ++i) {
+            value_free(argv[i]);
+        }
+    }
+    return result;
+}
+
+/**
+Find a builtin script function by name.
+
+Returns the builtin's index, or -1 if there is no builtin with that name.
+*/
+int builtin_lookup(const char *name) {
+    for (int i = 0; builtin_funcs[i].name != NULL; ++i) {
         if (strcmp(builtin_funcs[i].name, name) == 0) {
-            result = i;
+            return i;
         }
     }
-    if (result == -1) {
-        debug_out("tried to run non-existant function %s\n", name);
-        return list_create_false();
+    return -1;
+}
+
+const char *builtin_name(int index) {
+    return builtin_funcs[index].name;
+}
+
+int builtin_count() {
+    int count = 0;
+    while (builtin_funcs[count].name) {
+        ++count;
     }
+    return count;
+}
 
-    list_t *args = list_build_args_from(gd, locals, list->child->next, builtin_funcs[result].auto_evaluate);
-    list_t *run_result = builtin_funcs[result].func(gd, locals, args);
-    list_free(args);
-    return run_result;
+/**
+Returns true if the builtin's arguments are evaluated before it is called.
+*/
+int builtin_evaluates_args(int index) {
+    return builtin_funcs[index].auto_evaluate;
+}
+
+/**
+Call a builtin with already evaluated arguments. Builtins called this way
+have no access to a local symbol table, so this must not be used for
+builtins (such as set) that need one.
+*/
+svalue_t builtin_call(gamedata_t *gd, int index, int argc, svalue_t *argv) {
+    if (!gd || !gd->profiling) {
+        return builtin_funcs[index].func(gd, NULL, argc, argv);
+    }
+    profile_enter_builtin(gd, index);
+    svalue_t result = builtin_funcs[index].func(gd, NULL, argc, argv);
+    profile_exit(gd);
+    return result;
 }
 
 /* *********************************************************************** *
-* Functions for built-in scipt functions
+* Execution budgets
  * *********************************************************************** */
 
+static void budget_rearm(gamedata_t *gd);
+static unsigned long budget_allocs(gamedata_t *gd);
 
-list_t* builtin_add(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    int total = 0;
-    list_t *iter = args->child;
-    while (iter) {
-        if (iter->type != T_INTEGER) {
-            debug_out("add: requires integer arguments\n");
-            return list_create_false();
-        }
-        total += iter->number;
-        iter = iter->next;
+/* Set the countdown to the steps left before something needs checking. */
+void budget_rearm(gamedata_t *gd) {
+    script_budget_t *budget = &gd->budget;
+    long period = LONG_MAX;
+    if (script_step_limit || script_alloc_limit || budget->slice_steps) {
+        period = BUDGET_CHECK_INTERVAL;
     }
-    list_t *result = list_create();
-    result->type = T_INTEGER;
-    result->number = total;
-    return result;
+    if (script_step_limit && script_step_limit - budget->steps < period) {
+        period = script_step_limit - budget->steps;
+    }
+    if (budget->slice_steps && budget->slice_left < period) {
+        period = budget->slice_left;
+    }
+    if (period < 1) {
+        period = 1;
+    }
+    budget->period = budget->countdown = period;
 }
 
-list_t* builtin_sub(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    int total = 0;
-    list_t *iter = args->child;
-    if (iter) {
-        if (iter->type != T_INTEGER) {
-            debug_out("sub: requires integer arguments\n");
-            return list_create_false();
-        }
-        total = iter->number;
-        iter = iter->next;
+unsigned long budget_allocs(gamedata_t *gd) {
+    return gd->budget.allocs + list_allocs.nodes + list_allocs.strings - gd->budget.alloc_start;
+}
 
-        while (iter) {
-            if (iter->type != T_INTEGER) {
-                debug_out("sub: requires integer arguments\n");
-                return list_create_false();
-            }
-            total -= iter->number;
-            iter = iter->next;
+/* Record why the turn is being stopped; later checks will all abort. */
+void budget_stop(gamedata_t *gd, int code, const char *where) {
+    script_budget_t *budget = &gd->budget;
+    budget->error.code = code;
+    budget->error.where = where;
+    budget->error.steps = budget->steps + budget->period - budget->countdown;
+    budget->error.allocs = budget_allocs(gd);
+    budget->countdown = 0;
+}
+
+/**
+Give a session a fresh budget for a new turn.
+*/
+void budget_start_turn(gamedata_t *gd) {
+    script_budget_t *budget = &gd->budget;
+    budget->steps = 0;
+    budget->allocs = 0;
+    budget->depth = 0;
+    budget->suspended = FALSE;
+    budget->can_suspend = FALSE;
+    memset(&budget->error, 0, sizeof(script_error_t));
+    budget_start_slice(gd);
+}
+
+/**
+Start a new scheduler slice of the current turn. This must be called on
+the thread that will run the slice.
+*/
+void budget_start_slice(gamedata_t *gd) {
+    script_budget_t *budget = &gd->budget;
+    budget->alloc_start = list_allocs.nodes + list_allocs.strings;
+    budget->slice_left = budget->slice_steps;
+    budget_rearm(gd);
+}
+
+/**
+Called by an interpreter when a session's step countdown runs out. Where
+names what was running. may_suspend is true if the caller can save its
+state and return to be resumed later.
+
+Returns BUDGET_CONTINUE if evaluation may go on, BUDGET_SUSPEND if the
+caller should suspend because its slice is over, or BUDGET_ABORT if the
+turn has exceeded its budget and evaluation must stop. Once a turn has been
+aborted, every later check also returns BUDGET_ABORT.
+*/
+int budget_check(gamedata_t *gd, const char *where, int may_suspend) {
+    script_budget_t *budget = &gd->budget;
+    if (budget->error.code != SCRIPT_OK) {
+        budget->countdown = 0;
+        return BUDGET_ABORT;
+    }
+    budget->steps += budget->period;
+    if (budget->slice_steps) {
+        budget->slice_left -= budget->period;
+    }
+
+    int code = SCRIPT_OK;
+    if (script_step_limit && budget->steps >= script_step_limit) {
+        code = SCRIPT_OUT_OF_STEPS;
+    } else if (script_alloc_limit && budget_allocs(gd) >= script_alloc_limit) {
+        code = SCRIPT_OUT_OF_ALLOCS;
+    }
+    if (code != SCRIPT_OK) {
+        budget->period = budget->countdown = 0;
+        budget_stop(gd, code, where);
+        return BUDGET_ABORT;
+    }
+
+    if (budget->slice_steps && budget->slice_left <= 0) {
+        if (may_suspend) {
+            budget->allocs = budget_allocs(gd);
+            budget->suspended = TRUE;
+            return BUDGET_SUSPEND;
         }
+        /* nothing to hand control back to, so carry on in a new slice */
+        budget->slice_left = budget->slice_steps;
     }
+    budget_rearm(gd);
+    return BUDGET_CONTINUE;
+}
 
-    list_t *result = list_create();
-    result->type = T_INTEGER;
-    result->number = total;
-    return result;
+/**
+Report a turn that was stopped for exceeding its budget, to the player and
+to the session's log.
+
+Returns true if the turn was stopped.
+*/
+int budget_report(gamedata_t *gd) {
+    script_error_t *error = &gd->budget.error;
+    if (error->code == SCRIPT_OK) {
+        return FALSE;
+    }
+    static const char *reasons[] = { "", "step", "allocation", "call depth" };
+    gd_text_out(gd, "[The game's script took too long and was stopped.]\n");
+    gd_debug_out(gd, "budget: %s limit exceeded in %s after %ld steps and %lu allocations\n",
+                 reasons[error->code], error->where ? error->where : "(unknown)",
+                 error->steps, error->allocs);
+    return TRUE;
 }
 
-list_t* builtin_mul(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    int total = 1;
-    list_t *iter = args->child;
-    while (iter) {
-        if (iter->type != T_INTEGER) {
-            debug_out("mul: requires integer arguments\n");
-            return list_create_false();
+
+/* *********************************************************************** *
+* Functions for built-in scipt functions
+ * *********************************************************************** */
+
+
+/* Builtin names for the ARITH_* operators, in the same order. */
+static const char *arith_names[] = {
+    "add", "sub", "mul", "div", "mod", "lt", "gt", "le", "ge", "min", "max", NULL
+};
+
+/**
+Find the arithmetic or comparison operator a builtin performs.
+
+Returns one of the ARITH_* values, or -1 if the builtin is not one of them.
+*/
+int arith_lookup(const char *name) {
+    for (int i = 0; arith_names[i]; ++i) {
+        if (strcmp(arith_names[i], name) == 0) {
+            return i;
         }
-        total *= iter->number;
-        iter = iter->next;
     }
-    list_t *result = list_create();
-    result->type = T_INTEGER;
-    result->number = total;
-    return result;
+    return -1;
+}
+
+/**
+Apply an arithmetic or comparison operator to two integers. Comparisons
+give 1 or 0.
+
+Returns false, leaving result unchanged, if the result would overflow or
+the operator divides by zero; returns true otherwise.
+*/
+int arith_binary(int op, int left, int right, int *result) {
+    long long wide;
+    switch(op) {
+        case ARITH_ADD: wide = (long long)left + right; break;
+        case ARITH_SUB: wide = (long long)left - right; break;
+        case ARITH_MUL: wide = (long long)left * right; break;
+        case ARITH_DIV:
+            if (right == 0) return FALSE;
+            wide = (long long)left / right;
+            break;
+        case ARITH_MOD:
+            if (right == 0) return FALSE;
+            wide = (long long)left % right;
+            break;
+        case ARITH_LT:  wide = left < right;  break;
+        case ARITH_GT:  wide = left > right;  break;
+        case ARITH_LE:  wide = left <= right; break;
+        case ARITH_GE:  wide = left >= right; break;
+        case ARITH_MIN: wide = left < right ? left : right; break;
+        case ARITH_MAX: wide = left > right ? left : right; break;
+        default:
+            return FALSE;
+    }
+    if (wide < INT_MIN || wide > INT_MAX) {
+        return FALSE;
+    }
+    *result = (int)wide;
+    return TRUE;
 }
 
-list_t* builtin_div(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    int total = 0;
-    list_t *iter = args->child;
-    if (iter) {
-        if (iter->type != T_INTEGER) {
-            debug_out("div: requires integer arguments\n");
-            return list_create_false();
+/* Shared by the arithmetic and comparison builtins. Arithmetic folds its
+ * arguments from the left; a comparison is true if it holds between every
+ * pair of neighbouring arguments, so (lt a b c) means a < b < c. */
+svalue_t arith_apply(gamedata_t *gd, int op, int argc, svalue_t *argv) {
+    const char *name = arith_names[op];
+    for (int i = 0; i < argc; ++i) {
+        if (argv[i].type != T_INTEGER) {
+            gd_debug_out(gd, "%s: requires integer arguments\n", name);
+            return value_false();
         }
-        total = iter->number;
-        iter = iter->next;
+    }
+
+    if (argc == 0) {
+        switch(op) {
+            case ARITH_MUL:
+                return value_int(1);
+            case ARITH_MIN:
+            case ARITH_MAX:
+                gd_debug_out(gd, "%s: requires at least one argument\n", name);
+                return value_false();
+            case ARITH_LT:
+            case ARITH_GT:
+            case ARITH_LE:
+            case ARITH_GE:
+                return value_true();
+            default:
+                return value_int(0);
+        }
+    }
 
-        while (iter) {
-            if (iter->type != T_INTEGER) {
-                debug_out("div: requires integer arguments\n");
-                return list_create_false();
+    int comparison = op >= ARITH_LT && op <= ARITH_GE;
+    int total = argv[0].d.number;
+    for (int i = 1; i < argc; ++i) {
+        int result;
+        if (!arith_binary(op, comparison ? argv[i - 1].d.number : total,
+                          argv[i].d.number, &result)) {
+            if ((op == ARITH_DIV || op == ARITH_MOD) && argv[i].d.number == 0) {
+                gd_debug_out(gd, "%s: division by zero\n", name);
+            } else {
+                gd_debug_out(gd, "%s: integer overflow\n", name);
             }
-            total /= iter->number;
-            iter = iter->next;
+            return value_false();
         }
+        if (comparison && !result) {
+            return value_false();
+        }
+        total = result;
     }
+    return comparison ? value_true() : value_int(total);
+}
 
-    list_t *result = list_create();
-    result->type = T_INTEGER;
-    result->number = total;
-    return result;
+svalue_t builtin_add(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_ADD, argc, argv);
+}
+
+svalue_t builtin_sub(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_SUB, argc, argv);
+}
+
+svalue_t builtin_mul(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_MUL, argc, argv);
 }
 
-list_t* builtin_dump_symbols(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    dump_symbol_table(stdout, gd);
-    return list_create_false();
+svalue_t builtin_div(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_DIV, argc, argv);
 }
 
-list_t* builtin_vocab(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    vocab_dump();
-    return list_create_false();
+svalue_t builtin_mod(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_MOD, argc, argv);
 }
 
-list_t* builtin_log(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    debug_out("builtin_log:");
-    if (!args || !args->child) {
-        debug_out(" NULL\n");
-        return list_create_false();
+svalue_t builtin_lt(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_LT, argc, argv);
+}
+
+svalue_t builtin_gt(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_GT, argc, argv);
+}
+
+svalue_t builtin_le(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_LE, argc, argv);
+}
+
+svalue_t builtin_ge(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_GE, argc, argv);
+}
+
+svalue_t builtin_min(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_MIN, argc, argv);
+}
+
+svalue_t builtin_max(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return arith_apply(gd, ARITH_MAX, argc, argv);
+}
+
+svalue_t builtin_dump_symbols(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    dump_symbol_table(gd->out, gd->program);
+    return value_false();
+}
+
+svalue_t builtin_vocab(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    vocab_dump(gd->out, gd->program->vocab);
+    return value_false();
+}
+
+svalue_t builtin_log(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    gd_debug_out(gd, "builtin_log:");
+    if (argc == 0) {
+        gd_debug_out(gd, " NULL\n");
+        return value_false();
     }
-    list_t *list = args->child;
-    while (list) {
-        builtin_log_helper(gd, locals, list);
-        list = list->next;
+    for (int i = 0; i < argc; ++i) {
+        builtin_log_helper(gd, locals, argv[i].d.list);
     }
-    debug_out("\n");
-    return list_create_false();
+    gd_debug_out(gd, "\n");
+    return value_false();
 }
 void builtin_log_helper(gamedata_t *gd, symboltable_t *locals, list_t *list) {
-    list_t *result = NULL;
+    svalue_t result;
     switch(list->type) {
         case T_LIST:
-            debug_out(" {");
+            gd_debug_out(gd, " {");
             list_t *child = list->child;
             while (child) {
                 builtin_log_helper(gd, locals, child);
                 child = child->next;
             }
-            debug_out(" }");
+            gd_debug_out(gd, " }");
             break;
         case T_ATOM:
-            debug_out(" %s =", list->text);
+            gd_debug_out(gd, " %s =", list->text);
             if (is_defined(gd, locals, list)) {
                 result = list_evaluate(gd, locals, list);
-                builtin_log_helper(gd, locals, result);
+                builtin_log_value(gd, result);
+                value_free(result);
             } else {
-                debug_out(" NULL");
+                gd_debug_out(gd, " NULL");
             }
             break;
         case T_STRING:
-            debug_out(" %s", list->text);
+            gd_debug_out(gd, " %s", list->text);
             break;
         case T_INTEGER:
-            debug_out(" %d", list->number);
+            gd_debug_out(gd, " %d", list->number);
             break;
         case T_OBJECT_REF:
-            debug_out(" [object@%p]", list->ptr);
+            gd_debug_out(gd, " [object@%p]", list->ptr);
             break;
         case T_FUNCTION_REF:
-            debug_out(" [function@%p]", list->ptr);
+            gd_debug_out(gd, " [function@%p]", list->ptr);
             break;
         default:
-            debug_out(" [unsupported list type %d]", list->type);
+            gd_debug_out(gd, " [unsupported list type %d]", list->type);
     }
 }
-
-list_t* builtin_say(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args || !args->child) {
-        return list_create_false();
+void builtin_log_value(gamedata_t *gd, svalue_t value) {
+    switch(value.type) {
+        case T_INTEGER:
+            gd_debug_out(gd, " %d", value.d.number);
+            break;
+        case T_OBJECT_REF:
+            gd_debug_out(gd, " [object@%p]", value.d.ptr);
+            break;
+        case T_FUNCTION_REF:
+            gd_debug_out(gd, " [function@%p]", value.d.ptr);
+            break;
+        default:
+            builtin_log_helper(gd, NULL, value.d.list);
     }
-    list_t *list = args->child;
-    while (list) {
-        switch(list->type) {
+}
+
+svalue_t builtin_say(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    for (int i = 0; i < argc; ++i) {
+        switch(argv[i].type) {
             case T_OBJECT_REF:
-                object_name_print(gd, list->ptr);
+                object_name_print(gd, argv[i].d.ptr);
                 break;
             case T_STRING:
-                text_out("%s", list->text);
+                gd_text_out(gd, "%s", argv[i].d.list->text);
                 break;
             case T_INTEGER:
-                text_out("%d", list->number);
+                gd_text_out(gd, "%d", argv[i].d.number);
                 break;
             default:
-                text_out("[unsupported type %d]", list->type);
+                gd_text_out(gd, "[unsupported type %d]", argv[i].type);
         }
-        list = list->next;
     }
-    return list_create_false();
+    return value_false();
 }
 
-list_t* builtin_list(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    return list_duplicate(args);
+svalue_t builtin_list(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    list_t *list = list_create();
+    for (int i = 0; i < argc; ++i) {
+        list_add(list, value_to_list(argv[i]));
+    }
+    return value_list(list);
 }
 
-list_t* builtin_quote(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child) {
-        return list_create();
+svalue_t builtin_quote(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc == 0) {
+        return value_list(list_create());
     } else {
-        if (args->child->next) {
-            debug_out("builtin_quote: extraneous arguments provided.\n");
+        if (argc > 1) {
+            gd_debug_out(gd, "builtin_quote: extraneous arguments provided.\n");
         }
-        return list_duplicate(args->child);
+        return value_from_list(argv[0].d.list);
     }
 }
 
-list_t* builtin_if(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child) {
-        debug_out("builtin_if: no condition supplied.\n");
-        return list_create_false();
+svalue_t builtin_if(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc == 0) {
+        gd_debug_out(gd, "builtin_if: no condition supplied.\n");
+        return value_false();
     }
-    list_t *result = list_evaluate(gd, locals, args->child);
-    int is_true = list_is_true(result);
-    list_free(result);
+    svalue_t result = list_evaluate(gd, locals, argv[0].d.list);
+    int is_true = value_is_true(result);
+    value_free(result);
 
-    list_t *good = args->child->next;
     if (is_true) {
-        if (good) {
-            result = list_evaluate(gd, locals, good);
+        if (argc > 1) {
+            return list_evaluate(gd, locals, argv[1].d.list);
         } else {
-            result = list_create_true();
+            return value_true();
         }
     } else {
-        if (good && good->next) {
-            result = list_evaluate(gd, locals, good->next);
+        if (argc > 2) {
+            return list_evaluate(gd, locals, argv[2].d.list);
         } else {
-            result = list_create_false();
+            return value_false();
         }
     }
-    return result;
 }
 
-static list_t* builtin_prop_has(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child || args->child->type != T_OBJECT_REF) {
-        return list_create_false();
+/* The VM points prop_site at the cache for the call site it is running. */
+static property_t *prop_lookup(gamedata_t *gd, object_t *object, int prop_id) {
+    if (gd && gd->prop_site) {
+        return object_property_get_cached(gd->prop_site, gd->world_epoch, object, prop_id);
     }
-    object_t *object = args->child->ptr;
+    return object_property_get(object, prop_id);
+}
 
-    if (!args->child->next || args->child->next->type != T_INTEGER) {
-        return list_create_false();
+static svalue_t builtin_prop_has(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 1 || argv[0].type != T_OBJECT_REF) {
+        return value_false();
     }
-    int prop_id = args->child->next->number;
+    object_t *object = argv[0].d.ptr;
 
-    property_t *property = object_property_get(object, prop_id);
-    if (property) {
-        return list_create_true();
-    } else {
-        return list_create_false();
+    if (argc < 2 || argv[1].type != T_INTEGER) {
+        return value_false();
     }
+    int prop_id = argv[1].d.number;
+
+    return value_bool(prop_lookup(gd, object, prop_id) != NULL);
 }
 
-static list_t* builtin_prop_get(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child || args->child->type != T_OBJECT_REF) {
-        return list_create_false();
+static svalue_t builtin_prop_get(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 1 || argv[0].type != T_OBJECT_REF) {
+        return value_false();
     }
-    object_t *object = args->child->ptr;
+    object_t *object = argv[0].d.ptr;
 
-    if (!args->child->next || args->child->next->type != T_INTEGER) {
-        return list_create_false();
+    if (argc < 2 || argv[1].type != T_INTEGER) {
+        return value_false();
     }
-    int prop_id = args->child->next->number;
+    int prop_id = argv[1].d.number;
 
-    property_t *property = object_property_get(object, prop_id);
+    property_t *property = prop_lookup(gd, object, prop_id);
     if (!property) {
-        return list_create_false();
+        return value_false();
     }
-    list_t *result = NULL;
     switch(property->value.type) {
         case PT_STRING:
-            result = list_create();
-            result->type = T_STRING;
-            result->text = str_dupl(property->value.d.ptr);
-            return result;
+            return value_string(property->value.d.ptr);
         case PT_INTEGER:
-            result = list_create();
-            result->type = T_INTEGER;
-            result->number = property->value.d.num;
-            return result;
+            return value_int(property->value.d.num);
         case PT_OBJECT:
-            result = list_create();
-            result->type = T_OBJECT_REF;
-            result->ptr = property->value.d.ptr;
-            return result;
+            return value_object(property->value.d.ptr);
         default:
-            debug_out("builtin_prop_get: unknown property type %d\n", property->value.type);
-            return list_create_false();
+            gd_debug_out(gd, "builtin_prop_get: unknown property type %d\n", property->value.type);
+            return value_false();
     }
 }
 /*
@@ -538,356 +882,441 @@ static list_t* builtin_prop_get(gamedata_t *gd, symboltable_t *locals, list_t *a
 #define PT_ARRAY 3
 */
 
-static list_t* builtin_proc(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    return list_duplicate(args->last);
+static svalue_t builtin_proc(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc == 0) {
+        return value_false();
+    }
+    return value_copy(argv[argc - 1]);
 }
 
-static list_t* builtin_parent(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child) {
-        debug_out("builtin_parent: called without argument\n");
-        return list_create_false();
+static svalue_t builtin_parent(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc == 0) {
+        gd_debug_out(gd, "builtin_parent: called without argument\n");
+        return value_false();
     }
 
-    if (args->child->type != T_OBJECT_REF) {
-        debug_out("builtin_parent: called with non-object\n");
-        return list_create_false();
+    if (argv[0].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_parent: called with non-object\n");
+        return value_false();
     }
 
-    object_t *object = args->child->ptr;
-    list_t *result = list_create();
-    result->type = T_OBJECT_REF;
+    object_t *object = argv[0].d.ptr;
     if (object->parent) {
-        result->ptr = object->parent;
+        return value_object(object->parent);
     } else {
-        result->ptr = gd->root;
+        return value_object(gd->root);
     }
-    return result;
 }
 
-list_t* builtin_bold(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    list_t *result = list_create();
-    result->type = T_STRING;
-    result->text = str_dupl("\x1b[1m");
-    return result;
+svalue_t builtin_bold(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return value_string("\x1b[1m");
 }
 
-list_t* builtin_normal(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    list_t *result = list_create();
-    result->type = T_STRING;
-    result->text = str_dupl("\x1b[0m");
-    return result;
+svalue_t builtin_normal(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return value_string("\x1b[0m");
 }
 
-list_t* builtin_reverse(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    list_t *result = list_create();
-    result->type = T_STRING;
-    result->text = str_dupl("\x1b[7m");
-    return result;
+svalue_t builtin_reverse(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return value_string("\x1b[7m");
 }
 
-list_t* builtin_prop_true(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child || !args->child->next) {
-        debug_out("builtin_prop_true: called with insufficent argument\n");
-        return list_create_false();
+svalue_t builtin_prop_true(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 2) {
+        gd_debug_out(gd, "builtin_prop_true: called with insufficent argument\n");
+        return value_false();
     }
 
-    if (args->child->type != T_OBJECT_REF) {
-        debug_out("builtin_prop_true: called with non-object\n");
-        return list_create_false();
+    if (argv[0].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_prop_true: called with non-object\n");
+        return value_false();
     }
-    if (args->child->next->type != T_INTEGER) {
-        debug_out("builtin_prop_true: called with non-integer\n");
-        return list_create_false();
+    if (argv[1].type != T_INTEGER) {
+        gd_debug_out(gd, "builtin_prop_true: called with non-integer\n");
+        return value_false();
     }
 
-    int raw_result = object_property_is_true(args->child->ptr, args->child->next->number, 0);
-
-    if (raw_result) {
-        return list_create_true();
-    } else {
-        return list_create_false();
-    }
+    return value_bool(property_is_true(prop_lookup(gd, argv[0].d.ptr, argv[1].d.number), 0));
 }
 
-list_t* builtin_or(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    list_t *iter = args->child;
-    while (iter) {
-        if (list_is_true(iter)) {
-            return list_create_true();
+svalue_t builtin_or(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    for (int i = 0; i < argc; ++i) {
+        if (value_is_true(argv[i])) {
+            return value_true();
         }
-        iter = iter->next;
     }
-    return list_create_false();
+    return value_false();
 }
-list_t* builtin_and(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    list_t *iter = args->child;
-    while (iter) {
-        if (!list_is_true(iter)) {
-            return list_create_false();
+svalue_t builtin_and(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    for (int i = 0; i < argc; ++i) {
+        if (!value_is_true(argv[i])) {
+            return value_false();
         }
-        iter = iter->next;
     }
-    return list_create_true();
+    return value_true();
 }
-list_t* builtin_not(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child) {
-        return list_create_false();
-    }
-    if (list_is_true(args->child)) {
-        return list_create_false();
-    } else {
-        return list_create_true();
+svalue_t builtin_not(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc == 0) {
+        return value_false();
     }
+    return value_bool(!value_is_true(argv[0]));
 }
 
-list_t* builtin_sibling(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child) {
-        debug_out("builtin_sibling: called without argument\n");
-        return list_create_false();
+svalue_t builtin_sibling(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc == 0) {
+        gd_debug_out(gd, "builtin_sibling: called without argument\n");
+        return value_false();
     }
 
-    if (args->child->type != T_OBJECT_REF) {
-        debug_out("builtin_sibling: called with non-object\n");
-        return list_create_false();
+    if (argv[0].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_sibling: called with non-object\n");
+        return value_false();
     }
 
-    object_t *object = args->child->ptr;
-    list_t *result;
+    object_t *object = argv[0].d.ptr;
     if (object->sibling) {
-        result = list_create();
-        result->type = T_OBJECT_REF;
-        result->ptr = object->sibling;
+        return value_object(object->sibling);
     } else {
-        result = list_create_false();
+        return value_false();
     }
-    return result;
 }
 
-list_t* builtin_child(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child) {
-        debug_out("builtin_child: called without argument\n");
-        return list_create_false();
+svalue_t builtin_child(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc == 0) {
+        gd_debug_out(gd, "builtin_child: called without argument\n");
+        return value_false();
     }
 
-    if (args->child->type != T_OBJECT_REF) {
-        debug_out("builtin_child: called with non-object\n");
-        return list_create_false();
+    if (argv[0].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_child: called with non-object\n");
+        return value_false();
     }
 
-    object_t *object = args->child->ptr;
-    list_t *result;
+    object_t *object = argv[0].d.ptr;
     if (object->first_child) {
-        result = list_create();
-        result->type = T_OBJECT_REF;
-        result->ptr = object->first_child;
+        return value_object(object->first_child);
     } else {
-        result = list_create_false();
+        return value_false();
     }
-    return result;
 }
 
-list_t* builtin_set(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child || !args->child->next) {
-        debug_out("builtin_set: called with insufficent arguments\n");
-        return list_create_false();
+svalue_t builtin_set(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 2) {
+        gd_debug_out(gd, "builtin_set: called with insufficent arguments\n");
+        return value_false();
     }
 
-    if (args->child->type != T_STRING) {
-        debug_out("builtin_set: called with insufficent arguments\n");
-        return list_create_false();
+    if (argv[0].type != T_STRING) {
+        gd_debug_out(gd, "builtin_set: called with insufficent arguments\n");
+        return value_false();
     }
-    char *name = args->child->text;
+    char *name = argv[0].d.list->text;
 
-    list_t *value = list_duplicate(args->child->next);
-    symbol_add_ptr(locals, name, SYM_LIST, value);
-    return list_create_true();
+    svalue_t *value = malloc(sizeof(svalue_t));
+    *value = value_copy(argv[1]);
+    symbol_add_ptr(locals, name, SYM_VALUE, value);
+    return value_true();
 }
 
-list_t* builtin_object_move(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child) {
-        debug_out("builtin_move: called without argument\n");
-        return list_create_false();
+svalue_t builtin_object_move(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc == 0) {
+        gd_debug_out(gd, "builtin_move: called without argument\n");
+        return value_false();
     }
-    object_t *object = list_to_object(args->child);
+    object_t *object = value_to_object(argv[0]);
     object_t *new_parent;
-    if (!args->child->next) {
+    if (argc < 2) {
         new_parent = gd->root;
     } else {
-        new_parent = list_to_object(args->child->next);
+        new_parent = value_to_object(argv[1]);
     }
 
     if (!object || !new_parent) {
-        debug_out("builtin_move: called with bad objects\n");
-        return list_create_false();
+        gd_debug_out(gd, "builtin_move: called with bad objects\n");
+        return value_false();
     }
 
     object_move(object, new_parent);
-    return list_create_true();
+    return value_true();
 }
 
-static list_t* builtin_contains(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child || args->child->type != T_OBJECT_REF) {
-        debug_out("builtin_contains: first argument must be object\n");
-        return list_create_false();
+static svalue_t builtin_contains(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 1 || argv[0].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_contains: first argument must be object\n");
+        return value_false();
     }
-    if (!args->child->next || args->child->next->type != T_OBJECT_REF) {
-        debug_out("builtin_contains: second argument must be object\n");
-        return list_create_false();
+    if (argc < 2 || argv[1].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_contains: second argument must be object\n");
+        return value_false();
     }
 
-    object_t *o1 = args->child->ptr;
-    object_t *o2 = args->child->next->ptr;
-
-    if (object_contains(o1, o2)) {
-        return list_create_true();
-    } else {
-        return list_create_false();
-    }
+    return value_bool(object_contains(argv[0].d.ptr, argv[1].d.ptr));
 }
 
-static list_t* builtin_contains_indirect(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child || args->child->type != T_OBJECT_REF) {
-        debug_out("builtin_contains_indirect: first argument must be object\n");
-        return list_create_false();
+static svalue_t builtin_contains_indirect(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 1 || argv[0].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_contains_indirect: first argument must be object\n");
+        return value_false();
     }
-    if (!args->child->next || args->child->next->type != T_OBJECT_REF) {
-        debug_out("builtin_contains_indirect: second argument must be object\n");
-        return list_create_false();
+    if (argc < 2 || argv[1].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_contains_indirect: second argument must be object\n");
+        return value_false();
     }
 
-    object_t *o1 = args->child->ptr;
-    object_t *o2 = args->child->next->ptr;
-
-    if (object_contains_indirect(o1, o2)) {
-        return list_create_true();
-    } else {
-        return list_create_false();
-    }
+    return value_bool(object_contains_indirect(argv[0].d.ptr, argv[1].d.ptr));
 }
 
-static list_t* builtin_eq(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child || !args->child->next) {
-        debug_out("builtin_eq: insufficent arguments\n");
-        return list_create_false();
+static svalue_t builtin_eq(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 2) {
+        gd_debug_out(gd, "builtin_eq: insufficent arguments\n");
+        return value_false();
     }
 
-    if (args->child->type != args->child->next->type) {
-        return list_create_false();
+    if (argv[0].type != argv[1].type) {
+        return value_false();
     }
 
-    switch(args->child->type) {
+    switch(argv[0].type) {
         case T_STRING:
-            return list_create_bool(strcmp(args->child->text, args->child->next->text) == 0);
+            return value_bool(strcmp(argv[0].d.list->text, argv[1].d.list->text) == 0);
         case T_INTEGER:
-            return list_create_bool(args->child->number == args->child->next->number);
+            return value_bool(argv[0].d.number == argv[1].d.number);
         case T_OBJECT_REF:
         case T_FUNCTION_REF:
-            return list_create_bool(args->child->ptr == args->child->next->ptr);
+            return value_bool(argv[0].d.ptr == argv[1].d.ptr);
         default:
-            debug_out("builtin_eq: unhandled list type %d\n", args->child->type);
-            return list_create_false();
+            gd_debug_out(gd, "builtin_eq: unhandled list type %d\n", argv[0].type);
+            return value_false();
     }
 }
 
-list_t* builtin_is_object(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (args->child && args->child->type == T_OBJECT_REF) {
-        return list_create_true();
-    } else {
-        return list_create_false();
-    }
+svalue_t builtin_is_object(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return value_bool(argc > 0 && argv[0].type == T_OBJECT_REF);
 }
 
-list_t* builtin_is_string(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (args->child && args->child->type == T_STRING) {
-        return list_create_true();
-    } else {
-        return list_create_false();
-    }
+svalue_t builtin_is_string(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return value_bool(argc > 0 && argv[0].type == T_STRING);
 }
 
-list_t* builtin_is_number(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (args->child && args->child->type == T_INTEGER) {
-        return list_create_true();
-    } else {
-        return list_create_false();
-    }
+svalue_t builtin_is_number(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return value_bool(argc > 0 && argv[0].type == T_INTEGER);
 }
 
-list_t* builtin_is_function(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (args->child && args->child->type == T_FUNCTION_REF) {
-        return list_create_true();
-    } else {
-        return list_create_false();
-    }
+svalue_t builtin_is_function(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return value_bool(argc > 0 && argv[0].type == T_FUNCTION_REF);
 }
 
-list_t* builtin_is_list(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (args->child && args->child->type == T_LIST) {
-        return list_create_true();
-    } else {
-        return list_create_false();
-    }
+svalue_t builtin_is_list(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return value_bool(argc > 0 && argv[0].type == T_LIST);
 }
 
-list_t* builtin_type_name(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child) {
-        return list_create_string("(nothing)");
+svalue_t builtin_type_name(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc == 0) {
+        return value_string("(nothing)");
     }
-    switch(args->child->type) {
-        case T_STRING:      return list_create_string("string");
-        case T_INTEGER:     return list_create_string("number");
-        case T_LIST:        return list_create_string("list");
-        case T_OBJECT_REF:  return list_create_string("object");
-        case T_FUNCTION_REF:return list_create_string("function");
+    switch(argv[0].type) {
+        case T_STRING:      return value_string("string");
+        case T_INTEGER:     return value_string("number");
+        case T_LIST:        return value_string("list");
+        case T_OBJECT_REF:  return value_string("object");
+        case T_FUNCTION_REF:return value_string("function");
         default:
-            debug_out("builtin_type_name: unhandled type %d\n");
-            return list_create_string("(unhandled)");
+            gd_debug_out(gd, "builtin_type_name: unhandled type %d\n", argv[0].type);
+            return value_string("(unhandled)");
     }
 }
 
-list_t* builtin_prop_set(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child || args->child->type != T_OBJECT_REF) {
-        debug_out("builtin_prop_set: first argument must be object\n");
-        return list_create_false();
+svalue_t builtin_prop_set(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 1 || argv[0].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_prop_set: first argument must be object\n");
+        return value_false();
     }
-    if (!args->child->next || args->child->next->type != T_INTEGER) {
-        debug_out("builtin_prop_set: second argument must be property number\n");
-        return list_create_false();
+    if (argc < 2 || argv[1].type != T_INTEGER) {
+        gd_debug_out(gd, "builtin_prop_set: second argument must be property number\n");
+        return value_false();
     }
-    object_t *obj = args->child->ptr;
-    int pid = args->child->next->number;
-    list_t *new_value = args->child->next->next;
+    object_t *obj = argv[0].d.ptr;
+    int pid = argv[1].d.number;
+    ++gd->world_epoch;
 
-    if (!new_value) {
+    if (argc < 3) {
         object_property_delete(obj, pid);
-        return list_create_true();
+        return value_true();
     }
-    switch(new_value->type) {
+    svalue_t new_value = argv[2];
+    switch(new_value.type) {
         case T_STRING:
-            object_property_add_string(obj, pid, str_dupl(new_value->text));
-            return list_create_true();
+            object_property_add_string(obj, pid, str_dupl(new_value.d.list->text));
+            return value_true();
         case T_INTEGER:
-            object_property_add_integer(obj, pid, new_value->number);
-            return list_create_true();
+            object_property_add_integer(obj, pid, new_value.d.number);
+            return value_true();
         case T_OBJECT_REF:
-            object_property_add_object(obj, pid, new_value->ptr);
-            return list_create_true();
+            object_property_add_object(obj, pid, new_value.d.ptr);
+            return value_true();
         default:
-            debug_out("builtin_prop_set: unhandled list type %d\n", new_value->type);
-            return list_create_false();
+            gd_debug_out(gd, "builtin_prop_set: unhandled list type %d\n", new_value.type);
+            return value_false();
     }
 }
 
-static list_t* builtin_request_quit(gamedata_t *gd, symboltable_t *locals, list_t *args) {
+static svalue_t builtin_request_quit(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
     gd->quit_game = TRUE;
-    return list_create_true();
+    return value_true();
+}
+
+static svalue_t builtin_dump_obj(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 1 || argv[0].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_dump_obj: first argument must be object\n");
+        return value_false();
+    }
+    object_dump(gd, argv[0].d.ptr);
+    return value_true();
+}
+
+/* (profile "start"|"stop"|"reset"|"report") or (profile "folded" filename) */
+static svalue_t builtin_profile(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 1 || argv[0].type != T_STRING) {
+        gd_debug_out(gd, "builtin_profile: first argument must be command string\n");
+        return value_false();
+    }
+    const char *command = argv[0].d.list->text;
+    if (strcmp(command, "start") == 0) {
+        profile_start(gd);
+    } else if (strcmp(command, "stop") == 0) {
+        profile_stop(gd);
+    } else if (strcmp(command, "reset") == 0) {
+        profile_reset(gd);
+    } else if (strcmp(command, "report") == 0) {
+        profile_report(gd, gd->out);
+    } else if (strcmp(command, "folded") == 0) {
+        if (argc < 2 || argv[1].type != T_STRING) {
+            gd_debug_out(gd, "builtin_profile: folded requires a filename\n");
+            return value_false();
+        }
+        return value_bool(profile_write_folded(gd, argv[1].d.list->text));
+    } else {
+        gd_debug_out(gd, "builtin_profile: unknown command %s\n", command);
+        return value_false();
+    }
+    return value_true();
+}
+
+/* The object builtins below take an object followed by an optional
+ * property filter: (children obj [property [want]]) visits only objects
+ * whose property is true, or, if want is given and false, only those whose
+ * property is false or missing. */
+static int object_filter_args(gamedata_t *gd, const char *name, int argc, svalue_t *argv,
+                              int *pid, int *want) {
+    if (argc < 1 || argv[0].type != T_OBJECT_REF) {
+        gd_debug_out(gd, "builtin_%s: first argument must be object\n", name);
+        return FALSE;
+    }
+    *pid = -1;
+    *want = TRUE;
+    if (argc > 1) {
+        if (argv[1].type != T_INTEGER) {
+            gd_debug_out(gd, "builtin_%s: second argument must be property number\n", name);
+            return FALSE;
+        }
+        *pid = argv[1].d.number;
+    }
+    if (argc > 2) {
+        *want = value_is_true(argv[2]);
+    }
+    return TRUE;
+}
+
+static svalue_t object_collect(gamedata_t *gd, const char *name, int descend, int argc, svalue_t *argv) {
+    int pid, want;
+    if (!object_filter_args(gd, name, argc, argv, &pid, &want)) {
+        return value_false();
+    }
+    object_t *root = argv[0].d.ptr;
+    list_t *list = list_create();
+    for (object_t *cur = object_next_in(root, NULL, descend, pid, want); cur;
+            cur = object_next_in(root, cur, descend, pid, want)) {
+        list_add(list, value_to_list(value_object(cur)));
+    }
+    return value_list(list);
+}
+
+static svalue_t object_count(gamedata_t *gd, const char *name, int descend, int argc, svalue_t *argv) {
+    int pid, want;
+    if (!object_filter_args(gd, name, argc, argv, &pid, &want)) {
+        return value_false();
+    }
+    return value_int(object_count_in(argv[0].d.ptr, descend, pid, want));
+}
+
+static svalue_t builtin_children(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return object_collect(gd, "children", FALSE, argc, argv);
+}
+
+static svalue_t builtin_descendants(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return object_collect(gd, "descendants", TRUE, argc, argv);
+}
+
+static svalue_t builtin_count_children(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return object_count(gd, "count_children", FALSE, argc, argv);
+}
+
+static svalue_t builtin_count_descendants(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    return object_count(gd, "count_descendants", TRUE, argc, argv);
+}
+
+static svalue_t builtin_first_child(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    int pid, want;
+    if (!object_filter_args(gd, "first_child", argc, argv, &pid, &want)) {
+        return value_false();
+    }
+    object_t *found = object_next_in(argv[0].d.ptr, NULL, FALSE, pid, want);
+    return found ? value_object(found) : value_false();
+}
+
+static svalue_t builtin_next_sibling(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    int pid, want;
+    if (!object_filter_args(gd, "next_sibling", argc, argv, &pid, &want)) {
+        return value_false();
+    }
+    object_t *object = argv[0].d.ptr;
+    object_t *found = object_next_in(object->parent, object, FALSE, pid, want);
+    return found ? value_object(found) : value_false();
+}
+
+/* (for-each list function [extra...]) calls (function item index count
+ * extra...) for each item of list and returns the number of items. */
+static svalue_t builtin_for_each(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 1 || argv[0].type != T_LIST) {
+        gd_debug_out(gd, "builtin_for_each: first argument must be list\n");
+        return value_false();
+    }
+    if (argc < 2 || argv[1].type != T_FUNCTION_REF) {
+        gd_debug_out(gd, "builtin_for_each: second argument must be function\n");
+        return value_false();
+    }
+    list_t *list = argv[0].d.list;
+    function_t *func = argv[1].d.ptr;
+    int count = list_size(list);
+    int extra = argc - 2;
+
+    svalue_t args[3 + extra];
+    memcpy(&args[3], &argv[2], sizeof(svalue_t) * extra);
+    args[2] = value_int(count);
+    int index = 0;
+    for (list_t *item = list->child; item && gd->budget.error.code == SCRIPT_OK; item = item->next) {
+        args[0] = value_from_list(item);
+        args[1] = value_int(index++);
+        value_free(list_run_function(gd, func, 3 + extra, args));
+    }
+    return value_int(count);
 }
 
-static list_t* builtin_dump_obj(gamedata_t *gd, symboltable_t *locals, list_t *args) {
-    if (!args->child || args->child->type != T_OBJECT_REF) {
-        debug_out("builtin_dump_obj: first argument must be object\n");
-        return list_create_false();
+/* (reload filename) replaces the functions and grammar in one of the game's
+ * source files with what the file now defines, for every session. */
+static svalue_t builtin_reload(gamedata_t *gd, symboltable_t *locals, int argc, svalue_t *argv) {
+    if (argc < 1 || argv[0].type != T_STRING) {
+        gd_debug_out(gd, "builtin_reload: argument must be file name string\n");
+        return value_false();
     }
-    object_dump(gd, args->child->ptr);
-    return list_create_true();
+    return value_bool(reload_file(gd->program, argv[0].d.list->text, NULL, NULL));
 }
@@ -0,0 +1,675 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parse.h"
+
+/* A game image is a loaded and linked program written out as one block of
+ * memory: the program_t and every structure it points to. Pointers in the
+ * block are stored as offsets from its start, and a relocation table lists
+ * where they are, so the image can be mapped at any address and made usable
+ * by adding that address to each of them.
+ *
+ * The block has two regions. Structures containing pointers come first;
+ * strings and other pointer-free data follow, starting on a page boundary.
+ * Relocation only writes to the first region, so the pages of the second
+ * stay shared with the page cache (and with every other process that maps
+ * the same image).
+ *
+ * Bytecode is not stored. It is cheap to produce and full of pointers into
+ * session-independent heap data, so functions are compiled again when an
+ * image is loaded.
+ *
+ * The list of source files the program was loaded from is stored with it,
+ * so a game loaded from an image can still reload them. Grammar lines a
+ * reload replaces may then be in the mapping, and are not freed. */
+
+#define IMAGE_MAGIC     "IFPIMAGE"
+#define IMAGE_VERSION   2
+#define IMAGE_ALIGN     8
+#define IMAGE_PAGE      4096
+
+/* Marks an offset into the pointer-free region while the image is being
+ * built; the region's final position is not known until it is written. */
+#define IMAGE_FLAT_BIT  ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+typedef struct IMAGE_HEADER {
+    char magic[8];
+    uint32_t version;
+    uint32_t pointer_size;      /* sizeof(void*) where the image was written */
+    uint32_t struct_sizes;      /* a checksum of the layout of saved types */
+    uint32_t reserved;
+    uint64_t data_offset;       /* where the block starts in the file */
+    uint64_t data_size;
+    uint64_t reloc_offset;      /* where the relocation table starts */
+    uint64_t reloc_count;
+    uint64_t program;           /* offset of the program_t in the block */
+    uint64_t source_hash;       /* the program's source_hash */
+} image_header_t;
+
+typedef struct IMAGE_PLACED {
+    const void *ptr;
+    size_t offset;
+} image_placed_t;
+
+struct IMAGE_WRITER {
+    char *data;                 /* structures containing pointers */
+    size_t size, capacity;
+    char *flat;                 /* pointer-free data */
+    size_t flat_size, flat_capacity;
+
+    size_t *relocs;             /* offsets of pointer fields in data */
+    size_t reloc_count, reloc_capacity;
+
+    image_placed_t *placed;     /* where already written things went */
+    size_t placed_count, placed_capacity;
+};
+
+/* A mapped image, kept by the program loaded from it. */
+struct IMAGE {
+    void *map;
+    size_t length;
+};
+
+static uint32_t image_layout();
+static size_t image_grow(char **buffer, size_t *size, size_t *capacity, const void *src, size_t length);
+static size_t placed_hash(const void *ptr, size_t capacity);
+static size_t image_find(image_writer_t *w, const void *ptr);
+static void image_remember(image_writer_t *w, const void *ptr, size_t offset);
+static size_t write_list(image_writer_t *w, list_t *list, size_t *last_node);
+static size_t write_function(image_writer_t *w, function_t *func);
+static void write_object(image_writer_t *w, object_t *obj);
+static void write_value(value_t *dest, const value_t *src);
+static size_t write_value_pointer(image_writer_t *w, value_t *value);
+static size_t write_symbols(image_writer_t *w, symboltable_t *table);
+static size_t write_actions(image_writer_t *w, action_t *action);
+static size_t write_sources(image_writer_t *w, source_file_t *source);
+static size_t write_program(image_writer_t *w, program_t *prog);
+
+/* Changes to the saved structures should change this, so that old images
+ * are refused instead of misread. */
+uint32_t image_layout() {
+    uint32_t layout = 0;
+    size_t sizes[] = {
+        sizeof(program_t), sizeof(object_t), sizeof(property_t), sizeof(value_t),
+        sizeof(symbol_t), sizeof(symboltable_t), sizeof(function_t), sizeof(list_t),
+        sizeof(action_t), sizeof(grammar_t)
+    };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        layout = layout * 31 + (uint32_t)sizes[i];
+    }
+    return layout;
+}
+
+
+/* ****************************************************************************
+ * Building an image
+ * ****************************************************************************/
+
+size_t image_grow(char **buffer, size_t *size, size_t *capacity, const void *src, size_t length) {
+    size_t offset = (*size + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+    if (offset + length > *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 65536;
+        while (offset + length > new_capacity) {
+            new_capacity *= 2;
+        }
+        *buffer = realloc(*buffer, new_capacity);
+        *capacity = new_capacity;
+    }
+    memset(*buffer + *size, 0, offset - *size);
+    if (src) {
+        memcpy(*buffer + offset, src, length);
+    } else {
+        memset(*buffer + offset, 0, length);
+    }
+    *size = offset + length;
+    return offset;
+}
+
+/**
+Add a structure to an image, copying it from src (or zeroing it if src is
+NULL). Its pointer fields must then be set with image_pointer.
+
+Returns the offset of the copy, for use with image_at and image_pointer.
+*/
+size_t image_alloc(image_writer_t *w, const void *src, size_t length) {
+    return image_grow(&w->data, &w->size, &w->capacity, src, length);
+}
+
+/**
+Add data that contains no pointers to an image.
+
+Returns its offset, which may only be used as the target of image_pointer.
+*/
+size_t image_alloc_flat(image_writer_t *w, const void *src, size_t length) {
+    return image_grow(&w->flat, &w->flat_size, &w->flat_capacity, src, length) | IMAGE_FLAT_BIT;
+}
+
+/**
+Get the address of a structure added by image_alloc. The address is only
+valid until something else is added to the image.
+*/
+void *image_at(image_writer_t *w, size_t offset) {
+    return w->data + offset;
+}
+
+/**
+Set the pointer field at the given offset to point to a target added to the
+image, or to NULL if target is 0.
+*/
+void image_pointer(image_writer_t *w, size_t field, size_t target) {
+    uintptr_t value = target;
+    memcpy(w->data + field, &value, sizeof(value));
+    if (!target) {
+        return;
+    }
+    if (w->reloc_count >= w->reloc_capacity) {
+        w->reloc_capacity = w->reloc_capacity ? w->reloc_capacity * 2 : 1024;
+        w->relocs = realloc(w->relocs, sizeof(size_t) * w->reloc_capacity);
+    }
+    w->relocs[w->reloc_count++] = field;
+}
+
+size_t placed_hash(const void *ptr, size_t capacity) {
+    uintptr_t key = (uintptr_t)ptr;
+    key ^= key >> 17;
+    key *= 0x9E3779B1u;
+    return (key ^ (key >> 15)) & (capacity - 1);
+}
+
+/* Returns the offset something was written at, or 0 if it has not been. */
+size_t image_find(image_writer_t *w, const void *ptr) {
+    if (!w->placed_capacity) {
+        return 0;
+    }
+    size_t slot = placed_hash(ptr, w->placed_capacity);
+    while (w->placed[slot].ptr) {
+        if (w->placed[slot].ptr == ptr) {
+            return w->placed[slot].offset;
+        }
+        slot = (slot + 1) & (w->placed_capacity - 1);
+    }
+    return 0;
+}
+
+void image_remember(image_writer_t *w, const void *ptr, size_t offset) {
+    if (w->placed_count * 2 >= w->placed_capacity) {
+        size_t old_capacity = w->placed_capacity;
+        image_placed_t *old = w->placed;
+        w->placed_capacity = old_capacity ? old_capacity * 2 : 1024;
+        w->placed = calloc(sizeof(image_placed_t), w->placed_capacity);
+        w->placed_count = 0;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old[i].ptr) {
+                image_remember(w, old[i].ptr, old[i].offset);
+            }
+        }
+        free(old);
+    }
+    size_t slot = placed_hash(ptr, w->placed_capacity);
+    while (w->placed[slot].ptr) {
+        slot = (slot + 1) & (w->placed_capacity - 1);
+    }
+    w->placed[slot].ptr = ptr;
+    w->placed[slot].offset = offset;
+    ++w->placed_count;
+}
+
+/**
+Add a string to an image. A string already added (the same pointer, not
+just the same text) is only stored once.
+
+Returns the string's offset, or 0 for a NULL string.
+*/
+size_t image_string(image_writer_t *w, const char *text) {
+    if (!text) {
+        return 0;
+    }
+    size_t offset = image_find(w, text);
+    if (!offset) {
+        offset = image_alloc_flat(w, text, strlen(text) + 1);
+        image_remember(w, text, offset);
+    }
+    return offset;
+}
+
+/* Write a list node and the nodes following it. Returns the offset of the
+ * first, and sets *last_node (if not NULL) to the offset of the last. */
+size_t write_list(image_writer_t *w, list_t *list, size_t *last_node) {
+    size_t first = 0, prev = 0;
+    for (; list; list = list->next) {
+        size_t node = image_alloc(w, list, sizeof(list_t));
+        if (prev) {
+            image_pointer(w, prev + offsetof(list_t, next), node);
+        } else {
+            first = node;
+        }
+        size_t text = 0, ptr = 0, child = 0, last = 0;
+        switch(list->type) {
+            case T_ATOM:
+            case T_STRING:
+            case T_VOCAB:
+                text = image_string(w, list->text);
+                break;
+            case T_OBJECT_REF:
+                ptr = image_find(w, list->ptr);
+                break;
+            case T_FUNCTION_REF:
+                ptr = write_function(w, list->ptr);
+                break;
+            case T_LIST:
+                child = write_list(w, list->child, &last);
+                break;
+        }
+        image_pointer(w, node + offsetof(list_t, text), text);
+        image_pointer(w, node + offsetof(list_t, ptr), ptr);
+        image_pointer(w, node + offsetof(list_t, child), child);
+        image_pointer(w, node + offsetof(list_t, last), last);
+        image_pointer(w, node + offsetof(list_t, next), 0);
+        prev = node;
+    }
+    if (last_node) {
+        *last_node = prev;
+    }
+    return first;
+}
+
+size_t write_function(image_writer_t *w, function_t *func) {
+    if (!func) {
+        return 0;
+    }
+    size_t offset = image_find(w, func);
+    if (offset) {
+        return offset;
+    }
+    offset = image_alloc(w, func, sizeof(function_t));
+    image_remember(w, func, offset);
+    function_t *copy = image_at(w, offset);
+    memset(&copy->symbols, 0, sizeof(symboltable_t));
+    copy->code = NULL;
+    copy->latest = NULL;
+    image_pointer(w, offset + offsetof(function_t, name), image_string(w, func->name));
+    image_pointer(w, offset + offsetof(function_t, arg_list), write_list(w, func->arg_list, NULL));
+    image_pointer(w, offset + offsetof(function_t, body), write_list(w, func->body, NULL));
+    return offset;
+}
+
+size_t write_value_pointer(image_writer_t *w, value_t *value) {
+    switch(value->type) {
+        case PT_STRING:
+            return image_string(w, value->d.ptr);
+        case PT_OBJECT:
+            return image_find(w, value->d.ptr);
+        case PT_ARRAY: {
+            size_t array = image_alloc(w, NULL, sizeof(value_t) * value->array_size);
+            for (int i = 0; i < value->array_size; ++i) {
+                value_t *item = &((value_t*)value->d.ptr)[i];
+                write_value((value_t*)image_at(w, array) + i, item);
+                if (item->type == PT_STRING || item->type == PT_OBJECT) {
+                    image_pointer(w, array + sizeof(value_t) * i + offsetof(value_t, d.ptr),
+                                  write_value_pointer(w, item));
+                }
+            }
+            return array; }
+        default:
+            return 0;
+    }
+}
+
+/* Set up the copy of a value in an image with only its defined fields, so
+ * that the image holds no padding or leftover union bytes from the heap and
+ * the same game always gives the same image. Pointers are set afterwards
+ * with image_pointer. */
+void write_value(value_t *dest, const value_t *src) {
+    memset(dest, 0, sizeof(value_t));
+    dest->type = src->type;
+    dest->array_size = src->array_size;
+    if (src->type == PT_INTEGER) {
+        dest->d.num = src->d.num;
+    }
+}
+
+/* Objects are placed before anything else is written, so that references
+ * to them can be filled in as soon as they are met. */
+void write_object(image_writer_t *w, object_t *obj) {
+    size_t offset = image_find(w, obj);
+    image_pointer(w, offset + offsetof(object_t, parent), image_find(w, obj->parent));
+    image_pointer(w, offset + offsetof(object_t, first_child), image_find(w, obj->first_child));
+    image_pointer(w, offset + offsetof(object_t, sibling), image_find(w, obj->sibling));
+    image_pointer(w, offset + offsetof(object_t, parent_name), image_string(w, obj->parent_name));
+    image_pointer(w, offset + offsetof(object_t, prototype_name), image_string(w, obj->prototype_name));
+
+    size_t field = offset + offsetof(object_t, properties);
+    for (property_t *prop = obj->properties; prop; prop = prop->next) {
+        size_t copy = image_alloc(w, NULL, sizeof(property_t));
+        property_t *canonical = image_at(w, copy);
+        canonical->id = prop->id;
+        canonical->flags = prop->flags;
+        write_value(&canonical->value, &prop->value);
+        image_pointer(w, field, copy);
+        if (prop->value.type == PT_STRING || prop->value.type == PT_OBJECT
+                || prop->value.type == PT_ARRAY) {
+            image_pointer(w, copy + offsetof(property_t, value.d.ptr),
+                          write_value_pointer(w, &prop->value));
+        }
+        field = copy + offsetof(property_t, next);
+    }
+    image_pointer(w, field, 0);
+}
+
+size_t write_symbols(image_writer_t *w, symboltable_t *table) {
+    size_t offset = image_alloc(w, NULL, sizeof(symboltable_t));
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        size_t field = offset + offsetof(symboltable_t, buckets) + sizeof(symbol_t*) * i;
+        for (symbol_t *symbol = table->buckets[i]; symbol; symbol = symbol->next) {
+            size_t copy = image_alloc(w, symbol, sizeof(symbol_t));
+            image_pointer(w, field, copy);
+            image_pointer(w, copy + offsetof(symbol_t, name), image_string(w, symbol->name));
+            if (symbol->type == SYM_OBJECT) {
+                image_pointer(w, copy + offsetof(symbol_t, d.ptr), image_find(w, symbol->d.ptr));
+            } else if (symbol->type == SYM_FUNCTION) {
+                image_pointer(w, copy + offsetof(symbol_t, d.ptr), write_function(w, symbol->d.ptr));
+            }
+            field = copy + offsetof(symbol_t, next);
+        }
+        image_pointer(w, field, 0);
+    }
+    return offset;
+}
+
+size_t write_actions(image_writer_t *w, action_t *action) {
+    size_t first = 0, field = 0;
+    for (; action; action = action->next) {
+        size_t copy = image_alloc(w, action, sizeof(action_t));
+        image_remember(w, action, copy);
+        if (field) {
+            image_pointer(w, field, copy);
+        } else {
+            first = copy;
+        }
+        image_pointer(w, copy + offsetof(action_t, action_func), write_function(w, action->action_func));
+        image_pointer(w, copy + offsetof(action_t, action_name), image_string(w, action->action_name));
+        for (int i = 0; i < GT_MAX_TOKENS; ++i) {
+            /* only scope tokens still point at anything once linked */
+            size_t target = 0;
+            if (action->grammar[i].type == GT_SCOPE) {
+                target = image_find(w, action->grammar[i].ptr);
+            }
+            image_pointer(w, copy + offsetof(action_t, grammar) + sizeof(grammar_t) * i
+                             + offsetof(grammar_t, ptr), target);
+        }
+        field = copy + offsetof(action_t, next);
+        image_pointer(w, field, 0);
+    }
+    return first;
+}
+
+/* Write the source file list. Actions must already have been written. */
+size_t write_sources(image_writer_t *w, source_file_t *source) {
+    size_t first = 0, field = 0;
+    for (; source; source = source->next) {
+        size_t copy = image_alloc(w, source, sizeof(source_file_t));
+        if (field) {
+            image_pointer(w, field, copy);
+        } else {
+            first = copy;
+        }
+        image_pointer(w, copy + offsetof(source_file_t, name), image_string(w, source->name));
+        image_pointer(w, copy + offsetof(source_file_t, first_action),
+                      image_find(w, source->first_action));
+        field = copy + offsetof(source_file_t, next);
+        image_pointer(w, field, 0);
+    }
+    return first;
+}
+
+size_t write_program(image_writer_t *w, program_t *prog) {
+    /* offset 0 stands for NULL, so nothing may be placed there */
+    image_alloc(w, NULL, IMAGE_ALIGN);
+    size_t offset = image_alloc(w, prog, sizeof(program_t));
+
+    size_t objects = image_alloc(w, NULL, sizeof(object_t*) * prog->object_count);
+    for (int i = 0; i < prog->object_count; ++i) {
+        size_t obj = image_alloc(w, prog->objects[i], sizeof(object_t));
+        image_remember(w, prog->objects[i], obj);
+        image_pointer(w, objects + sizeof(object_t*) * i, obj);
+    }
+    for (int i = 0; i < prog->object_count; ++i) {
+        write_object(w, prog->objects[i]);
+    }
+
+    program_t *copy = image_at(w, offset);
+    copy->object_capacity = prog->object_count;
+    copy->prop_cache_count = 0;
+    copy->image = NULL;
+    copy->reload = NULL;
+    image_pointer(w, offset + offsetof(program_t, objects), objects);
+    image_pointer(w, offset + offsetof(program_t, root), image_find(w, prog->root));
+    image_pointer(w, offset + offsetof(program_t, symbols), write_symbols(w, prog->symbols));
+    image_pointer(w, offset + offsetof(program_t, actions), write_actions(w, prog->actions));
+    image_pointer(w, offset + offsetof(program_t, sources), write_sources(w, prog->sources));
+    image_pointer(w, offset + offsetof(program_t, vocab), vocab_write_image(w, prog->vocab));
+    return offset;
+}
+
+/**
+Write a loaded program to a file as a game image, which image_load can
+later map in place of loading the game's source.
+
+Returns true on success and false if the file could not be written.
+*/
+int image_write(program_t *prog, const char *filename) {
+    image_writer_t w;
+    memset(&w, 0, sizeof(w));
+    size_t program = write_program(&w, prog);
+
+    /* the pointer-free region goes after the rest, on its own pages */
+    size_t flat_start = (w.size + IMAGE_PAGE - 1) & ~(size_t)(IMAGE_PAGE - 1);
+    for (size_t i = 0; i < w.reloc_count; ++i) {
+        uintptr_t value;
+        memcpy(&value, w.data + w.relocs[i], sizeof(value));
+        if (value & IMAGE_FLAT_BIT) {
+            value = (value & ~IMAGE_FLAT_BIT) + flat_start;
+            memcpy(w.data + w.relocs[i], &value, sizeof(value));
+        }
+    }
+
+    image_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.pointer_size = sizeof(void*);
+    header.struct_sizes = image_layout();
+    header.data_offset = IMAGE_PAGE;
+    header.data_size = flat_start + w.flat_size;
+    header.reloc_offset = header.data_offset + header.data_size;
+    header.reloc_count = w.reloc_count;
+    header.program = program;
+    header.source_hash = prog->source_hash;
+
+    int success = FALSE;
+    FILE *dest = fopen(filename, "wb");
+    if (!dest) {
+        debug_out("image_write: could not open %s\n", filename);
+    } else {
+        char padding[IMAGE_PAGE];
+        memset(padding, 0, sizeof(padding));
+        success = fwrite(&header, sizeof(header), 1, dest) == 1
+               && fwrite(padding, IMAGE_PAGE - sizeof(header), 1, dest) == 1
+               && fwrite(w.data, 1, w.size, dest) == w.size
+               && fwrite(padding, 1, flat_start - w.size, dest) == flat_start - w.size
+               && fwrite(w.flat, 1, w.flat_size, dest) == w.flat_size;
+        for (size_t i = 0; success && i < w.reloc_count; ++i) {
+            uint64_t field = w.relocs[i];
+            success = fwrite(&field, sizeof(field), 1, dest) == 1;
+        }
+        if (fclose(dest) != 0) {
+            success = FALSE;
+        }
+        if (!success) {
+            debug_out("image_write: could not write %s\n", filename);
+        }
+    }
+    TRACE(TRACE_LOADER, TRACE_INFO, "image_write: %zu bytes of structures, %zu of text, %zu relocations\n",
+          w.size, w.flat_size, w.reloc_count);
+
+    free(w.data);
+    free(w.flat);
+    free(w.relocs);
+    free(w.placed);
+    return success;
+}
+
+
+/* ****************************************************************************
+ * Loading an image
+ * ****************************************************************************/
+
+/**
+Map a game image written by image_write. The program is used where it lies
+in the mapping; only its pointers are adjusted, and its functions compiled
+to bytecode.
+
+Returns the program, or NULL if the file is missing or is not a valid image
+for this build.
+*/
+program_t *image_load(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        debug_out("image_load: could not open %s\n", filename);
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(image_header_t)) {
+        debug_out("image_load: %s is not a game image\n", filename);
+        close(fd);
+        return NULL;
+    }
+    size_t length = info.st_size;
+    char *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        debug_out("image_load: could not map %s\n", filename);
+        return NULL;
+    }
+
+    image_header_t header;
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != IMAGE_VERSION || header.pointer_size != sizeof(void*)
+            || header.struct_sizes != image_layout()) {
+        debug_out("image_load: %s is not a game image for this version\n", filename);
+        munmap(map, length);
+        return NULL;
+    }
+    if (header.data_offset > length || header.data_size > length - header.data_offset
+            || header.reloc_offset > length
+            || header.reloc_count > (length - header.reloc_offset) / sizeof(uint64_t)
+            || header.program + sizeof(program_t) > header.data_size) {
+        debug_out("image_load: %s is truncated or damaged\n", filename);
+        munmap(map, length);
+        return NULL;
+    }
+
+    char *base = map + header.data_offset;
+    const char *relocs = map + header.reloc_offset;
+    for (uint64_t i = 0; i < header.reloc_count; ++i) {
+        uint64_t field;
+        uintptr_t value;
+        memcpy(&field, relocs + i * sizeof(field), sizeof(field));
+        if (field > header.data_size - sizeof(value)) {
+            debug_out("image_load: %s has a bad relocation\n", filename);
+            munmap(map, length);
+            return NULL;
+        }
+        memcpy(&value, base + field, sizeof(value));
+        if (value >= header.data_size) {
+            debug_out("image_load: %s has a bad relocation\n", filename);
+            munmap(map, length);
+            return NULL;
+        }
+        value += (uintptr_t)base;
+        memcpy(base + field, &value, sizeof(value));
+    }
+
+    program_t *prog = (program_t*)(base + header.program);
+    prog->image = calloc(sizeof(struct IMAGE), 1);
+    prog->image->map = map;
+    prog->image->length = length;
+    prog->reload = reload_create();
+
+    int function_count = 0;
+    int compiled = vm_compile_program(prog, &function_count);
+    TRACE(TRACE_LOADER, TRACE_INFO, "image_load: mapped %zu bytes, %llu relocations, compiled %d of %d functions\n",
+          length, (unsigned long long)header.reloc_count, compiled, function_count);
+    return prog;
+}
+
+/**
+Tell whether something is part of the image a program was loaded from, and
+so must not be freed.
+*/
+int image_contains(program_t *prog, const void *ptr) {
+    if (!prog->image) {
+        return FALSE;
+    }
+    const char *map = prog->image->map;
+    return (const char*)ptr >= map && (const char*)ptr < map + prog->image->length;
+}
+
+/**
+Read the source_hash recorded in a game image's header, without loading it.
+
+Returns false if the file is missing or is not a valid image for this build.
+*/
+int image_source_hash(const char *filename, uint64_t *hash) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return FALSE;
+    }
+    image_header_t header;
+    int success = fread(&header, sizeof(header), 1, fp) == 1
+               && memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) == 0
+               && header.version == IMAGE_VERSION && header.pointer_size == sizeof(void*)
+               && header.struct_sizes == image_layout();
+    fclose(fp);
+    if (success) {
+        *hash = header.source_hash;
+    }
+    return success;
+}
+
+/**
+Release a program loaded by image_load. Only the bytecode made when it was
+loaded and the grammar lines added by reloads were allocated; everything
+else is in the mapping.
+*/
+void image_free(program_t *prog) {
+    struct IMAGE *image = prog->image;
+    for (action_t *action = prog->actions; action; ) {
+        action_t *next = action->next;
+        if (!image_contains(prog, action)) {
+            free(action);
+        }
+        action = next;
+    }
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = prog->symbols->buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type == SYM_FUNCTION) {
+                function_t *func = symbol->d.ptr;
+                vm_free(func->code);
+                func->code = NULL;
+            }
+        }
+    }
+    munmap(image->map, image->length);
+    free(image);
+}
@@ -1,22 +1,123 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "parse.h"
 
+unsigned trace_categories = 0;
+int trace_level = TRACE_INFO;
+
+static const struct {
+    const char *name;
+    unsigned category;
+} trace_names[] = {
+    { "parser",      TRACE_PARSER },
+    { "scope",       TRACE_SCOPE },
+    { "interpreter", TRACE_INTERPRETER },
+    { "loader",      TRACE_LOADER },
+    { "all",         TRACE_ALL },
+    { NULL }
+};
+
+static FILE *process_log = NULL;
+static pthread_once_t process_log_once = PTHREAD_ONCE_INIT;
+
+static void debug_log_open() {
+    process_log = fopen("debug.log", "wt");
+    setvbuf(process_log, NULL, _IONBF, 0);
+}
+
+static FILE *debug_log_file() {
+    pthread_once(&process_log_once, debug_log_open);
+    return process_log;
+}
+
+/**
+Write to the process-wide debug log. This is used for messages that do not
+belong to any one session, such as those produced while loading.
+*/
 void debug_out(const char *msg, ...) {
-    static FILE *logfile = NULL;
+    va_list args;
+    va_start(args, msg);
+    vfprintf(debug_log_file(), msg, args);
+    va_end(args);
+}
 
-    if (logfile == NULL) {
-        logfile = fopen("debug.log", "wt");
-        setvbuf(logfile, NULL, _IONBF, 0);
-    }
+/**
+Write to a session's debug log, or to the process-wide debug log if the
+session does not have its own.
+*/
+void gd_debug_out(gamedata_t *gd, const char *msg, ...) {
+    FILE *dest = gd && gd->log ? gd->log : debug_log_file();
+    va_list args;
+    va_start(args, msg);
+    vfprintf(dest, msg, args);
+    va_end(args);
+}
+
+/**
+Write text intended for the player of a session.
+*/
+void gd_text_out(gamedata_t *gd, const char *msg, ...) {
+    va_list args;
+    va_start(args, msg);
+    vfprintf(gd->out, msg, args);
+    va_end(args);
+}
 
+/**
+Write a single trace record to the debug log. Records are tab separated as
+"trace", category, level, and message so they can be filtered with standard
+tools. Callers should use the TRACE macro rather than calling this directly
+so that disabled trace points cost nothing.
+*/
+void trace_out(unsigned category, int level, const char *msg, ...) {
+    const char *cat_name = "?";
+    for (int i = 0; trace_names[i].name; ++i) {
+        if (trace_names[i].category == category) {
+            cat_name = trace_names[i].name;
+            break;
+        }
+    }
 
+    char buffer[512];
     va_list args;
     va_start(args, msg);
-    vfprintf(logfile, msg, args);
+    vsnprintf(buffer, sizeof(buffer), msg, args);
     va_end(args);
+    debug_out("trace\t%s\t%d\t%s", cat_name, level, buffer);
+}
+
+/**
+Enable the trace categories named in a comma separated list (for example,
+"parser,scope").
+
+Returns false if any name was not recognized; returns true otherwise.
+*/
+int trace_set_categories(const char *names) {
+    int all_known = TRUE;
+    const char *pos = names;
+    while (*pos) {
+        size_t len = strcspn(pos, ",");
+        int found = FALSE;
+        for (int i = 0; trace_names[i].name; ++i) {
+            if (strlen(trace_names[i].name) == len
+                    && strncmp(trace_names[i].name, pos, len) == 0) {
+                trace_categories |= trace_names[i].category;
+                found = TRUE;
+            }
+        }
+        if (!found) {
+            all_known = FALSE;
+        }
+        pos += len;
+        if (*pos == ',') ++pos;
+    }
+    return all_known;
 }
 
 void text_out(const char *msg, ...) {
@@ -28,34 +129,42 @@ void text_out(const char *msg, ...) {
 
 char* read_line() {
     char *buffer = calloc(MAX_INPUT_LENGTH, 1);
-    fgets(buffer, MAX_INPUT_LENGTH-1, stdin);
+    if (!fgets(buffer, MAX_INPUT_LENGTH-1, stdin)) {
+        free(buffer);
+        return NULL;
+    }
     return buffer;
 }
 
 char* read_file(const char *filename) {
-    FILE *fp = fopen(filename, "rt");
+    FILE *fp = fopen(filename, "rb");
     if (!fp) {
         debug_out("read_file: Could not open file '%s'\n", filename);
         return NULL;
     }
     fseek(fp, 0, SEEK_END);
-    size_t filesize = ftell(fp);
+    long filesize = ftell(fp);
     fseek(fp, 0, SEEK_SET);
+    if (filesize < 0) {
+        debug_out("read_file: Could not read file '%s'\n", filename);
+        fclose(fp);
+        return NULL;
+    }
     char *file = malloc(filesize+1);
-    fread(file, filesize, 1, fp);
-    file[filesize] = 0;
+    size_t count = fread(file, 1, filesize, fp);
+    file[count] = 0;
     fclose(fp);
     return file;
 }
 
-void style_bold() {
-    text_out("\x1b[1m");
+void style_bold(gamedata_t *gd) {
+    gd_text_out(gd, "\x1b[1m");
 }
 
-void style_normal() {
-    text_out("\x1b[0m");
+void style_normal(gamedata_t *gd) {
+    gd_text_out(gd, "\x1b[0m");
 }
 
-void style_reverse() {
-    text_out("\x1b[7m");
+void style_reverse(gamedata_t *gd) {
+    gd_text_out(gd, "\x1b[7m");
 }
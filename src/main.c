@@ -12,11 +12,13 @@ void add_to_scope(gamedata_t *gd, object_t *obj);
 void scope_within(gamedata_t *gd, object_t *ceiling);
 
 void object_name_print(gamedata_t *gd, object_t *obj);
-void object_property_print(object_t *obj, int prop_num);
+void object_property_print(gamedata_t *gd, object_t *obj, int prop_num);
 void print_location(gamedata_t *gd, object_t *location);
 int dispatch_action(gamedata_t *gd, input_t *input);
-static int game_init(gamedata_t *gd);
+static void game_intro(gamedata_t *gd);
 static void game_loop(gamedata_t *gd);
+static void game_input(gamedata_t *gd, const char *text);
+static void game_commands(gamedata_t *gd, input_t *input);
 
 
 /* ************************************************************************ *
@@ -70,21 +72,48 @@ void scope_within(gamedata_t *gd, object_t *ceiling) {
             ++queue;
         }
     }
+    TRACE(TRACE_SCOPE, TRACE_DEBUG, "scope_within: obj#%d gives %d objects in scope\n",
+          ceiling->id, gd->search_count);
 }
 
 /* ************************************************************************ *
  * Tokenizing player input
  * ************************************************************************ */
 
+/**
+Look up a word of the player's input in the vocabulary. Unknown words of
+three or more letters are matched against the vocabulary allowing for a
+typing mistake (one edit, or two for longer words) and are corrected if
+exactly one word is closest.
+*/
+static void tokenize_word(gamedata_t *gd, cmd_token_t *token) {
+    vocabulary_t *vocab = gd->program->vocab;
+    token->word_no = vocab_index(vocab, token->word);
+    if (token->word_no != -1) {
+        return;
+    }
+
+    size_t length = strlen(token->word);
+    if (length < 3) {
+        return;
+    }
+    int suggestion = vocab_suggest(vocab, token->word, length < 5 ? 1 : 2, NULL);
+    if (suggestion != -1) {
+        token->word_no = suggestion;
+        token->corrected = TRUE;
+    }
+}
+
 /**
 Takes text input by the player and turns it into a sequence of words and
-vocab word numbers.
+vocab word numbers. If there are more words than fit, too_long is set and
+parse_command will refuse the input rather than act on part of it.
 
 Returns false if the input text was empty or contained only whitespace;
 returns true otherwise.
 */
-int tokenize(input_t *input) {
-    int in_word = 0, count = 0;
+int tokenize(gamedata_t *gd, input_t *input) {
+    int in_word = 0, count = 0, i;
     memset(input->words, 0, sizeof(cmd_token_t) * MAX_INPUT_WORDS);
 
     if (!input) {
@@ -92,7 +121,8 @@ int tokenize(input_t *input) {
         return 0;
     }
 
-    for (int i = 0; input->input[i]; ++i) {
+    input->too_long = FALSE;
+    for (i = 0; count < MAX_INPUT_WORDS - 2; ++i) {
         unsigned char here = input->input[i];
         char punct_char = 0;
 
@@ -103,12 +133,12 @@ int tokenize(input_t *input) {
             if (in_word) {
                 in_word = 0;
                 input->input[i] = 0;
-                input->words[count].word_no = vocab_index(input->words[count].word);
+                tokenize_word(gd, &input->words[count]);
                 ++count;
             }
             if (punct_char) {
                 char buf[2] = { punct_char };
-                input->words[count].word_no = vocab_index(buf);
+                input->words[count].word_no = vocab_index(gd->program->vocab, buf);
                 ++count;
             }
             if (here != 0) {
@@ -123,6 +153,14 @@ int tokenize(input_t *input) {
             in_word = 1;
         }
     }
+    if (count >= MAX_INPUT_WORDS - 2) {
+        for (; input->input[i]; ++i) {
+            if (!isspace((unsigned char)input->input[i])) {
+                input->too_long = TRUE;
+                break;
+            }
+        }
+    }
     if (count == 0) {
         return 0;
     } else {
@@ -138,11 +176,12 @@ int tokenize(input_t *input) {
  * ************************************************************************ */
 
 void free_noun_list(noun_t *noun) {
-    if (noun == NULL) return;
-
-    free(noun->ambig);
-    free(noun->also);
-    free(noun);
+    while (noun) {
+        noun_t *next = noun->ambig;
+        free(noun->also);
+        free(noun);
+        noun = next;
+    }
 }
 
  /**
@@ -156,13 +195,11 @@ void free_noun_list(noun_t *noun) {
 noun_t* match_noun(gamedata_t *gd, input_t *input) {
     int match_strength = 0;
     noun_t *match = NULL;
-    int prop_vocab = property_number(gd, "#vocab");
+    int prop_vocab = property_number(gd->program, "#vocab");
+    int prop_name = trace_on(TRACE_PARSER, TRACE_DEBUG) ? property_number(gd->program, "#name") : 0;
 
-    text_out("finding noun...\n");
+    TRACE(TRACE_PARSER, TRACE_DEBUG, "match_noun: %d objects in scope\n", gd->search_count);
     for (int i = 0; i < gd->search_count; ++i) {
-        text_out("   OBJECT ");
-        object_property_print(gd->search[i], property_number(gd, "#name"));
-
         int words = 0;
         int cur_word = input->cur_word;
         while (word_in_property(gd->search[i], prop_vocab,
@@ -170,10 +207,10 @@ noun_t* match_noun(gamedata_t *gd, input_t *input) {
             ++words;
             ++cur_word;
         }
-        text_out(" [%d]", words);
         noun_t *new_match = NULL;
+        const char *outcome = "";
         if (words > match_strength) {
-            text_out("   (match)\n");
+            outcome = "match";
             new_match = calloc(sizeof(noun_t), 1);
             new_match->object = gd->search[i];
             match_strength = words;
@@ -182,14 +219,19 @@ noun_t* match_noun(gamedata_t *gd, input_t *input) {
             }
             match = new_match;
         } else if (words == match_strength && words > 0) {
-            text_out("   (ambig)\n");
+            outcome = "ambig";
             new_match = calloc(sizeof(noun_t), 1);
             new_match->object = gd->search[i];
             match_strength = words;
             new_match->ambig = match->ambig;
             match->ambig = new_match;
-        } else {
-            text_out("\n");
+        }
+        if (trace_on(TRACE_PARSER, TRACE_DEBUG)) {
+            property_t *name = object_property_get(gd->search[i], prop_name);
+            trace_out(TRACE_PARSER, TRACE_DEBUG, "match_noun: obj#%d '%s' words=%d %s\n",
+                      gd->search[i]->id,
+                      name && name->value.type == PT_STRING ? (char*)name->value.d.ptr : "",
+                      words, outcome);
         }
     }
 
@@ -204,8 +246,8 @@ Returns the action's action number if successful. On failure, returns an
 error code less than 0.
 */
 int try_parse_action(gamedata_t *gd, input_t *input, action_t *action) {
-    int then_word = vocab_index("then");
-    int period_word = vocab_index(".");
+    int then_word = vocab_index(gd->program->vocab, "then");
+    int period_word = vocab_index(gd->program->vocab, ".");
     int token_no = 0;
     object_t *obj;
     noun_t *noun;
@@ -228,12 +270,12 @@ int try_parse_action(gamedata_t *gd, input_t *input, action_t *action) {
         gd->search_count = 0;
         switch(action->grammar[token_no].type) {
             case GT_END:
-            text_out("PARSE ERROR: Encountered GT_END in grammar; this should have already been handled.\n");
+                TRACE(TRACE_PARSER, TRACE_ERROR, "try_parse_action: encountered GT_END in grammar; this should have already been handled.\n");
                 break;
             case GT_SCOPE:
             case GT_NOUN:
                 if (action->grammar[token_no].type == GT_SCOPE) {
-                    scope_within(gd, (object_t*)action->grammar[token_no].ptr);
+                    scope_within(gd, session_object(gd, action->grammar[token_no].ptr));
                 } else {
                     obj = scope_ceiling(gd, gd->player);
                     add_to_scope(gd, obj);
@@ -273,21 +315,34 @@ int try_parse_action(gamedata_t *gd, input_t *input, action_t *action) {
     }
 }
 
+static void input_clear_nouns(input_t *input) {
+    for (int i = 0; i < PARSE_MAX_NOUNS; ++i) {
+        free_noun_list(input->nouns[i]);
+        input->nouns[i] = NULL;
+    }
+    input->noun_count = 0;
+}
+
 /**
-Try the parse the player's tokenize command as an action. If a match is
-found, the relevent fields in the input data will be filled out.
+Try to parse the player's tokenized command as an action. If a match is
+found, the relevent fields in the input data will be filled out. This does
+not produce any output; use parse_report to describe failures to the player.
 
-Returns false if not matching action line could be found; returns true
-otherwise.
+Returns the action code if a matching action line was found; otherwise
+returns one of the PARSE_* error codes.
 */
-int parse(gamedata_t *gd, input_t *input) {
-    action_t *action_iter = gd->actions;
-    input->noun_count = 0;
+int parse_command(gamedata_t *gd, input_t *input) {
+    /* a reload may replace grammar lines while we read them */
+    action_t *action_iter = __atomic_load_n(&gd->program->actions, __ATOMIC_ACQUIRE);
+    input->action = -1;
+    input->action_func = NULL;
+    input_clear_nouns(input);
 
+    if (input->too_long) {
+        return PARSE_TOOLONG;
+    }
     if (input->words[input->cur_word].word_no == -1) {
-        text_out("Unknown word '%s'.\n", input->words[input->cur_word].word);
-        input->action = PARSE_BADTOKEN;
-        return 0;
+        return PARSE_BADWORD;
     }
 
     int best_result_end_word = 0;
@@ -295,7 +350,10 @@ int parse(gamedata_t *gd, input_t *input) {
     function_t *best_function = NULL;
     while (action_iter && best_result < 0) {
         input->cur_word = input->next_cmd;
+        input_clear_nouns(input);
         int result = try_parse_action(gd, input, action_iter);
+        TRACE(TRACE_PARSER, TRACE_INFO, "parse: action %s gives %d\n",
+              action_iter->action_func ? action_iter->action_func->name : "(builtin)", result);
         if (best_result < result) {
             best_result = result;
             best_result_end_word = input->cur_word;
@@ -304,7 +362,7 @@ int parse(gamedata_t *gd, input_t *input) {
         if (result >= 0) {
             break;
         }
-        action_iter = action_iter->next;
+        action_iter = __atomic_load_n(&action_iter->next, __ATOMIC_ACQUIRE);
     }
     input->cur_word = best_result_end_word;
     if (input->cur_word == input->word_count) {
@@ -315,74 +373,85 @@ int parse(gamedata_t *gd, input_t *input) {
 
     for (int i = 0; i < PARSE_MAX_NOUNS; ++i) {
         if (input->nouns[i] && input->nouns[i]->ambig) {
-            text_out("You'll need to be more specific whether you mean ");
-            noun_t *cur = input->nouns[i];
-            while (cur) {
-                if (cur != input->nouns[i]) {
-                    text_out(", ");
-                    if (cur->ambig == NULL) {
-                        text_out("or ");
-                    }
-                }
-                object_name_print(gd, cur->object);
-                cur = cur->ambig;
-            }
-            text_out(".\n");
             best_result = PARSE_AMBIG;
         }
     }
 
-    input->action = -1;
-    switch(best_result) {
+    if (best_result >= 0) {
+        input->action_func = best_function;
+        input->action = best_result;
+    }
+    return best_result;
+}
+
+/**
+Describe the outcome of parse_command to the player. Successful parses
+produce no output.
+*/
+void parse_report(gamedata_t *gd, input_t *input, int result) {
+    switch(result) {
         case PARSE_AMBIG:
-//            printf("Multiple items matched.\n");
+            for (int i = 0; i < PARSE_MAX_NOUNS; ++i) {
+                if (!input->nouns[i] || !input->nouns[i]->ambig) {
+                    continue;
+                }
+                gd_text_out(gd, "You'll need to be more specific whether you mean ");
+                noun_t *cur = input->nouns[i];
+                while (cur) {
+                    if (cur != input->nouns[i]) {
+                        gd_text_out(gd, ", ");
+                        if (cur->ambig == NULL) {
+                            gd_text_out(gd, "or ");
+                        }
+                    }
+                    object_name_print(gd, cur->object);
+                    cur = cur->ambig;
+                }
+                gd_text_out(gd, ".\n");
+            }
+            break;
+        case PARSE_BADWORD:
+            gd_text_out(gd, "Unknown word '%s'.\n", input->words[input->cur_word].word);
             break;
         case PARSE_BADNOUN:
-            text_out("Not visible.\n");
+            gd_text_out(gd, "Not visible.\n");
             break;
         case PARSE_NONMATCH:
-            text_out("Unrecognized verb '%s'.\n", input->words[input->next_cmd].word);
+            gd_text_out(gd, "Unrecognized verb '%s'.\n", input->words[input->next_cmd].word);
             break;
         case PARSE_BADTOKEN:
-            text_out("Parser error.\n");
+            gd_text_out(gd, "Parser error.\n");
+            break;
+        case PARSE_TOOLONG:
+            gd_text_out(gd, "That's too many words; try a shorter command.\n");
             break;
-        default:
-            input->action_func = best_function;
-            input->action = best_result;
     }
+}
 
-    return input->action >= 0;
+/**
+Parse the player's tokenized command and report any failure to the player.
+
+Returns false if not matching action line could be found; returns true
+otherwise.
+*/
+int parse(gamedata_t *gd, input_t *input) {
+    int result = parse_command(gd, input);
+    parse_report(gd, input, result);
+    return result >= 0;
 }
 
 /* ************************************************************************ *
  * Main game loop
  * ************************************************************************ */
 
-int game_init(gamedata_t *gd) {
-    gd->gameinfo = object_get_by_ident(gd, "gameinfo");
-    if (!gd->gameinfo) {
-        text_out("FATAL: no gameinfo object\n");
-        free_data(gd);
-        return 0;
-    }
+void game_intro(gamedata_t *gd) {
+    gd_text_out(gd, "if-parse-test VERSION %d.%d.%d\n\n", VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD);
+    gd_text_out(gd, "--------------------------------------------------------------------------------\n\n");
 
-    property_t *player_prop = object_property_get(gd->gameinfo, property_number(gd, "#player"));
-    if (!player_prop || !player_prop->value.d.ptr) {
-        text_out("FATAL: gameinfo does not define valid initial player object\n");
-        free_data(gd);
-        return 0;
-    }
-    gd->player = player_prop->value.d.ptr;
-
-    text_out("if-parse-test VERSION %d.%d.%d\n\n", VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD);
-    text_out("--------------------------------------------------------------------------------\n\n");
-
-    property_t *intro_prop = object_property_get(gd->gameinfo, property_number(gd, "#intro"));
+    property_t *intro_prop = object_property_get(gd->gameinfo, property_number(gd->program, "#intro"));
     if (intro_prop && intro_prop->value.d.ptr) {
-        text_out("%s\n", (char*)intro_prop->value.d.ptr);
+        gd_text_out(gd, "%s\n", (char*)intro_prop->value.d.ptr);
     }
-
-    return 1;
 }
 
 void input_free(input_t *input) {
@@ -393,61 +462,263 @@ void input_free(input_t *input) {
     free(input);
 }
 
-void game_loop(gamedata_t *gd) {
-    debug_out("game_loop: entering main game loop\n");
-    input_t *input = NULL;
-    print_location(gd, gd->player->parent);
-    while (!gd->quit_game) {
-        if (input == NULL) {
-            input = calloc(sizeof(input_t), 1);
-            text_out("\n> ");
-            input->input = read_line();
-
-            if (input->input[0] == '(') {
-                list_t *list = parse_string(input->input);
-                input_free(input);
-                input = NULL;
-                list_t *result = list_run(gd, NULL, list);
-                text_out("RESULT: ");
-                dump_list(stdout, result);
-                text_out("\n");
-                continue;
-            }
+/**
+Run a single turn for a session: evaluate the player's input and dispatch
+every command it contains. Input beginning with '(' is run as a script
+expression instead. All output goes to the session's output stream.
+*/
+void game_turn(gamedata_t *gd, const char *text) {
+    reload_enter(gd);
+    budget_start_turn(gd);
+    game_input(gd, text);
+    reload_leave(gd);
+}
 
-            if (!tokenize(input)) {
-                text_out("Pardon?\n");
-                input_free(input);
-                input = NULL;
-                continue;
-            }
+/* Run the player's input, or the script expression they entered. */
+void game_input(gamedata_t *gd, const char *text) {
+    if (text[0] == '(') {
+        list_t *list = parse_string(gd->program->vocab, text);
+        svalue_t result = list_run(gd, NULL, list);
+        gd_text_out(gd, "RESULT: ");
+        dump_value(gd->out, result);
+        gd_text_out(gd, "\n");
+        value_free(result);
+        if (list) list_freelist(list);
+        budget_report(gd);
+        return;
+    }
+
+    input_t *input = calloc(sizeof(input_t), 1);
+    input->input = str_dupl(text);
+    if (!tokenize(gd, input)) {
+        gd_text_out(gd, "Pardon?\n");
+        input_free(input);
+        return;
+    }
+    for (unsigned i = 0; i < input->word_count; ++i) {
+        if (input->words[i].corrected) {
+            gd_text_out(gd, "(assuming '%s' means '%s')\n", input->words[i].word,
+                        vocab_word(gd->program->vocab, input->words[i].word_no));
         }
+    }
+
+    game_commands(gd, input);
+}
+
+/* Run the commands of a turn's input, starting with the next one to be
+ * parsed. If an action is suspended, the input is kept for game_resume. */
+void game_commands(gamedata_t *gd, input_t *input) {
+    while (!gd->quit_game && gd->budget.error.code == SCRIPT_OK) {
         if (!parse(gd, input)) {
-            input_free(input);
-            input = NULL;
-            continue;
+            break;
         }
-
         dispatch_action(gd, input);
+        if (gd->budget.suspended) {
+            gd->suspended_input = input;
+            return;
+        }
         if (!input->next_cmd) {
-            input_free(input);
-            input = NULL;
+            break;
+        }
+    }
+    budget_report(gd);
+    input_free(input);
+}
+
+/**
+Run the next slice of a turn whose action was suspended because its
+scheduler slice ran out, finishing the turn's remaining commands if the
+action completes.
+
+Returns true if the turn is still unfinished.
+*/
+int game_resume(gamedata_t *gd) {
+    input_t *input = gd->suspended_input;
+    if (!input) {
+        return FALSE;
+    }
+    gd->suspended_input = NULL;
+    budget_start_slice(gd);
+    value_free(vm_resume(gd));
+    if (gd->budget.suspended) {
+        gd->suspended_input = input;
+        return TRUE;
+    }
+    if (input->next_cmd) {
+        game_commands(gd, input);
+    } else {
+        budget_report(gd);
+        input_free(input);
+    }
+    reload_leave(gd);
+    return gd->suspended_input != NULL;
+}
+
+void game_loop(gamedata_t *gd) {
+    gd_debug_out(gd, "game_loop: entering main game loop\n");
+    print_location(gd, gd->player->parent);
+    while (!gd->quit_game) {
+        gd_text_out(gd, "\n> ");
+        char *line = read_line();
+        if (!line) {
+            break;
         }
+        game_turn(gd, line);
+        free(line);
     }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    const char *batch_file = NULL;
+    int batch_results = FALSE;
+    const char *sched_file = NULL;
+    int sched_sessions = 1, sched_threads = 1;
+    const char *bench_name = NULL;
+    int bench_size = 0;
+    const char *vm_check = NULL;
+    const char *profile_file = NULL;
+    const char *image_file = NULL, *write_image = NULL;
+    const char *generate_dir = NULL;
+    world_spec_t world_spec;
+    world_spec_default(&world_spec, 10000);
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+            if (!trace_set_categories(argv[++i])) {
+                fprintf(stderr, "Unknown trace category in '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-trace-level") == 0 && i + 1 < argc) {
+            trace_level = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc) {
+            batch_file = argv[++i];
+        } else if (strcmp(argv[i], "-batch-results") == 0) {
+            batch_results = TRUE;
+        } else if (strcmp(argv[i], "-sched") == 0 && i + 3 < argc) {
+            sched_sessions = strtol(argv[++i], NULL, 10);
+            sched_threads = strtol(argv[++i], NULL, 10);
+            sched_file = argv[++i];
+        } else if (strcmp(argv[i], "-bench") == 0 && i + 1 < argc) {
+            bench_name = argv[++i];
+        } else if (strcmp(argv[i], "-bench-size") == 0 && i + 1 < argc) {
+            bench_size = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc) {
+            ++i;
+            if (strcmp(argv[i], "tree") == 0) {
+                script_engine = ENGINE_TREE;
+            } else if (strcmp(argv[i], "vm") == 0) {
+                script_engine = ENGINE_VM;
+            } else {
+                fprintf(stderr, "Unknown script engine '%s'; use tree or vm.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-vm-check") == 0 && i + 1 < argc) {
+            vm_check = argv[++i];
+        } else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc) {
+            profile_file = argv[++i];
+        } else if (strcmp(argv[i], "-budget") == 0 && i + 2 < argc) {
+            script_step_limit = strtol(argv[++i], NULL, 10);
+            script_alloc_limit = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-slice") == 0 && i + 1 < argc) {
+            script_slice_steps = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-manifest") == 0 && i + 1 < argc) {
+            load_manifest = argv[++i];
+        } else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) {
+            load_cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "-load-threads") == 0 && i + 1 < argc) {
+            load_threads = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-image") == 0 && i + 1 < argc) {
+            image_file = argv[++i];
+        } else if (strcmp(argv[i], "-write-image") == 0 && i + 1 < argc) {
+            write_image = argv[++i];
+        } else if (strcmp(argv[i], "-generate") == 0 && i + 1 < argc) {
+            generate_dir = argv[++i];
+        } else if (strcmp(argv[i], "-world") == 0 && i + 1 < argc) {
+            if (!world_spec_parse(&world_spec, argv[++i])) {
+                fprintf(stderr, "Bad world spec '%s'; use name=number pairs separated by commas,\n"
+                                "naming rooms, items, depth, vocab, prototypes, grammar, functions\n"
+                                "or per-file.\n", argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-trace categories] [-trace-level n] [-batch file [-batch-results]]\n"
+                            "       [-sched sessions threads file] [-bench name [-bench-size n]]\n"
+                            "       [-engine tree|vm] [-vm-check file] [-profile folded-file]\n"
+                            "       [-budget steps allocations] [-slice steps]\n"
+                            "       [-image file] [-write-image file] [-load-threads n]\n"
+                            "       [-manifest file] [-cache dir] [-generate dir [-world spec]]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench_name) {
+        return bench_run(bench_name, bench_size) ? 0 : 1;
+    }
+    if (generate_dir) {
+        char *manifest = world_generate(&world_spec, generate_dir);
+        if (!manifest) {
+            fprintf(stderr, "Could not write a world to %s.\n", generate_dir);
+            return 1;
+        }
+        printf("Wrote %d rooms of %d items; load them with -manifest %s\n",
+               world_spec.rooms, world_spec.items_per_room, manifest);
+        free(manifest);
+        return 0;
+    }
+
     time_t start_time = time(NULL);
     debug_out("main: starting up at %s", ctime(&start_time));
 
-    gamedata_t *gd = load_data();
-    if (!gd) return 1;
-    if (!game_init(gd)) return 1;
+    program_t *prog = image_file ? image_load(image_file) : load_data();
+    if (!prog) return 1;
+    if (write_image) {
+        int success = image_write(prog, write_image);
+        program_free(prog);
+        return success ? 0 : 1;
+    }
+    if (vm_check) {
+        int success = vm_check_file(prog, vm_check);
+        program_free(prog);
+        return success ? 0 : 1;
+    }
+    if (sched_file) {
+        int success = scheduler_run_file(prog, sched_file, sched_sessions, sched_threads);
+        program_free(prog);
+        return success ? 0 : 1;
+    }
+    gamedata_t *gd = session_create(prog);
+    if (!gd) {
+        program_free(prog);
+        return 1;
+    }
+
+    if (profile_file) {
+        profile_start(gd);
+    }
 
+    if (batch_file) {
+        int success = batch_run_file(gd, batch_file, batch_results);
+        if (profile_file) {
+            profile_report(gd, stderr);
+            profile_write_folded(gd, profile_file);
+        }
+        session_free(gd);
+        program_free(prog);
+        return success ? 0 : 1;
+    }
+
+    game_intro(gd);
     game_loop(gd);
 
     text_out("Goodbye!\n\n");
+    if (profile_file) {
+        profile_report(gd, stderr);
+        profile_write_folded(gd, profile_file);
+    }
     time_t end_time = time(NULL);
     debug_out("main: shutting down at %s", ctime(&end_time));
-    free_data(gd);
+    session_free(gd);
+    program_free(prog);
     return 0;
 }
@@ -30,10 +30,14 @@ int object_contains_indirect(object_t *container, object_t *content) {
     return 0;
 }
 
-object_t* object_create(object_t *parent) {
-    static int next_id = 0;
+object_t* object_create(program_t *prog, object_t *parent) {
     object_t *obj = calloc(sizeof(object_t), 1);
-    obj->id = next_id++;
+    if (prog->object_count >= prog->object_capacity) {
+        prog->object_capacity = prog->object_capacity ? prog->object_capacity * 2 : 64;
+        prog->objects = realloc(prog->objects, sizeof(object_t*) * prog->object_capacity);
+    }
+    obj->id = prog->object_count++;
+    prog->objects[obj->id] = obj;
     if (parent) {
         obj->parent = parent;
         obj->sibling = parent->first_child;
@@ -45,67 +49,67 @@ object_t* object_create(object_t *parent) {
 void object_dump(gamedata_t *gd, object_t *obj) {
     if (!obj) return;
 
-    text_out("Object \"");
+    gd_text_out(gd, "Object \"");
     object_name_print(gd, obj);
-    text_out("\" at %p\n", (void*)obj);
-    text_out("   PARENT: ");
+    gd_text_out(gd, "\" at %p\n", (void*)obj);
+    gd_text_out(gd, "   PARENT: ");
 
     if (obj->parent) {
-        putchar('"');
+        gd_text_out(gd, "\"");
         object_name_print(gd, obj->parent);
-        text_out("\" at %p\n", (void*)obj->parent);
+        gd_text_out(gd, "\" at %p\n", (void*)obj->parent);
     } else {
-        text_out("(none)\n");
+        gd_text_out(gd, "(none)\n");
     }
 
-    text_out("   FIRST CHILD: ");
+    gd_text_out(gd, "   FIRST CHILD: ");
     if (obj->first_child) {
-        putchar('"');
+        gd_text_out(gd, "\"");
         object_name_print(gd, obj->first_child);
-        text_out("\" at %p\n", (void*)obj->first_child);
+        gd_text_out(gd, "\" at %p\n", (void*)obj->first_child);
     } else {
-        text_out("(none)\n");
+        gd_text_out(gd, "(none)\n");
     }
 
-    text_out("   SIBLING: ");
+    gd_text_out(gd, "   SIBLING: ");
     if (obj->sibling) {
-        putchar('"');
+        gd_text_out(gd, "\"");
         object_name_print(gd, obj->sibling);
-        text_out("\" at %p\n", (void*)obj->sibling);
+        gd_text_out(gd, "\" at %p\n", (void*)obj->sibling);
     } else {
-        text_out("(none)\n");
+        gd_text_out(gd, "(none)\n");
     }
 
     if (!obj->properties) {
-        text_out("   (no properties)\n");
+        gd_text_out(gd, "   (no properties)\n");
         return;
     }
 
     property_t *prop = obj->properties;
     while (prop) {
-        text_out("   %2d ", prop->id);
+        gd_text_out(gd, "   %2d ", prop->id);
         switch(prop->value.type) {
             case PT_INTEGER:
-             text_out("%d\n", prop->value.d.num);
+             gd_text_out(gd, "%d\n", prop->value.d.num);
                 break;
             case PT_STRING:
-                text_out("\"%s\"\n", (char*)prop->value.d.ptr);
+                gd_text_out(gd, "\"%s\"\n", (char*)prop->value.d.ptr);
                 break;
             case PT_OBJECT:
-                putchar('"');
+                gd_text_out(gd, "\"");
                 object_name_print(gd, (object_t*)prop->value.d.ptr);
-                text_out("\" at %p\n", (void*)prop->value.d.ptr);
+                gd_text_out(gd, "\" at %p\n", (void*)prop->value.d.ptr);
                 break;
             case PT_ARRAY:
-                putchar('(');
+                gd_text_out(gd, "(");
                 for (int i = 0; i < prop->value.array_size; ++i) {
                     value_t *cur = &((value_t*)prop->value.d.ptr)[i];
-                    text_out(" %d", cur->d.num);
+                    gd_text_out(gd, " %d", cur->d.num);
                 }
-                text_out(" )\n");
+                gd_text_out(gd, " )\n");
                 break;
             default:
-            text_out("(unhandled type %d)\n", prop->value.type);
+            gd_text_out(gd, "(unhandled type %d)\n", prop->value.type);
                 break;
         }
         prop = prop->next;
@@ -230,8 +234,63 @@ property_t* object_property_get(object_t *obj, int pid) {
     return NULL;
 }
 
+/**
+Look up a property through a call site's cache. A lookup on the same object
+as the cache's last one is answered without searching; one on another object
+that inherited the property from the same prototype needs only a search of
+the object's own properties. Any change to the world's properties must
+change the epoch, which discards what the cache remembers.
+*/
+property_t* object_property_get_cached(prop_cache_t *cache, unsigned epoch, object_t *obj, int pid) {
+    if (cache->epoch == epoch && cache->pid == pid) {
+        if (cache->object == obj) {
+            return cache->prop;
+        }
+        if (cache->inherited) {
+            object_t *prototype = NULL;
+            property_t *cur;
+            for (cur = obj->properties; cur; cur = cur->next) {
+                if (cur->id == pid) {
+                    break;
+                }
+                if (cur->id == OBJPROP_PROTOTYPE && cur->value.type == PT_OBJECT) {
+                    prototype = cur->value.d.ptr;
+                }
+            }
+            if (!cur && prototype == cache->prototype) {
+                cache->object = obj;
+                return cache->prop;
+            }
+        }
+    }
+
+    cache->epoch = epoch;
+    cache->pid = pid;
+    cache->object = obj;
+    cache->inherited = FALSE;
+    cache->prototype = NULL;
+    for (property_t *cur = obj->properties; cur; cur = cur->next) {
+        if (cur->id == pid) {
+            cache->prop = cur;
+            return cur;
+        }
+        if (cur->id == OBJPROP_PROTOTYPE && cur->value.type == PT_OBJECT) {
+            cache->prototype = cur->value.d.ptr;
+        }
+    }
+    cache->inherited = TRUE;
+    cache->prop = NULL;
+    if (cache->prototype && pid != OBJPROP_PROTOTYPE) {
+        cache->prop = object_property_get(cache->prototype, pid);
+    }
+    return cache->prop;
+}
+
 int object_property_is_true(object_t *obj, int pid, int default_value) {
-    property_t *prop = object_property_get(obj, pid);
+    return property_is_true(object_property_get(obj, pid), default_value);
+}
+
+int property_is_true(property_t *prop, int default_value) {
     if (!prop) return default_value;
     switch(prop->value.type) {
         case PT_INTEGER:
@@ -242,11 +301,53 @@ int object_property_is_true(object_t *obj, int pid, int default_value) {
         case PT_ARRAY:
             return 1;
         default:
-            text_out("[ERROR: unknown property type %d in object_property_is_true.]\n", prop->value.type);
+            debug_out("object_property_is_true: unknown property type %d\n", prop->value.type);
             return 0;
     }
 }
 
+/**
+Returns true if an object passes a property filter. With a pid of -1 every
+object passes; otherwise the truth of the object's property must match want.
+*/
+int object_matches(object_t *obj, int pid, int want) {
+    if (pid < 0) return 1;
+    return object_property_is_true(obj, pid, 0) == (want != 0);
+}
+
+/**
+Step through the objects inside root that pass a property filter. Pass NULL
+as cur to get the first; each later call gives the one after cur. When
+descend is false only root's children are visited, otherwise all of its
+descendants are, depth first. Returns NULL once there are no more.
+*/
+object_t* object_next_in(object_t *root, object_t *cur, int descend, int pid, int want) {
+    do {
+        if (!cur) {
+            cur = root->first_child;
+        } else if (descend && cur->first_child) {
+            cur = cur->first_child;
+        } else if (!descend) {
+            cur = cur->sibling;
+        } else {
+            while (cur != root && !cur->sibling) {
+                cur = cur->parent;
+            }
+            cur = cur == root ? NULL : cur->sibling;
+        }
+    } while (cur && !object_matches(cur, pid, want));
+    return cur;
+}
+
+int object_count_in(object_t *root, int descend, int pid, int want) {
+    int count = 0;
+    for (object_t *cur = object_next_in(root, NULL, descend, pid, want); cur;
+            cur = object_next_in(root, cur, descend, pid, want)) {
+        ++count;
+    }
+    return count;
+}
+
 void objectloop_depth_first(object_t *root, void (*callback)(object_t *obj)) {
     object_t *cur = root->first_child;
     while (cur) {
@@ -270,7 +371,7 @@ void objectloop_free(object_t *obj) {
 }
 
 void property_free(property_t *prop) {
-    if (prop->value.type == PT_ARRAY) {
+    if (prop->value.type == PT_ARRAY && !(prop->flags & PF_SHARED)) {
         free(prop->value.d.ptr);
     }
     free(prop);
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+
+/* Load-time simplification of script function bodies. This runs once the
+ * symbol table is complete and before functions are compiled, and only
+ * rewrites forms whose result cannot depend on the session, so both script
+ * engines see the same simplified bodies. */
+
+#define FOLD_INTEGERS   1   /* all arguments must be integers */
+#define FOLD_DIVISORS   2   /* integers, and none but the first may be zero */
+#define FOLD_ANY        3   /* any constant arguments */
+
+static const struct {
+    const char *name;
+    int args;
+} foldable[] = {
+    { "add",         FOLD_INTEGERS },
+    { "sub",         FOLD_INTEGERS },
+    { "mul",         FOLD_INTEGERS },
+    { "div",         FOLD_DIVISORS },
+    { "mod",         FOLD_DIVISORS },
+    { "lt",          FOLD_INTEGERS },
+    { "gt",          FOLD_INTEGERS },
+    { "le",          FOLD_INTEGERS },
+    { "ge",          FOLD_INTEGERS },
+    { "min",         FOLD_INTEGERS },
+    { "max",         FOLD_INTEGERS },
+    { "eq",          FOLD_ANY },
+    { "not",         FOLD_ANY },
+    { "and",         FOLD_ANY },
+    { "or",          FOLD_ANY },
+    { "is-object",   FOLD_ANY },
+    { "is-string",   FOLD_ANY },
+    { "is-number",   FOLD_ANY },
+    { "is-function", FOLD_ANY },
+    { "is-list",     FOLD_ANY },
+    { "type-name",   FOLD_ANY },
+    { NULL }
+};
+
+typedef struct OPTIMIZER {
+    program_t *prog;
+    function_t *func;
+    int resolve_atoms;
+} optimizer_t;
+
+static int count_nodes(list_t *list);
+static int is_local_name(optimizer_t *opt, const char *name, list_t *list);
+static int has_computed_set(list_t *list);
+static int is_constant(list_t *list);
+static const char *builtin_form(optimizer_t *opt, list_t *list);
+static list_t *replace_child(list_t *parent, list_t *prev, list_t *old_child, list_t *new_child);
+static list_t *optimize_node(optimizer_t *opt, list_t *list);
+static list_t *fold_call(optimizer_t *opt, list_t *list, const char *name);
+static list_t *fold_if(list_t *list);
+static void fold_proc(list_t *list);
+
+int count_nodes(list_t *list) {
+    int count = 1;
+    if (list->type == T_LIST) {
+        for (list_t *iter = list->child; iter; iter = iter->next) {
+            count += count_nodes(iter);
+        }
+    }
+    return count;
+}
+
+/* Returns true if name is bound as a local anywhere in the function, either
+ * as a parameter or by a set with a literal name. */
+int is_local_name(optimizer_t *opt, const char *name, list_t *list) {
+    if (list == opt->func->body) {
+        for (list_t *arg = opt->func->arg_list->child; arg; arg = arg->next) {
+            if (strcmp(arg->text, name) == 0) {
+                return TRUE;
+            }
+        }
+    }
+    if (!list || list->type != T_LIST) {
+        return FALSE;
+    }
+    list_t *head = list->child;
+    if (head && head->type == T_ATOM && strcmp(head->text, "set") == 0
+            && head->next && head->next->type == T_STRING
+            && strcmp(head->next->text, name) == 0) {
+        return TRUE;
+    }
+    for (list_t *iter = list->child; iter; iter = iter->next) {
+        if (is_local_name(opt, name, iter)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* A set whose name is not a literal string could bind any name, so atoms in
+ * such a function can never be resolved early. */
+int has_computed_set(list_t *list) {
+    if (list->type != T_LIST) {
+        return FALSE;
+    }
+    list_t *head = list->child;
+    if (head && head->type == T_ATOM && strcmp(head->text, "set") == 0
+            && (!head->next || head->next->type != T_STRING)) {
+        return TRUE;
+    }
+    for (list_t *iter = list->child; iter; iter = iter->next) {
+        if (has_computed_set(iter)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+int is_constant(list_t *list) {
+    return list->type == T_INTEGER || list->type == T_STRING;
+}
+
+/* Returns the name of the builtin a list calls, or NULL if it is not a call
+ * to a builtin (including when a script function shadows the builtin). */
+const char *builtin_form(optimizer_t *opt, list_t *list) {
+    if (list->type != T_LIST || !list->child || list->child->type != T_ATOM) {
+        return NULL;
+    }
+    const char *name = list->child->text;
+    if (symbol_get(opt->prog->symbols, name) || builtin_lookup(name) < 0) {
+        return NULL;
+    }
+    return name;
+}
+
+/* Swap new_child into parent in place of old_child, which is freed. */
+list_t *replace_child(list_t *parent, list_t *prev, list_t *old_child, list_t *new_child) {
+    if (new_child == old_child) {
+        return new_child;
+    }
+    new_child->next = old_child->next;
+    if (prev) {
+        prev->next = new_child;
+    } else {
+        parent->child = new_child;
+    }
+    if (parent->last == old_child) {
+        parent->last = new_child;
+    }
+    old_child->next = NULL;
+    list_free(old_child);
+    return new_child;
+}
+
+/* Optimize a node, returning the node that should take its place. The
+ * returned node may be the original or a new one; the caller is responsible
+ * for linking it in and freeing the original if they differ. */
+list_t *optimize_node(optimizer_t *opt, list_t *list) {
+    if (list->type == T_ATOM) {
+        if (!opt->resolve_atoms || is_local_name(opt, list->text, opt->func->body)) {
+            return list;
+        }
+        symbol_t *symbol = symbol_get(opt->prog->symbols, list->text);
+        if (symbol && (symbol->type == SYM_PROPERTY || symbol->type == SYM_CONSTANT)) {
+            list_t *number = list_create();
+            number->type = T_INTEGER;
+            number->number = symbol->d.value;
+            return number;
+        }
+        return list;
+    }
+    if (list->type != T_LIST || !list->child) {
+        return list;
+    }
+
+    const char *name = builtin_form(opt, list);
+    if (name && (strcmp(name, "quote") == 0 || strcmp(name, "log") == 0)) {
+        /* arguments are used unevaluated */
+        return list;
+    }
+
+    list_t *prev = list->child;
+    list_t *iter = list->child->next;
+    while (iter) {
+        list_t *next = iter->next;
+        iter = replace_child(list, prev, iter, optimize_node(opt, iter));
+        prev = iter;
+        iter = next;
+    }
+
+    if (!name) {
+        return list;
+    }
+    if (strcmp(name, "if") == 0) {
+        return fold_if(list);
+    }
+    if (strcmp(name, "proc") == 0) {
+        fold_proc(list);
+        return list;
+    }
+    return fold_call(opt, list, name);
+}
+
+list_t *fold_call(optimizer_t *opt, list_t *list, const char *name) {
+    int rule = 0;
+    for (int i = 0; foldable[i].name; ++i) {
+        if (strcmp(foldable[i].name, name) == 0) {
+            rule = foldable[i].args;
+        }
+    }
+    if (!rule) {
+        return list;
+    }
+
+    /* arithmetic that would overflow is left for run time to report, as
+     * division by zero is */
+    int op = arith_lookup(name);
+    int arithmetic = op >= 0 && (op < ARITH_LT || op > ARITH_GE);
+    int total = 0;
+    int argc = 0;
+    for (list_t *iter = list->child->next; iter; iter = iter->next) {
+        if (!is_constant(iter)) {
+            return list;
+        }
+        if (rule != FOLD_ANY && iter->type != T_INTEGER) {
+            return list;
+        }
+        if (rule == FOLD_DIVISORS && argc > 0 && iter->number == 0) {
+            return list;
+        }
+        if (arithmetic) {
+            if (argc == 0) {
+                total = iter->number;
+            } else if (!arith_binary(op, total, iter->number, &total)) {
+                return list;
+            }
+        }
+        ++argc;
+    }
+    if (strcmp(name, "eq") == 0 && argc < 2) {
+        return list;
+    }
+
+    svalue_t argv[argc + 1];
+    argc = 0;
+    for (list_t *iter = list->child->next; iter; iter = iter->next) {
+        argv[argc++] = value_from_list(iter);
+    }
+    svalue_t result = builtin_call(NULL, builtin_lookup(name), argc, argv);
+    list_t *folded = value_to_list(result);
+    value_free(result);
+    return folded;
+}
+
+/* An if with a constant condition becomes the branch that would be taken. */
+list_t *fold_if(list_t *list) {
+    list_t *cond = list->child->next;
+    if (!cond || !is_constant(cond)) {
+        return list;
+    }
+    list_t *branch = list_is_true(cond) ? cond->next : (cond->next ? cond->next->next : NULL);
+    if (!branch) {
+        return list_create_bool(list_is_true(cond));
+    }
+    return list_duplicate(branch);
+}
+
+/* Constants other than the last form of a proc have no effect. */
+void fold_proc(list_t *list) {
+    list_t *prev = list->child;
+    list_t *iter = list->child->next;
+    while (iter && iter->next) {
+        list_t *next = iter->next;
+        if (is_constant(iter)) {
+            prev->next = next;
+            iter->next = NULL;
+            list_free(iter);
+        } else {
+            prev = iter;
+        }
+        iter = next;
+    }
+}
+
+/**
+Simplify a function's body: property names and global constants become
+integers, calls to pure builtins with constant arguments are evaluated, and
+ifs with constant conditions are replaced by the branch taken.
+
+Returns the number of nodes removed from the body.
+*/
+int optimize_function(program_t *prog, function_t *func) {
+    if (!func->body || func->body->type != T_LIST) {
+        return 0;
+    }
+    optimizer_t opt = { prog, func, !has_computed_set(func->body) };
+    int before = count_nodes(func->body);
+
+    list_t *body = optimize_node(&opt, func->body);
+    if (body != func->body) {
+        list_free(func->body);
+        if (body->type != T_LIST) {
+            /* the body is run as a call, so keep a constant result in one */
+            list_t *wrapper = list_create();
+            list_t *proc = list_create();
+            proc->type = T_ATOM;
+            proc->text = str_dupl("proc");
+            list_add(wrapper, proc);
+            list_add(wrapper, body);
+            body = wrapper;
+        }
+        func->body = body;
+    }
+
+    int after = count_nodes(func->body);
+    TRACE(TRACE_LOADER, TRACE_INFO, "optimize: %s: %d nodes, %d removed\n",
+          func->name, after, before - after);
+    return before - after;
+}
+
+/**
+Run optimize_function over every function in a program.
+
+Returns the total number of nodes removed.
+*/
+int optimize_program(program_t *prog) {
+    int removed = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = prog->symbols->buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type == SYM_FUNCTION) {
+                removed += optimize_function(prog, symbol->d.ptr);
+            }
+        }
+    }
+    return removed;
+}
@@ -1,6 +1,8 @@
 #ifndef PARSE_H
 #define PARSE_H
 
+#include <stdint.h>
+
 #ifndef TRUE
 #define TRUE 1
 #endif
@@ -20,6 +22,8 @@
 #define PARSE_BADNOUN -2
 #define PARSE_NONMATCH -3
 #define PARSE_BADTOKEN -4
+#define PARSE_BADWORD -5
+#define PARSE_TOOLONG -6
 #define OBJ_AMBIG ((object_t*)-1)
 
 #define PT_STRING 1
@@ -54,6 +58,7 @@
 #define SYM_CONSTANT 2
 #define SYM_FUNCTION 3
 #define SYM_LIST 4
+#define SYM_VALUE 5
 
 #define PARSE_MAX_OBJS 64
 #define PARSE_MAX_NOUNS 2
@@ -67,24 +72,106 @@
 #define T_OBJECT_REF 5
 #define T_FUNCTION_REF 6
 
+#define T_END     97
 #define T_OPEN    98
 #define T_CLOSE   99
 
+#define ENGINE_TREE 0
+#define ENGINE_VM   1
+
+#define BUDGET_CONTINUE 0
+#define BUDGET_SUSPEND  1
+#define BUDGET_ABORT    2
+
+#define ARITH_ADD   0
+#define ARITH_SUB   1
+#define ARITH_MUL   2
+#define ARITH_DIV   3
+#define ARITH_MOD   4
+#define ARITH_LT    5
+#define ARITH_GT    6
+#define ARITH_LE    7
+#define ARITH_GE    8
+#define ARITH_MIN   9
+#define ARITH_MAX   10
+
+#define SCRIPT_OK               0
+#define SCRIPT_OUT_OF_STEPS     1
+#define SCRIPT_OUT_OF_ALLOCS    2
+#define SCRIPT_TOO_DEEP         3
+
 #define OBJPROP_INTERNAL_NAME   -1
 #define OBJPROP_PROTOTYPE       -2
 
+/* Tracing is compiled out entirely when TRACE_ENABLED is 0; otherwise each
+ * trace point costs a single mask-and-compare until a category is enabled. */
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+#define TRACE_PARSER      0x01
+#define TRACE_SCOPE       0x02
+#define TRACE_INTERPRETER 0x04
+#define TRACE_LOADER      0x08
+#define TRACE_ALL         0x0F
+
+#define TRACE_ERROR 1
+#define TRACE_INFO  2
+#define TRACE_DEBUG 3
+
+#if TRACE_ENABLED
+#define trace_on(cat, level) ((trace_categories & (cat)) && (level) <= trace_level)
+#define TRACE(cat, level, ...) \
+    do { if (trace_on(cat, level)) trace_out(cat, level, __VA_ARGS__); } while (0)
+#else
+#define trace_on(cat, level) 0
+/* the call is never made, but its arguments are still checked and used */
+#define TRACE(cat, level, ...) \
+    do { if (0) trace_out(cat, level, __VA_ARGS__); } while (0)
+#endif
+
+/* A token read by tokenize_source. Its text is not copied: it is the slice
+ * of length bytes at offset in the source the buffer was read from. Strings
+ * have their escapes decoded in place, and strings and vocabulary words are
+ * followed by a zero byte in the source. */
 typedef struct TOKEN {
     int type;
     int number;
-    char *text;
-
-    struct TOKEN *prev;
-    struct TOKEN *next;
+    unsigned offset;
+    unsigned length;
 } token_t;
 
+typedef struct TOKEN_BUFFER {
+    char *source;
+    token_t *tokens;
+    size_t count, capacity;
+} token_buffer_t;
+
+/* Reads tokens from source text one at a time, so that a loader can build
+ * from them without holding the whole token stream. A lexer made with
+ * lexer_open reads its file in chunks, holding only the text from the
+ * current token on; source then starts at offset base of the file. */
+typedef struct LEXER {
+    struct VOCABULARY *vocab;
+    char *source;
+    FILE *stream;       /* the rest of the file, or NULL */
+    size_t base;        /* file offset of source[0] */
+    size_t pos;         /* offset of the next byte to read */
+    size_t length;      /* bytes in source */
+    size_t keep;        /* offset of the first byte still needed */
+    size_t capacity;    /* size of source, if the lexer allocated it */
+    int allow_new_vocab;
+    const char *name;   /* the source's file name, for error messages */
+    uint64_t *hash;     /* if not NULL, continued over each chunk read */
+    int line;
+    size_t line_start;  /* offset of the start of the current line */
+    token_t token;      /* the token most recently read */
+} lexer_t;
+
 typedef struct LIST {
     int type;
     int number;
+    int refs;
     char *text;
     void *ptr;
     struct LIST *child;
@@ -93,6 +180,26 @@ typedef struct LIST {
     struct LIST *next;
 } list_t;
 
+/* A script value. Numbers, object references and function references are
+ * held in the value itself; strings and lists point to an immutable heap
+ * node. A node with a non-zero refs count is shared by that many values and
+ * freed when the last is released. A node with refs of zero belongs to
+ * something that outlives the value, such as a function body, and is only
+ * borrowed. The type is one of the T_ list types. */
+typedef struct SCRIPT_VALUE {
+    int type;
+    union {
+        int number;
+        void *ptr;
+        list_t *list;
+    } d;
+} svalue_t;
+
+typedef struct ALLOC_COUNTS {
+    unsigned long nodes;
+    unsigned long strings;
+} alloc_counts_t;
+
 typedef struct SYMBOL_INFO {
     char *name;
     int type;
@@ -108,11 +215,18 @@ typedef struct SYMBOL_TABLE {
     symbol_t *buckets[SYMBOL_TABLE_BUCKETS];
 } symboltable_t;
 
+/* A script function. Everything refers to a function by the function_t the
+ * loader made for it; when the function is reloaded, the new definition is
+ * published through latest and the old one is kept until no session can
+ * still be running it. Use function_current to find the definition to run. */
 typedef struct FUNCTION {
+    int id;
     const char *name;
     symboltable_t symbols;
     list_t *arg_list;
     list_t *body;
+    struct BYTECODE *code;
+    struct FUNCTION *latest;    /* the newest definition, or NULL for this one */
 } function_t;
 
 typedef struct GRAMMAR {
@@ -139,13 +253,27 @@ typedef struct VALUE {
         void *ptr;
     } d;
 } value_t;
+#define PF_SHARED 1
+
 typedef struct PROPERTY {
     int id;
+    int flags;
     value_t value;
 
     struct PROPERTY *next;
 } property_t;
 
+/* The remembered result of a property lookup made at one script call site.
+ * It stays valid until the session's world epoch changes. */
+typedef struct PROP_CACHE {
+    unsigned epoch;
+    int pid;
+    struct OBJECT *object;
+    int inherited;              /* the object had no property of its own */
+    struct OBJECT *prototype;   /* ...and this was its prototype */
+    property_t *prop;
+} prop_cache_t;
+
 typedef struct OBJECT {
     int id;
     property_t *properties;
@@ -165,6 +293,7 @@ typedef struct NOUN {
 
 typedef struct CMD_TOKEN {
     int word_no;
+    int corrected;
     const char *word;
 } cmd_token_t;
 
@@ -174,6 +303,7 @@ typedef struct COMMAND_INPUT {
 
     unsigned word_count, cur_word;
     cmd_token_t words[MAX_INPUT_WORDS];
+    int too_long;
 
     int action;
     function_t *action_func;
@@ -181,29 +311,169 @@ typedef struct COMMAND_INPUT {
     noun_t *nouns[PARSE_MAX_NOUNS];
 } input_t;
 
-typedef struct GAMEDATA {
-    const char **dictionary;
+typedef struct BATCH_RESULT {
+    int result;
+    function_t *action_func;
+    unsigned noun_count;
+    object_t *nouns[PARSE_MAX_NOUNS];
+    size_t next_offset;
+} batch_result_t;
+
+/* A source file a program was loaded from. The grammar lines a file defines
+ * are consecutive in the program's action list, so that they can be replaced
+ * when the file is reloaded. */
+typedef struct SOURCE_FILE {
+    char *name;
+    action_t *first_action;     /* NULL if the file defines none */
+    int action_count;
+    struct SOURCE_FILE *next;
+} source_file_t;
+
+typedef struct VOCABULARY vocabulary_t;
+typedef struct SCHEDULER scheduler_t;
+typedef struct IMAGE_WRITER image_writer_t;
+
+/* Data produced by loading the game files. Once loading is complete this is
+ * never modified, except by reload_file replacing function definitions and
+ * grammar, and may be shared by any number of sessions. Objects in the
+ * program form the template world that each session is cloned from. */
+typedef struct PROGRAM {
+    vocabulary_t *vocab;
     action_t *actions;
+    symboltable_t *symbols;
     object_t *root;
+
+    int object_count;
+    int object_capacity;
+    object_t **objects;
+    int next_property_id;
+    int function_count;
+    int prop_cache_count;
+    int game_loaded;
+    struct IMAGE *image;        /* the mapping, if loaded from an image */
+    source_file_t *sources;     /* in the order they were loaded */
+    uint64_t source_hash;       /* of the sources as loaded, if cached; or 0 */
+    struct RELOAD *reload;
+} program_t;
+
+/* Why a turn's scripts were stopped, for reporting once the turn is over. */
+typedef struct SCRIPT_ERROR {
+    int code;               /* SCRIPT_OUT_OF_*, or SCRIPT_OK */
+    const char *where;      /* function or form running at the time */
+    long steps;
+    unsigned long allocs;
+} script_error_t;
+
+/* A session's allowance of script evaluation steps and list allocations
+ * for the current turn. Interpreters decrement countdown for each step and
+ * call budget_check once it runs out. */
+typedef struct SCRIPT_BUDGET {
+    long countdown;
+    long period;                /* what countdown was last set to */
+    long steps;                 /* steps counted by budget_check this turn */
+    long slice_steps;           /* steps per scheduler slice, or 0 */
+    long slice_left;
+    unsigned long allocs;       /* allocations made in earlier slices */
+    unsigned long alloc_start;  /* list_allocs total when this slice began */
+    int depth;                  /* nested calls to list_run_function */
+    int can_suspend;            /* the next VM run may be suspended */
+    int suspended;              /* a VM run is waiting to be resumed */
+    script_error_t error;
+} script_budget_t;
+
+/* The mutable state of a single game session. */
+typedef struct GAMEDATA {
+    program_t *program;
+    symboltable_t *symbols;
+    object_t *root;
+    object_t **objects;
+    object_t *object_block;
     object_t *gameinfo;
     object_t *player;
-    symboltable_t *symbols;
 
-    int game_loaded;
+    FILE *out;
+    FILE *log;
+    struct SESSION_TURNS *turns;
+    struct VM_STACK *vm;
+    unsigned world_epoch;
+    unsigned long reload_epoch; /* reload epoch when the turn began, or 0 */
+    prop_cache_t *prop_site;
+    int profiling;
+    struct PROFILE *profile;
+    script_budget_t budget;
+    input_t *suspended_input;
+
     int quit_game;
     int search_count;
     object_t *search[PARSE_MAX_OBJS];
 } gamedata_t;
 
+#define SCHED_LATENCY_BUCKETS 32
+
+typedef void (*turn_callback_t)(gamedata_t *gd, const char *command,
+                                const char *output, size_t length, void *user_data);
+
+typedef struct SCHED_STATS {
+    int threads;                /* worker threads actually running */
+    unsigned long turns;
+    unsigned long steals;
+    unsigned long preemptions;  /* turns suspended at the end of a slice */
+    double elapsed;
+    double turns_per_sec;
+    double latency_p50;
+    double latency_p99;
+    double latency_max;
+} sched_stats_t;
+
+/* How long each phase of the last call to load_files took, in seconds. */
+typedef struct LOAD_TIMES {
+    double build;       /* reading and building each file on its own */
+    double merge;       /* merging the files into one program */
+    double vocab;
+    double link;
+    double optimize;
+    double compile;
+} load_times_t;
+
+/* The shape of a synthetic world for world_generate. Items are dealt out
+ * between the rooms; each run of depth items is nested one inside the
+ * next, starting in the room. */
+typedef struct WORLD_SPEC {
+    int rooms;
+    int items_per_room;
+    int depth;
+    int vocab_size;     /* distinct words the items are named with */
+    int prototypes;     /* item prototypes, shared out among the items */
+    int grammar_lines;  /* actions, each with a verb of its own */
+    int functions;      /* functions the actions are shared out among */
+    int rooms_per_file;
+} world_spec_t;
+
 
 extern const char *symbol_types[];
+extern unsigned trace_categories;
+extern int trace_level;
+extern int script_engine;
+extern long script_step_limit;
+extern unsigned long script_alloc_limit;
+extern long script_slice_steps;
+extern int load_threads;
+extern const char *load_cache_dir;
+extern const char *load_manifest;
+extern load_times_t load_times;
+extern __thread alloc_counts_t list_allocs;
 
 
 void dump_list(FILE *dest, list_t *list);
-void dump_tokens(FILE *dest, token_t *tokens);
+void dump_tokens(FILE *dest, token_buffer_t *buffer);
 
-void token_free(token_t *token);
-void token_freelist(token_t *tokens);
+void lexer_init(lexer_t *lex, vocabulary_t *vocab, char *source, int allow_new_vocab);
+int lexer_open(lexer_t *lex, vocabulary_t *vocab, const char *filename, int allow_new_vocab);
+void lexer_close(lexer_t *lex);
+int lexer_next(lexer_t *lex);
+token_buffer_t *tokenize_source(vocabulary_t *vocab, char *file, int allow_new_vocab);
+const char *token_text(token_buffer_t *buffer, token_t *token);
+void token_buffer_free(token_buffer_t *buffer);
 
 void list_add(list_t *list, list_t *item);
 list_t *list_create();
@@ -216,11 +486,26 @@ void list_free(list_t *list);
 void list_freelist(list_t *lists);
 int list_size(list_t *list);
 int list_is_true(list_t *list);
+svalue_t value_int(int number);
+svalue_t value_bool(int is_true);
+svalue_t value_false();
+svalue_t value_true();
+svalue_t value_object(object_t *object);
+svalue_t value_function(function_t *function);
+svalue_t value_string(const char *text);
+svalue_t value_list(list_t *list);
+svalue_t value_from_list(list_t *list);
+list_t *value_to_list(svalue_t value);
+int value_is_heap(svalue_t value);
+svalue_t value_copy(svalue_t value);
+void value_free(svalue_t value);
+int value_is_true(svalue_t value);
+void dump_value(FILE *dest, svalue_t value);
 
 
 int object_contains(object_t *container, object_t *content);
 int object_contains_indirect(object_t *container, object_t *content);
-object_t* object_create(object_t *parent);
+object_t* object_create(program_t *prog, object_t *parent);
 void object_dump(gamedata_t *gd, object_t *obj);
 void object_free(object_t *obj);
 void object_move(object_t *obj, object_t *new_parent);
@@ -231,31 +516,49 @@ void object_property_add_object(object_t *obj, int pid, object_t *value);
 void object_property_add_string(object_t *obj, int pid, const char *text);
 void object_property_delete(object_t *obj, int pid);
 property_t* object_property_get(object_t *obj, int pid);
+property_t* object_property_get_cached(prop_cache_t *cache, unsigned epoch, object_t *obj, int pid);
 int object_property_is_true(object_t *obj, int pid, int default_value);
+int property_is_true(property_t *prop, int default_value);
 
 void objectloop_depth_first(object_t *root, void (*callback)(object_t *obj));
+int object_matches(object_t *obj, int pid, int want);
+object_t* object_next_in(object_t *root, object_t *cur, int descend, int pid, int want);
+int object_count_in(object_t *root, int descend, int pid, int want);
 void objectloop_free(object_t *obj);
 
 void property_free(property_t *prop);
 
 
-void vocab_dump();
-void vocab_raw_add(const char *the_word);
-void vocab_build();
-void vocab_raw_free();
-int vocab_index(const char *word);
-int vocab_is_built();
-int action_add(gamedata_t *gd, action_t *action);
-
-
-gamedata_t *gamedata_create();
+vocabulary_t *vocab_create();
+void vocab_free(vocabulary_t *vocab);
+void vocab_dump(FILE *dest, vocabulary_t *vocab);
+void vocab_raw_add(vocabulary_t *vocab, const char *the_word);
+void vocab_merge(vocabulary_t *vocab, vocabulary_t *from);
+const char *vocab_raw_word(vocabulary_t *vocab, unsigned index);
+void vocab_build(vocabulary_t *vocab);
+int vocab_index(vocabulary_t *vocab, const char *word);
+int vocab_is_built(vocabulary_t *vocab);
+int vocab_suggest(vocabulary_t *vocab, const char *word, int max_distance, int *distance);
+const char *vocab_word(vocabulary_t *vocab, int word_no);
+size_t vocab_write_image(image_writer_t *w, vocabulary_t *vocab);
+int action_add(program_t *prog, action_t *action);
+
+
+program_t *program_create();
+void program_free(program_t *prog);
+gamedata_t *session_create(program_t *prog);
+void session_free(gamedata_t *gd);
+object_t *session_object(gamedata_t *gd, object_t *template_obj);
 unsigned hash_string(const char *text);
 symboltable_t* symboltable_create();
-gamedata_t* load_data();
-void free_data(gamedata_t *gd);
+program_t* load_data();
+program_t* load_files(const char **filelist);
+int load_sources(program_t *prog, const char **filelist, uint64_t *hashes);
+char **read_manifest(const char *filename);
 object_t *object_get_by_ident(gamedata_t *gd, const char *ident);
-int property_number(gamedata_t *gd, const char *name);
-void add_builtin_property(gamedata_t *gd, const char *name, int pid);
+object_t *program_object_by_ident(program_t *prog, const char *ident);
+int property_number(program_t *prog, const char *name);
+void add_builtin_property(program_t *prog, const char *name, int pid);
 char *str_dupl(const char *text);
 char *str_dupl_left(const char *text, int size);
 void symbol_add_value(symboltable_t *table, const char *name, int type, int value);
@@ -264,29 +567,122 @@ symbol_t* symbol_get(symboltable_t *table, const char *name);
 void symboltable_free(symboltable_t *table);
 
 
-void dump_symbol_table(FILE *fp, gamedata_t *gd);
-int tokenize_file(const char *filename);
-gamedata_t* parse_tokens();
-list_t* parse_string(const char *text);
+void dump_symbol_table(FILE *fp, program_t *prog);
+list_t* parse_string(vocabulary_t *vocab, const char *text);
+int load_source(program_t *prog, const char *text);
+int load_file(program_t *prog, const char *filename, uint64_t *hash);
+int link_action(program_t *prog, action_t *action);
 
 void debug_out(const char *msg, ...);
+void gd_debug_out(gamedata_t *gd, const char *msg, ...);
+void gd_text_out(gamedata_t *gd, const char *msg, ...);
+void trace_out(unsigned category, int level, const char *msg, ...);
+int trace_set_categories(const char *names);
 void text_out(const char *msg, ...);
 char* read_line();
 char* read_file(const char *filename);
-void style_bold();
-void style_normal();
-void style_reverse();
+void style_bold(gamedata_t *gd);
+void style_normal(gamedata_t *gd);
+void style_reverse(gamedata_t *gd);
+
+
+int tokenize(gamedata_t *gd, input_t *input);
+void free_noun_list(noun_t *noun);
+int parse_command(gamedata_t *gd, input_t *input);
+void parse_report(gamedata_t *gd, input_t *input, int result);
+int parse(gamedata_t *gd, input_t *input);
+int dispatch_action(gamedata_t *gd, input_t *input);
+void game_turn(gamedata_t *gd, const char *text);
+int game_resume(gamedata_t *gd);
+void input_free(input_t *input);
+
+scheduler_t *scheduler_create(int thread_count, turn_callback_t callback, void *user_data);
+void scheduler_free(scheduler_t *sched);
+void scheduler_submit(scheduler_t *sched, gamedata_t *gd, const char *command);
+void scheduler_wait_idle(scheduler_t *sched);
+void scheduler_session_release(gamedata_t *gd);
+void scheduler_stats(scheduler_t *sched, sched_stats_t *stats);
+int bench_run(const char *name, int size);
+int scheduler_run_file(program_t *prog, const char *filename, int session_count, int thread_count);
+size_t parse_batch(gamedata_t *gd, const char *buffer, size_t length,
+                   batch_result_t *results, size_t max_results, size_t *consumed);
+int batch_run_file(gamedata_t *gd, const char *filename, int print_results);
 
 
 void object_name_print(gamedata_t *gd, object_t *obj);
-void object_property_print(object_t *obj, int prop_num);
+void object_property_print(gamedata_t *gd, object_t *obj, int prop_num);
 void print_list_horz(gamedata_t *gd, object_t *parent_obj);
 void print_list_vert_core(gamedata_t *gd, object_t *parent_obj, int depth);
 void print_list_vert(gamedata_t *gd, object_t *parent_obj);
 void print_location(gamedata_t *gd, object_t *location);
 
-list_t *list_run_function_noargs(gamedata_t *gd, function_t *func);
-list_t *list_run_function(gamedata_t *gd, function_t *func, list_t *args);
-list_t *list_run(gamedata_t *gd, symboltable_t *locals, list_t *list);
+svalue_t list_run_function_noargs(gamedata_t *gd, function_t *func);
+svalue_t list_run_function(gamedata_t *gd, function_t *func, int argc, svalue_t *argv);
+svalue_t list_evaluate(gamedata_t *gd, symboltable_t *locals, list_t *list);
+svalue_t list_run(gamedata_t *gd, symboltable_t *locals, list_t *list);
+int builtin_lookup(const char *name);
+const char *builtin_name(int index);
+int builtin_count();
+int builtin_evaluates_args(int index);
+int arith_lookup(const char *name);
+int arith_binary(int op, int left, int right, int *result);
+svalue_t builtin_call(gamedata_t *gd, int index, int argc, svalue_t *argv);
+void budget_start_turn(gamedata_t *gd);
+void budget_start_slice(gamedata_t *gd);
+int budget_check(gamedata_t *gd, const char *where, int may_suspend);
+int budget_report(gamedata_t *gd);
+
+void profile_start(gamedata_t *gd);
+void profile_stop(gamedata_t *gd);
+void profile_reset(gamedata_t *gd);
+void profile_free(gamedata_t *gd);
+void profile_enter_function(gamedata_t *gd, function_t *func);
+void profile_enter_builtin(gamedata_t *gd, int index);
+void profile_exit(gamedata_t *gd);
+void profile_report(gamedata_t *gd, FILE *dest);
+int profile_write_folded(gamedata_t *gd, const char *filename);
+
+struct RELOAD *reload_create();
+void reload_free(program_t *prog);
+void reload_session_add(gamedata_t *gd);
+void reload_session_remove(gamedata_t *gd);
+void reload_enter(gamedata_t *gd);
+void reload_leave(gamedata_t *gd);
+function_t *function_current(function_t *func);
+int reload_file(program_t *prog, const char *filename, int *functions, int *actions);
+
+void world_spec_default(world_spec_t *spec, int objects);
+int world_spec_parse(world_spec_t *spec, const char *text);
+char *world_generate(const world_spec_t *spec, const char *dir);
+
+int optimize_function(program_t *prog, function_t *func);
+int optimize_program(program_t *prog);
+
+size_t image_alloc(image_writer_t *w, const void *src, size_t length);
+size_t image_alloc_flat(image_writer_t *w, const void *src, size_t length);
+void *image_at(image_writer_t *w, size_t offset);
+void image_pointer(image_writer_t *w, size_t field, size_t target);
+size_t image_string(image_writer_t *w, const char *text);
+uint64_t hash_bytes(const char *data, size_t length);
+uint64_t hash_update(uint64_t hash, const char *data, size_t length);
+int hash_file(const char *filename, uint64_t *hash);
+uint64_t cache_source_hash(const char **filelist, const uint64_t *hashes);
+program_t *cache_load(const char *dir, const char **filelist);
+int cache_store(const char *dir, const char **filelist, program_t *prog);
+
+int image_write(program_t *prog, const char *filename);
+program_t *image_load(const char *filename);
+int image_contains(program_t *prog, const void *ptr);
+int image_source_hash(const char *filename, uint64_t *hash);
+void image_free(program_t *prog);
+
+int vm_compile(program_t *prog, function_t *func);
+int vm_compile_program(program_t *prog, int *function_count);
+void vm_free(struct BYTECODE *code);
+void vm_dump(FILE *dest, function_t *func);
+void vm_stack_free(gamedata_t *gd);
+svalue_t vm_resume(gamedata_t *gd);
+svalue_t vm_run_function(gamedata_t *gd, function_t *func, int argc, svalue_t *argv);
+int vm_check_file(program_t *prog, const char *filename);
 
 #endif // PARSE_H
@@ -0,0 +1,272 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parse.h"
+
+/* An instrumenting profiler for script code. The interpreters report each
+ * script function and builtin as it is entered and left; time and list
+ * allocations are charged to the entry on top of the profile's stack, and
+ * to the calling context (the chain of entries above it) for folded-stack
+ * output. Script functions are profiled under their function id and
+ * builtins after them, under the program's function count plus the
+ * builtin's index. */
+
+typedef struct PROFILE_ENTRY {
+    const char *name;
+    int is_builtin;
+    unsigned long calls;
+    double inclusive, exclusive;
+    unsigned long allocs, self_allocs;
+    int active;     /* number of calls currently on the stack */
+} profile_entry_t;
+
+typedef struct PROFILE_NODE {
+    int entry;
+    double self_time;
+    struct PROFILE_NODE *parent;
+    struct PROFILE_NODE *first_child;
+    struct PROFILE_NODE *sibling;
+} profile_node_t;
+
+typedef struct PROFILE_FRAME {
+    profile_node_t *node;
+    double start, child_time;
+    unsigned long start_allocs, child_allocs;
+} profile_frame_t;
+
+typedef struct PROFILE {
+    profile_entry_t *entries;
+    int entry_count;
+    profile_node_t root;
+    profile_frame_t *frames;
+    int frame_count, frame_capacity;
+} profile_t;
+
+static double profile_now();
+static unsigned long profile_allocs();
+static void profile_push(gamedata_t *gd, int entry, const char *name, int is_builtin);
+static void profile_free_nodes(profile_node_t *node);
+static int entry_compare(const void *left, const void *right);
+static void profile_write_node(FILE *dest, profile_t *profile, profile_node_t *node, int depth);
+
+double profile_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned long profile_allocs() {
+    return list_allocs.nodes + list_allocs.strings;
+}
+
+/**
+Begin (or resume) profiling a session. Anything already recorded is kept;
+calls that were running when profiling stopped are forgotten.
+*/
+void profile_start(gamedata_t *gd) {
+    if (!gd->profile) {
+        gd->profile = calloc(sizeof(profile_t), 1);
+        gd->profile->root.entry = -1;
+    }
+    profile_t *profile = gd->profile;
+    profile->frame_count = 0;
+    for (int i = 0; i < profile->entry_count; ++i) {
+        profile->entries[i].active = 0;
+    }
+    gd->profiling = TRUE;
+}
+
+void profile_stop(gamedata_t *gd) {
+    gd->profiling = FALSE;
+}
+
+/**
+Discard everything recorded so far. Profiling stays on if it was on.
+*/
+void profile_reset(gamedata_t *gd) {
+    int profiling = gd->profiling;
+    profile_free(gd);
+    if (profiling) {
+        profile_start(gd);
+    }
+}
+
+void profile_free(gamedata_t *gd) {
+    profile_t *profile = gd->profile;
+    gd->profiling = FALSE;
+    if (!profile) return;
+    profile_free_nodes(profile->root.first_child);
+    free(profile->entries);
+    free(profile->frames);
+    free(profile);
+    gd->profile = NULL;
+}
+
+void profile_free_nodes(profile_node_t *node) {
+    while (node) {
+        profile_node_t *next = node->sibling;
+        profile_free_nodes(node->first_child);
+        free(node);
+        node = next;
+    }
+}
+
+void profile_push(gamedata_t *gd, int entry, const char *name, int is_builtin) {
+    profile_t *profile = gd->profile;
+    if (entry >= profile->entry_count) {
+        int new_count = entry + 1 + builtin_count();
+        profile->entries = realloc(profile->entries, sizeof(profile_entry_t) * new_count);
+        memset(&profile->entries[profile->entry_count], 0,
+               sizeof(profile_entry_t) * (new_count - profile->entry_count));
+        profile->entry_count = new_count;
+    }
+    profile_entry_t *info = &profile->entries[entry];
+    info->name = name;
+    info->is_builtin = is_builtin;
+    ++info->calls;
+    ++info->active;
+
+    profile_node_t *parent = profile->frame_count > 0
+                           ? profile->frames[profile->frame_count - 1].node
+                           : &profile->root;
+    profile_node_t *node = parent->first_child;
+    while (node && node->entry != entry) {
+        node = node->sibling;
+    }
+    if (!node) {
+        node = calloc(sizeof(profile_node_t), 1);
+        node->entry = entry;
+        node->parent = parent;
+        node->sibling = parent->first_child;
+        parent->first_child = node;
+    }
+
+    if (profile->frame_count >= profile->frame_capacity) {
+        profile->frame_capacity = profile->frame_capacity ? profile->frame_capacity * 2 : 64;
+        profile->frames = realloc(profile->frames, sizeof(profile_frame_t) * profile->frame_capacity);
+    }
+    profile_frame_t *frame = &profile->frames[profile->frame_count++];
+    frame->node = node;
+    frame->child_time = 0;
+    frame->child_allocs = 0;
+    frame->start_allocs = profile_allocs();
+    frame->start = profile_now();
+}
+
+void profile_enter_function(gamedata_t *gd, function_t *func) {
+    profile_push(gd, func->id, func->name, FALSE);
+}
+
+void profile_enter_builtin(gamedata_t *gd, int index) {
+    profile_push(gd, gd->program->function_count + index, builtin_name(index), TRUE);
+}
+
+/**
+Leave the most recently entered function or builtin.
+*/
+void profile_exit(gamedata_t *gd) {
+    double now = profile_now();
+    profile_t *profile = gd->profile;
+    if (profile->frame_count == 0) {
+        /* entered before profiling started */
+        return;
+    }
+    profile_frame_t *frame = &profile->frames[--profile->frame_count];
+    profile_entry_t *info = &profile->entries[frame->node->entry];
+    double elapsed = now - frame->start;
+    unsigned long allocs = profile_allocs() - frame->start_allocs;
+
+    frame->node->self_time += elapsed - frame->child_time;
+    info->exclusive += elapsed - frame->child_time;
+    info->self_allocs += allocs - frame->child_allocs;
+    /* recursive calls are already inside the outermost call's time */
+    if (--info->active == 0) {
+        info->inclusive += elapsed;
+        info->allocs += allocs;
+    }
+    if (profile->frame_count > 0) {
+        profile->frames[profile->frame_count - 1].child_time += elapsed;
+        profile->frames[profile->frame_count - 1].child_allocs += allocs;
+    }
+}
+
+int entry_compare(const void *left, const void *right) {
+    const profile_entry_t *l = *(const profile_entry_t**)left;
+    const profile_entry_t *r = *(const profile_entry_t**)right;
+    if (l->exclusive < r->exclusive) return 1;
+    if (l->exclusive > r->exclusive) return -1;
+    return 0;
+}
+
+/**
+Write a table of everything profiled so far, slowest (by exclusive time)
+first.
+*/
+void profile_report(gamedata_t *gd, FILE *dest) {
+    profile_t *profile = gd->profile;
+    if (!profile) {
+        fprintf(dest, "profile: nothing recorded\n");
+        return;
+    }
+
+    int count = 0;
+    profile_entry_t *sorted[profile->entry_count + 1];
+    for (int i = 0; i < profile->entry_count; ++i) {
+        if (profile->entries[i].calls > 0) {
+            sorted[count++] = &profile->entries[i];
+        }
+    }
+    qsort(sorted, count, sizeof(profile_entry_t*), entry_compare);
+
+    fprintf(dest, "%10s %12s %12s %10s %10s  %s\n",
+            "calls", "incl ms", "excl ms", "allocs", "self alc", "name");
+    for (int i = 0; i < count; ++i) {
+        profile_entry_t *info = sorted[i];
+        fprintf(dest, "%10lu %12.3f %12.3f %10lu %10lu  %s%s\n",
+                info->calls, info->inclusive * 1000.0, info->exclusive * 1000.0,
+                info->allocs, info->self_allocs,
+                info->name, info->is_builtin ? " (builtin)" : "");
+    }
+}
+
+void profile_write_node(FILE *dest, profile_t *profile, profile_node_t *node, int depth) {
+    for (profile_node_t *child = node->first_child; child; child = child->sibling) {
+        long micros = (long)(child->self_time * 1e6 + 0.5);
+        if (micros > 0) {
+            const char *path[depth + 1];
+            int at = depth;
+            for (profile_node_t *iter = child; iter != &profile->root; iter = iter->parent) {
+                path[at--] = profile->entries[iter->entry].name;
+            }
+            for (int i = 0; i <= depth; ++i) {
+                fprintf(dest, "%s%s", i ? ";" : "", path[i]);
+            }
+            fprintf(dest, " %ld\n", micros);
+        }
+        profile_write_node(dest, profile, child, depth + 1);
+    }
+}
+
+/**
+Write the recorded calling contexts in the folded-stack format read by
+flame graph tools: one line per call chain, giving its exclusive time in
+microseconds.
+
+Returns true on success and false if the file could not be written.
+*/
+int profile_write_folded(gamedata_t *gd, const char *filename) {
+    FILE *dest = fopen(filename, "w");
+    if (!dest) {
+        gd_debug_out(gd, "profile_write_folded: could not open %s\n", filename);
+        return FALSE;
+    }
+    if (gd->profile) {
+        profile_write_node(dest, gd->profile, &gd->profile->root, 0);
+    }
+    fclose(dest);
+    return TRUE;
+}
@@ -0,0 +1,428 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+
+/* Reloading a source file replaces the definitions of its functions and its
+ * grammar lines while sessions may be running the old ones, perhaps in a
+ * turn that is suspended between scheduler slices. New definitions are
+ * published with a single pointer store, so a session sees either the old
+ * definition or the new one and never a mixture.
+ *
+ * Old definitions are reclaimed by epoch. Each reload advances the program's
+ * reload epoch, and each session notes the epoch when it starts a turn and
+ * clears it when the turn is over. Whatever a reload replaced can only still
+ * be in use by sessions whose turns began before the reload, so it is freed
+ * once every session is either between turns or started its turn after
+ * that reload. */
+
+/* Something a reload replaced, waiting until no session can be using it. */
+typedef struct RETIRED {
+    unsigned long epoch;    /* the epoch begun by the reload that replaced it */
+    function_t *func;       /* an old definition, or NULL */
+    function_t *owner;      /* ...and the function it was a definition of */
+    action_t *actions;      /* a run of old grammar lines, or NULL */
+    int action_count;
+
+    struct RETIRED *next;
+} retired_t;
+
+struct RELOAD {
+    pthread_mutex_t lock;   /* held by reloads and while reclaiming */
+    unsigned long epoch;
+    gamedata_t **sessions;
+    int session_count, session_capacity;
+    retired_t *retired;
+};
+
+static void definition_free(function_t *func);
+static void retired_free(program_t *prog, retired_t *retired);
+static void reclaim(program_t *prog);
+static retired_t *retire(retired_t *list, function_t *func, function_t *owner,
+                         action_t *actions, int action_count);
+static int check_unit(program_t *prog, program_t *unit);
+static int replace_functions(program_t *prog, program_t *unit, retired_t **retired);
+static int replace_actions(program_t *prog, program_t *unit, source_file_t *source,
+                           retired_t **retired);
+
+
+struct RELOAD *reload_create() {
+    struct RELOAD *reload = calloc(sizeof(struct RELOAD), 1);
+    pthread_mutex_init(&reload->lock, NULL);
+    reload->epoch = 1;
+    return reload;
+}
+
+/**
+Release a program's reload state, along with every definition and grammar
+line reloads have replaced. No session may be using the program.
+*/
+void reload_free(program_t *prog) {
+    struct RELOAD *reload = prog->reload;
+    if (!reload) return;
+
+    while (reload->retired) {
+        retired_t *next = reload->retired->next;
+        retired_free(prog, reload->retired);
+        reload->retired = next;
+    }
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = prog->symbols->buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type == SYM_FUNCTION) {
+                function_t *func = symbol->d.ptr;
+                definition_free(func->latest);
+                func->latest = NULL;
+            }
+        }
+    }
+    /* a game image's source list is part of the mapping */
+    while (prog->sources && !prog->image) {
+        source_file_t *next = prog->sources->next;
+        free(prog->sources->name);
+        free(prog->sources);
+        prog->sources = next;
+    }
+    pthread_mutex_destroy(&reload->lock);
+    free(reload->sessions);
+    free(reload);
+    prog->reload = NULL;
+}
+
+/* Free a definition made by a reload. Its name belongs to the function. */
+void definition_free(function_t *func) {
+    if (!func) return;
+    if (func->arg_list) list_free(func->arg_list);
+    if (func->body) list_free(func->body);
+    vm_free(func->code);
+    free(func);
+}
+
+/* Free something a reload replaced. A function's original definition is
+ * part of the function itself, so only its contents are freed; in a game
+ * image, they are part of the mapping apart from the bytecode, as are the
+ * grammar lines the image was written with. */
+void retired_free(program_t *prog, retired_t *retired) {
+    if (retired->func && retired->func == retired->owner) {
+        function_t *func = retired->owner;
+        if (!prog->image) {
+            if (func->arg_list) list_free(func->arg_list);
+            if (func->body) list_free(func->body);
+        }
+        vm_free(func->code);
+        func->arg_list = NULL;
+        func->body = NULL;
+        func->code = NULL;
+    } else {
+        definition_free(retired->func);
+    }
+
+    action_t *action = retired->actions;
+    for (int i = 0; i < retired->action_count; ++i) {
+        action_t *next = action->next;
+        if (!image_contains(prog, action)) {
+            free(action);
+        }
+        action = next;
+    }
+    free(retired);
+}
+
+retired_t *retire(retired_t *list, function_t *func, function_t *owner,
+                  action_t *actions, int action_count) {
+    retired_t *retired = calloc(sizeof(retired_t), 1);
+    retired->func = func;
+    retired->owner = owner;
+    retired->actions = actions;
+    retired->action_count = action_count;
+    retired->next = list;
+    return retired;
+}
+
+/* Free whatever no session can still be using. The caller holds the
+ * reload lock. */
+void reclaim(program_t *prog) {
+    struct RELOAD *reload = prog->reload;
+    unsigned long oldest = ULONG_MAX;
+    for (int i = 0; i < reload->session_count; ++i) {
+        unsigned long epoch = __atomic_load_n(&reload->sessions[i]->reload_epoch, __ATOMIC_ACQUIRE);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    int freed = 0;
+    retired_t *kept = NULL, **tail = &kept;
+    retired_t *retired = reload->retired;
+    while (retired) {
+        retired_t *next = retired->next;
+        if (retired->epoch <= oldest) {
+            retired_free(prog, retired);
+            ++freed;
+        } else {
+            *tail = retired;
+            tail = &retired->next;
+        }
+        retired = next;
+    }
+    *tail = NULL;
+    __atomic_store_n(&reload->retired, kept, __ATOMIC_RELAXED);
+    if (freed) {
+        TRACE(TRACE_LOADER, TRACE_DEBUG, "reclaim: freed %d replaced items\n", freed);
+    }
+}
+
+
+/* ****************************************************************************
+ * Sessions
+ * ****************************************************************************/
+
+/**
+Add a session to those whose turns hold back the reclaiming of replaced
+definitions. Called when the session is created.
+*/
+void reload_session_add(gamedata_t *gd) {
+    struct RELOAD *reload = gd->program->reload;
+    pthread_mutex_lock(&reload->lock);
+    if (reload->session_count >= reload->session_capacity) {
+        reload->session_capacity = reload->session_capacity ? reload->session_capacity * 2 : 16;
+        reload->sessions = realloc(reload->sessions, sizeof(gamedata_t*) * reload->session_capacity);
+    }
+    reload->sessions[reload->session_count++] = gd;
+    pthread_mutex_unlock(&reload->lock);
+}
+
+void reload_session_remove(gamedata_t *gd) {
+    struct RELOAD *reload = gd->program->reload;
+    pthread_mutex_lock(&reload->lock);
+    for (int i = 0; i < reload->session_count; ++i) {
+        if (reload->sessions[i] == gd) {
+            reload->sessions[i] = reload->sessions[--reload->session_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reload->lock);
+}
+
+/**
+Note that a session is starting a turn, during which it may use any
+definition that is current now.
+*/
+void reload_enter(gamedata_t *gd) {
+    if (gd->reload_epoch) {
+        return;
+    }
+    struct RELOAD *reload = gd->program->reload;
+    __atomic_store_n(&gd->reload_epoch, __atomic_load_n(&reload->epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    /* a reload that did not see our epoch must be seen by everything we
+     * read from here on */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+Note that a session's turn is over, unless it is suspended, and free any
+replaced definitions that were waiting for it.
+*/
+void reload_leave(gamedata_t *gd) {
+    if (gd->suspended_input) {
+        return;
+    }
+    struct RELOAD *reload = gd->program->reload;
+    __atomic_store_n(&gd->reload_epoch, 0, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&reload->retired, __ATOMIC_RELAXED)
+            && pthread_mutex_trylock(&reload->lock) == 0) {
+        reclaim(gd->program);
+        pthread_mutex_unlock(&reload->lock);
+    }
+}
+
+/**
+Find the definition of a function to run: the newest one published by a
+reload, or the one it was loaded with.
+*/
+function_t *function_current(function_t *func) {
+    function_t *latest = __atomic_load_n(&func->latest, __ATOMIC_ACQUIRE);
+    return latest ? latest : func;
+}
+
+
+/* ****************************************************************************
+ * Reloading
+ * ****************************************************************************/
+
+/* Check that a reloaded file can be swapped into the program: it may only
+ * define functions the program already has and use vocabulary words the
+ * program already knows, since adding either would renumber what sessions
+ * hold. Links the file's grammar against the program. */
+int check_unit(program_t *prog, program_t *unit) {
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = unit->symbols->buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type != SYM_FUNCTION) {
+                continue;
+            }
+            symbol_t *existing = symbol_get(prog->symbols, symbol->name);
+            if (!existing || existing->type != SYM_FUNCTION) {
+                text_out("reload_file: new function %s needs a restart.\n", symbol->name);
+                return FALSE;
+            }
+        }
+    }
+    for (action_t *action = unit->actions; action; action = action->next) {
+        for (int i = 0; i < GT_MAX_TOKENS; ++i) {
+            if (action->grammar[i].type == GT_WORD
+                    && vocab_index(prog->vocab, action->grammar[i].ptr) < 0) {
+                text_out("reload_file: new vocabulary word <%s> needs a restart.\n",
+                         (char*)action->grammar[i].ptr);
+                return FALSE;
+            }
+        }
+        if (!link_action(prog, action)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Give each function the file defines its new definition, optimized and
+ * compiled against the program. Returns the number replaced. */
+int replace_functions(program_t *prog, program_t *unit, retired_t **retired) {
+    int count = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = unit->symbols->buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type != SYM_FUNCTION) {
+                continue;
+            }
+            function_t *from = symbol->d.ptr;
+            function_t *func = symbol_get(prog->symbols, symbol->name)->d.ptr;
+            function_t *definition = calloc(sizeof(function_t), 1);
+            definition->id = func->id;
+            definition->name = func->name;
+            definition->arg_list = from->arg_list;
+            definition->body = from->body;
+            from->arg_list = NULL;
+            from->body = NULL;
+            optimize_function(prog, definition);
+            vm_compile(prog, definition);
+
+            function_t *old = function_current(func);
+            __atomic_store_n(&func->latest, definition, __ATOMIC_RELEASE);
+            *retired = retire(*retired, old, func, NULL, 0);
+            ++count;
+        }
+    }
+    return count;
+}
+
+/* Put the file's grammar lines in place of those it defined before. Lines
+ * are matched in the order they appear in the action list, which has the
+ * files in reverse order, so the file's lines follow those of the nearest
+ * later file that has any. Returns the number of lines added. */
+int replace_actions(program_t *prog, program_t *unit, source_file_t *source,
+                    retired_t **retired) {
+    action_t **link = &prog->actions;
+    for (source_file_t *later = source->next; later; later = later->next) {
+        if (later->action_count > 0) {
+            action_t *last = later->first_action;
+            for (int i = 1; i < later->action_count; ++i) {
+                last = last->next;
+            }
+            link = &last->next;
+            break;
+        }
+    }
+
+    action_t *following = *link;
+    for (int i = 0; i < source->action_count; ++i) {
+        following = following->next;
+    }
+
+    action_t *first = unit->actions;
+    int count = 0;
+    if (first) {
+        action_t *last = first;
+        count = 1;
+        while (last->next) {
+            last = last->next;
+            ++count;
+        }
+        last->next = following;
+    }
+    unit->actions = NULL;
+
+    __atomic_store_n(link, first ? first : following, __ATOMIC_RELEASE);
+    if (source->action_count > 0) {
+        *retired = retire(*retired, NULL, NULL, source->first_action, source->action_count);
+    }
+    source->first_action = first;
+    source->action_count = count;
+    return count;
+}
+
+/**
+Reload one of a program's source files, replacing the definitions of the
+functions it defines and its grammar lines in every session. Objects and
+constants in the file are left as they are, so the state of each session's
+world is kept. A file may not add functions or vocabulary words.
+
+Turns that are running carry on with the definitions they started with,
+which are freed once no session can still be using them. The time taken
+depends only on the size of the file.
+
+If functions or actions is not NULL, it is set to the number of functions
+or grammar lines that were replaced, or 0 if the file was not reloaded.
+
+Returns true on success; returns false, leaving the program as it was, if
+the file is not one of the program's or cannot be reloaded.
+*/
+int reload_file(program_t *prog, const char *filename, int *functions, int *actions) {
+    int replaced_functions = 0, replaced_actions = 0;
+    source_file_t *source = prog->sources;
+    while (source && strcmp(source->name, filename) != 0) {
+        source = source->next;
+    }
+    if (!source) {
+        debug_out("reload_file: %s is not one of the game's source files\n", filename);
+        if (functions) *functions = 0;
+        if (actions) *actions = 0;
+        return FALSE;
+    }
+    program_t *unit = program_create();
+    int success = load_file(unit, filename, NULL);
+
+    struct RELOAD *reload = prog->reload;
+    pthread_mutex_lock(&reload->lock);
+    if (success && check_unit(prog, unit)) {
+        retired_t *retired = NULL;
+        replaced_functions = replace_functions(prog, unit, &retired);
+        replaced_actions = replace_actions(prog, unit, source, &retired);
+
+        /* sessions that start a turn from now on see only what was just
+         * published */
+        unsigned long epoch = __atomic_add_fetch(&reload->epoch, 1, __ATOMIC_SEQ_CST);
+        if (retired) {
+            retired_t *last = retired;
+            last->epoch = epoch;
+            while (last->next) {
+                last = last->next;
+                last->epoch = epoch;
+            }
+            last->next = reload->retired;
+            __atomic_store_n(&reload->retired, retired, __ATOMIC_RELAXED);
+        }
+        reclaim(prog);
+        TRACE(TRACE_LOADER, TRACE_INFO, "reload_file: %s: replaced %d functions and %d grammar lines\n",
+              filename, replaced_functions, replaced_actions);
+    } else {
+        debug_out("reload_file: could not reload %s\n", filename);
+        success = FALSE;
+    }
+    pthread_mutex_unlock(&reload->lock);
+
+    program_free(unit);
+    if (functions) *functions = replaced_functions;
+    if (actions) *actions = replaced_actions;
+    return success;
+}
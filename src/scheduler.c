@@ -0,0 +1,509 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parse.h"
+
+/* A command waiting to be run as a turn in a session. */
+typedef struct PENDING_TURN {
+    char *command;
+    double submit_time;
+    struct PENDING_TURN *next;
+} pending_turn_t;
+
+/* Per-session scheduling state. A session is "scheduled" from the moment it
+ * is pushed onto a worker's deque until its queue of pending turns becomes
+ * empty; while scheduled it appears on at most one deque or is being run by
+ * exactly one worker, which is what keeps a session's turns serial. */
+struct SESSION_TURNS {
+    pthread_mutex_t lock;
+    pending_turn_t *first, *last;
+    pending_turn_t *current;    /* a turn suspended part way through */
+    int scheduled;
+};
+
+/* Each worker owns a deque of sessions. Workers take from the front of their
+ * own deque and idle workers steal from the back of other workers' deques. */
+typedef struct WORKER {
+    scheduler_t *sched;
+    pthread_t thread;
+    int index;
+
+    pthread_mutex_t lock;
+    gamedata_t **deque;
+    int capacity, head, count;
+
+    unsigned long turns, steals, preemptions;
+} worker_t;
+
+struct SCHEDULER {
+    int worker_count;
+    worker_t *workers;
+    turn_callback_t callback;
+    void *user_data;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t all_idle;
+    int runnable;
+    int running;
+    int shutting_down;
+    unsigned next_worker;
+
+    double start_time;
+    unsigned long latency_buckets[SCHED_LATENCY_BUCKETS];
+    double latency_max;
+    unsigned long turns;
+};
+
+static double sched_now();
+static void deque_push(worker_t *worker, gamedata_t *gd);
+static gamedata_t *deque_pop_front(worker_t *worker);
+static gamedata_t *deque_pop_back(worker_t *worker);
+static gamedata_t *worker_find_session(worker_t *worker);
+static void *worker_main(void *data);
+static void worker_run_turn(worker_t *worker, gamedata_t *gd);
+static void sched_make_runnable(scheduler_t *sched, worker_t *worker, gamedata_t *gd);
+static double latency_percentile(scheduler_t *sched, double fraction);
+
+
+double sched_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void deque_push(worker_t *worker, gamedata_t *gd) {
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count == worker->capacity) {
+        int new_capacity = worker->capacity ? worker->capacity * 2 : 16;
+        gamedata_t **new_deque = malloc(sizeof(gamedata_t*) * new_capacity);
+        for (int i = 0; i < worker->count; ++i) {
+            new_deque[i] = worker->deque[(worker->head + i) % worker->capacity];
+        }
+        free(worker->deque);
+        worker->deque = new_deque;
+        worker->capacity = new_capacity;
+        worker->head = 0;
+    }
+    worker->deque[(worker->head + worker->count) % worker->capacity] = gd;
+    ++worker->count;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+gamedata_t *deque_pop_front(worker_t *worker) {
+    gamedata_t *gd = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count > 0) {
+        gd = worker->deque[worker->head];
+        worker->head = (worker->head + 1) % worker->capacity;
+        --worker->count;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return gd;
+}
+
+gamedata_t *deque_pop_back(worker_t *worker) {
+    gamedata_t *gd = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count > 0) {
+        --worker->count;
+        gd = worker->deque[(worker->head + worker->count) % worker->capacity];
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return gd;
+}
+
+/**
+Find a session for a worker to run, first from its own deque and then by
+stealing from the other workers.
+*/
+gamedata_t *worker_find_session(worker_t *worker) {
+    scheduler_t *sched = worker->sched;
+    gamedata_t *gd = deque_pop_front(worker);
+    if (gd) return gd;
+
+    for (int i = 1; i < sched->worker_count; ++i) {
+        worker_t *victim = &sched->workers[(worker->index + i) % sched->worker_count];
+        gd = deque_pop_back(victim);
+        if (gd) {
+            ++worker->steals;
+            return gd;
+        }
+    }
+    return NULL;
+}
+
+void sched_make_runnable(scheduler_t *sched, worker_t *worker, gamedata_t *gd) {
+    deque_push(worker, gd);
+    pthread_mutex_lock(&sched->lock);
+    ++sched->runnable;
+    pthread_cond_signal(&sched->work_ready);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void *worker_main(void *data) {
+    worker_t *worker = data;
+    scheduler_t *sched = worker->sched;
+
+    while (1) {
+        pthread_mutex_lock(&sched->lock);
+        while (sched->runnable == 0 && !sched->shutting_down) {
+            pthread_cond_wait(&sched->work_ready, &sched->lock);
+        }
+        if (sched->runnable == 0 && sched->shutting_down) {
+            pthread_mutex_unlock(&sched->lock);
+            return NULL;
+        }
+        --sched->runnable;
+        ++sched->running;
+        pthread_mutex_unlock(&sched->lock);
+
+        /* runnable counts sessions on deques, so one is guaranteed to be
+         * found, though another worker may take it first and leave us to
+         * find a different one. */
+        gamedata_t *gd = NULL;
+        while (!gd) {
+            gd = worker_find_session(worker);
+        }
+        worker_run_turn(worker, gd);
+
+        pthread_mutex_lock(&sched->lock);
+        --sched->running;
+        if (sched->running == 0 && sched->runnable == 0) {
+            pthread_cond_broadcast(&sched->all_idle);
+        }
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+/**
+Run one slice of a session's work: the rest of a suspended turn if there is
+one, otherwise the oldest pending turn. Then either reschedule the session
+on this worker (if its turn is unfinished or more turns are waiting) or mark
+it idle. An unfinished turn goes to the back of the deque, so that other
+sessions get to run before its next slice.
+*/
+void worker_run_turn(worker_t *worker, gamedata_t *gd) {
+    scheduler_t *sched = worker->sched;
+    struct SESSION_TURNS *turns = gd->turns;
+
+    pthread_mutex_lock(&turns->lock);
+    pending_turn_t *turn = turns->current;
+    int resuming = turn != NULL;
+    if (!resuming) {
+        turn = turns->first;
+        turns->first = turn->next;
+        if (!turns->first) turns->last = NULL;
+    }
+    pthread_mutex_unlock(&turns->lock);
+
+    char *output = NULL;
+    size_t length = 0;
+    FILE *old_out = gd->out;
+    if (sched->callback) {
+        gd->out = open_memstream(&output, &length);
+    }
+    int unfinished = FALSE;
+    if (resuming) {
+        unfinished = game_resume(gd);
+    } else if (!gd->quit_game) {
+        game_turn(gd, turn->command);
+        unfinished = gd->suspended_input != NULL;
+    }
+    if (sched->callback) {
+        fclose(gd->out);
+        gd->out = old_out;
+        sched->callback(gd, turn->command, output, length, sched->user_data);
+        free(output);
+    }
+
+    if (unfinished) {
+        pthread_mutex_lock(&turns->lock);
+        turns->current = turn;
+        pthread_mutex_unlock(&turns->lock);
+        ++worker->preemptions;
+        sched_make_runnable(sched, worker, gd);
+        return;
+    }
+    pthread_mutex_lock(&turns->lock);
+    turns->current = NULL;
+    pthread_mutex_unlock(&turns->lock);
+
+    double latency = sched_now() - turn->submit_time;
+    int bucket = 0;
+    double limit = 1e-6;
+    while (latency > limit && bucket < SCHED_LATENCY_BUCKETS - 1) {
+        limit *= 2;
+        ++bucket;
+    }
+    pthread_mutex_lock(&sched->lock);
+    ++sched->latency_buckets[bucket];
+    ++sched->turns;
+    if (latency > sched->latency_max) sched->latency_max = latency;
+    pthread_mutex_unlock(&sched->lock);
+    ++worker->turns;
+
+    free(turn->command);
+    free(turn);
+
+    pthread_mutex_lock(&turns->lock);
+    if (turns->first) {
+        pthread_mutex_unlock(&turns->lock);
+        sched_make_runnable(sched, worker, gd);
+    } else {
+        turns->scheduled = FALSE;
+        pthread_mutex_unlock(&turns->lock);
+    }
+}
+
+/**
+Create a scheduler that runs session turns on a pool of worker threads.
+The callback (which may be NULL) is called on the worker thread after each
+turn with the output the turn produced; a turn that is run in several
+slices is reported after each slice with that slice's output. If fewer
+threads can be started than asked for, the scheduler runs on those that
+were.
+
+Returns NULL if no worker thread could be started.
+*/
+scheduler_t *scheduler_create(int thread_count, turn_callback_t callback, void *user_data) {
+    if (thread_count < 1) thread_count = 1;
+
+    scheduler_t *sched = calloc(sizeof(scheduler_t), 1);
+    sched->worker_count = thread_count;
+    sched->callback = callback;
+    sched->user_data = user_data;
+    sched->start_time = sched_now();
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work_ready, NULL);
+    pthread_cond_init(&sched->all_idle, NULL);
+
+    sched->workers = calloc(sizeof(worker_t), thread_count);
+    for (int i = 0; i < thread_count; ++i) {
+        worker_t *worker = &sched->workers[i];
+        worker->sched = sched;
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+    /* workers that start are kept at the front, so that the ones in use
+     * are always the first worker_count */
+    int started = 0;
+    for (int i = 0; i < thread_count; ++i) {
+        worker_t *worker = &sched->workers[started];
+        worker->index = started;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) == 0) {
+            ++started;
+        }
+    }
+    if (started < thread_count) {
+        debug_out("scheduler_create: started %d of %d worker threads\n", started, thread_count);
+        for (int i = started; i < thread_count; ++i) {
+            pthread_mutex_destroy(&sched->workers[i].lock);
+        }
+        pthread_mutex_lock(&sched->lock);
+        sched->worker_count = started;
+        pthread_mutex_unlock(&sched->lock);
+    }
+    if (started == 0) {
+        pthread_mutex_destroy(&sched->lock);
+        pthread_cond_destroy(&sched->work_ready);
+        pthread_cond_destroy(&sched->all_idle);
+        free(sched->workers);
+        free(sched);
+        return NULL;
+    }
+    return sched;
+}
+
+/**
+Stop all worker threads and free the scheduler. Pending turns are run
+before the workers exit. Sessions are not freed, but their scheduling
+state is, so sessions must not be submitted to again.
+*/
+void scheduler_free(scheduler_t *sched) {
+    scheduler_wait_idle(sched);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->shutting_down = TRUE;
+    pthread_cond_broadcast(&sched->work_ready);
+    pthread_mutex_unlock(&sched->lock);
+
+    for (int i = 0; i < sched->worker_count; ++i) {
+        pthread_join(sched->workers[i].thread, NULL);
+        pthread_mutex_destroy(&sched->workers[i].lock);
+        free(sched->workers[i].deque);
+    }
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->work_ready);
+    pthread_cond_destroy(&sched->all_idle);
+    free(sched->workers);
+    free(sched);
+}
+
+/**
+Queue a command to be run as a turn in a session. Turns for the same
+session are run one at a time in the order they were submitted; turns for
+different sessions run in parallel.
+*/
+void scheduler_submit(scheduler_t *sched, gamedata_t *gd, const char *command) {
+    if (!gd->turns) {
+        gd->turns = calloc(sizeof(struct SESSION_TURNS), 1);
+        pthread_mutex_init(&gd->turns->lock, NULL);
+        gd->budget.slice_steps = script_slice_steps;
+    }
+
+    pending_turn_t *turn = calloc(sizeof(pending_turn_t), 1);
+    turn->command = str_dupl(command);
+    turn->submit_time = sched_now();
+
+    struct SESSION_TURNS *turns = gd->turns;
+    pthread_mutex_lock(&turns->lock);
+    if (turns->last) {
+        turns->last->next = turn;
+    } else {
+        turns->first = turn;
+    }
+    turns->last = turn;
+    int start = !turns->scheduled;
+    turns->scheduled = TRUE;
+    pthread_mutex_unlock(&turns->lock);
+
+    if (start) {
+        pthread_mutex_lock(&sched->lock);
+        worker_t *worker = &sched->workers[sched->next_worker++ % sched->worker_count];
+        pthread_mutex_unlock(&sched->lock);
+        sched_make_runnable(sched, worker, gd);
+    }
+}
+
+/**
+Block until every submitted turn has been run.
+*/
+void scheduler_wait_idle(scheduler_t *sched) {
+    pthread_mutex_lock(&sched->lock);
+    while (sched->runnable > 0 || sched->running > 0) {
+        pthread_cond_wait(&sched->all_idle, &sched->lock);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/**
+Release the scheduling state attached to a session. The session must not
+have any turns pending.
+*/
+void scheduler_session_release(gamedata_t *gd) {
+    if (!gd->turns) return;
+    pthread_mutex_destroy(&gd->turns->lock);
+    free(gd->turns);
+    gd->turns = NULL;
+}
+
+double latency_percentile(scheduler_t *sched, double fraction) {
+    unsigned long target = (unsigned long)(sched->turns * fraction);
+    unsigned long seen = 0;
+    double limit = 1e-6;
+    for (int i = 0; i < SCHED_LATENCY_BUCKETS; ++i) {
+        seen += sched->latency_buckets[i];
+        if (seen > target) {
+            return limit;
+        }
+        limit *= 2;
+    }
+    return sched->latency_max;
+}
+
+/**
+Report throughput and latency figures for all turns run so far. Latency is
+measured from submission to the end of the turn and percentiles are
+accurate to a power of two.
+*/
+void scheduler_stats(scheduler_t *sched, sched_stats_t *stats) {
+    memset(stats, 0, sizeof(sched_stats_t));
+    pthread_mutex_lock(&sched->lock);
+    stats->threads = sched->worker_count;
+    stats->turns = sched->turns;
+    stats->elapsed = sched_now() - sched->start_time;
+    stats->turns_per_sec = stats->elapsed > 0 ? stats->turns / stats->elapsed : 0;
+    stats->latency_p50 = latency_percentile(sched, 0.50);
+    stats->latency_p99 = latency_percentile(sched, 0.99);
+    stats->latency_max = sched->latency_max;
+    pthread_mutex_unlock(&sched->lock);
+
+    for (int i = 0; i < sched->worker_count; ++i) {
+        stats->steals += sched->workers[i].steals;
+        stats->preemptions += sched->workers[i].preemptions;
+    }
+}
+
+/**
+Drive a scheduler from a file of commands: the commands are dealt round
+robin to session_count sessions and run on thread_count threads, then
+throughput and latency are reported.
+
+Returns false if the file could not be read, no session could be created
+or the scheduler could not be started; returns true otherwise.
+*/
+int scheduler_run_file(program_t *prog, const char *filename, int session_count, int thread_count) {
+    char *buffer = read_file(filename);
+    if (!buffer) {
+        fprintf(stderr, "Could not read command file '%s'.\n", filename);
+        return FALSE;
+    }
+    if (session_count < 1) session_count = 1;
+
+    gamedata_t **sessions = calloc(sizeof(gamedata_t*), session_count);
+    FILE *null_out = fopen("/dev/null", "w");
+    for (int i = 0; i < session_count; ++i) {
+        sessions[i] = session_create(prog);
+        if (!sessions[i]) {
+            for (int j = 0; j < i; ++j) session_free(sessions[j]);
+            free(sessions);
+            free(buffer);
+            fclose(null_out);
+            return FALSE;
+        }
+        sessions[i]->out = null_out;
+    }
+
+    scheduler_t *sched = scheduler_create(thread_count, NULL, NULL);
+    if (!sched) {
+        fprintf(stderr, "Could not start the scheduler.\n");
+        for (int i = 0; i < session_count; ++i) session_free(sessions[i]);
+        free(sessions);
+        free(buffer);
+        fclose(null_out);
+        return FALSE;
+    }
+    int next_session = 0;
+    char *line = strtok(buffer, "\n");
+    while (line) {
+        scheduler_submit(sched, sessions[next_session], line);
+        next_session = (next_session + 1) % session_count;
+        line = strtok(NULL, "\n");
+    }
+    scheduler_wait_idle(sched);
+
+    sched_stats_t stats;
+    scheduler_stats(sched, &stats);
+    printf("sched: %lu turns on %d sessions, %d threads in %.3f s (%.0f turns/sec, %lu steals)\n",
+           stats.turns, session_count, stats.threads, stats.elapsed, stats.turns_per_sec, stats.steals);
+    if (stats.preemptions) {
+        printf("sched: %lu turns preempted at the end of a slice\n", stats.preemptions);
+    }
+    printf("sched: latency p50 <= %.1f us, p99 <= %.1f us, max %.1f us\n",
+           stats.latency_p50 * 1e6, stats.latency_p99 * 1e6, stats.latency_max * 1e6);
+    scheduler_free(sched);
+
+    for (int i = 0; i < session_count; ++i) {
+        scheduler_session_release(sessions[i]);
+        session_free(sessions[i]);
+    }
+    fclose(null_out);
+    free(sessions);
+    free(buffer);
+    return TRUE;
+}
@@ -13,15 +13,15 @@ void dumpobj_sub(gamedata_t *gd, input_t *input);
  * Utility methods
  * ****************************************************************************/
 void object_name_print(gamedata_t *gd, object_t *obj) {
-    int prop_isproper = property_number(gd, "#is-proper");
-    int prop_name = property_number(gd, "#name");
+    int prop_isproper = property_number(gd->program, "#is-proper");
+    int prop_name = property_number(gd->program, "#name");
 
     if (!object_property_is_true(obj, prop_isproper, 0)) {
-        int prop_article = property_number(gd, "#article");
+        int prop_article = property_number(gd->program, "#article");
         property_t *article = object_property_get(obj, prop_article);
         if (article) {
-            text_out("%s", (char*)article->value.d.ptr);
-            putchar(' ');
+            gd_text_out(gd, "%s", (char*)article->value.d.ptr);
+            gd_text_out(gd, " ");
         } else {
             property_t *name = object_property_get(obj, prop_name);
             int first_letter = 0;
@@ -30,21 +30,21 @@ void object_name_print(gamedata_t *gd, object_t *obj) {
             }
 
             if (first_letter == 'a' || first_letter == 'u' || first_letter == 'i' || first_letter == 'e' || first_letter == 'o') {
-                text_out("an ");
+                gd_text_out(gd, "an ");
             } else {
-                text_out("a ");
+                gd_text_out(gd, "a ");
             }
         }
     }
-    object_property_print(obj, prop_name);
+    object_property_print(gd, obj, prop_name);
 }
 
-void object_property_print(object_t *obj, int prop_num) {
+void object_property_print(gamedata_t *gd, object_t *obj, int prop_num) {
     property_t *prop = object_property_get(obj, prop_num);
     if (prop) {
-        text_out("%s", (char*)prop->value.d.ptr);
+        gd_text_out(gd, "%s", (char*)prop->value.d.ptr);
     } else {
-        text_out("(obj#%d)", obj->id);
+        gd_text_out(gd, "(obj#%d)", obj->id);
     }
 }
 
@@ -52,7 +52,7 @@ void print_location(gamedata_t *gd, object_t *location) {
     symbol_t *func_sym = symbol_get(gd->symbols, "print-location");
     if (!func_sym) return;
     function_t *func = func_sym->d.ptr;
-    list_run_function_noargs(gd, func);
+    value_free(list_run_function_noargs(gd, func));
 }
 
 
@@ -61,19 +61,18 @@ void print_location(gamedata_t *gd, object_t *location) {
  * ****************************************************************************/
 int dispatch_action(gamedata_t *gd, input_t *input) {
     function_t *func = input->action_func;
-    list_t *args = list_create();
+    svalue_t args[PARSE_MAX_NOUNS];
 
     for (int i = 0; i < PARSE_MAX_NOUNS; ++i) {
         if (input->nouns[i]) {
-        list_t *noun = list_create();
-        noun->type = T_OBJECT_REF;
-            noun->ptr = input->nouns[i]->object;
-        list_add(args, noun);
-    } else {
-            list_add(args, list_create_false());
+            args[i] = value_object(input->nouns[i]->object);
+        } else {
+            args[i] = value_false();
         }
     }
-    list_run_function(gd, func, args);
-    list_free(args);
+    /* the action may be suspended to let other sessions run */
+    gd->budget.can_suspend = TRUE;
+    value_free(list_run_function(gd, func, PARSE_MAX_NOUNS, args));
+    gd->budget.can_suspend = FALSE;
     return 1;
 }
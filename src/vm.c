@@ -0,0 +1,967 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+
+/* Script functions are compiled into a flat array of ints. Each instruction
+ * is an opcode followed by its operands (see op_info below). Values on
+ * the VM stack and in local slots are owned script values, exactly as the
+ * tree walker would have produced them, so builtins run unchanged. */
+
+#define OP_CONST      0     /* a: constant; push a copy */
+#define OP_OBJECT     1     /* a: object id; push the session's object */
+#define OP_LOAD       2     /* a: slot; push a copy of the slot */
+#define OP_LOAD_OR    3     /* a: slot, b: target; push the slot and jump if set */
+#define OP_STORE      4     /* a: slot; pop into slot and push true */
+#define OP_UNDEFINED  5     /* a: constant holding name; report and push false */
+#define OP_POP        6
+#define OP_JUMP       7     /* a: target */
+#define OP_JUMP_FALSE 8     /* a: target; pops the condition */
+#define OP_CALL       9     /* a: function, b: argument count */
+#define OP_BUILTIN    10    /* a: builtin, b: argument count */
+#define OP_RETURN     11
+#define OP_TAIL_CALL  12    /* a: function, b: argument count; replaces the frame */
+#define OP_PROP       13    /* a: builtin, b: cache site; a two argument property read */
+#define OP_ARITH      14    /* a: builtin, b: ARITH_* operator; a two argument arithmetic builtin */
+
+/* type of a local slot that has not been set */
+#define VM_UNSET -1
+
+static const struct {
+    const char *name;
+    int operands;
+} op_info[] = {
+    { "const",      1 },
+    { "object",     1 },
+    { "load",       1 },
+    { "load-or",    2 },
+    { "store",      1 },
+    { "undefined",  1 },
+    { "pop",        0 },
+    { "jump",       1 },
+    { "jump-false", 1 },
+    { "call",       2 },
+    { "builtin",    2 },
+    { "return",     0 },
+    { "tail-call",  2 },
+    { "prop",       2 },
+    { "arith",      2 },
+};
+
+typedef struct BYTECODE {
+    int *code;
+    int length, capacity;
+
+    svalue_t *constants;
+    unsigned char *constant_owned;
+    int constant_count, constant_capacity;
+    function_t **functions;
+    int function_count, function_capacity;
+
+    int param_count;
+    int *param_slots;
+    int arg_slot_count;
+    int slot_count;
+    int max_stack;
+    int site_limit;     /* one more than the highest property cache site used */
+} bytecode_t;
+
+/* A running call. func is the definition being run, as found by
+ * function_current when the call was made; a reload does not affect it. */
+typedef struct VM_FRAME {
+    function_t *func;
+    int pc;
+    int base;   /* index of the frame's first local slot in the value stack */
+    int sp;     /* index of the frame's stack top when it is not running */
+} vm_frame_t;
+
+/* A session's script call stack. Each frame's local slots are followed by
+ * its operand stack in the shared value array. */
+typedef struct VM_STACK {
+    svalue_t *values;
+    int value_capacity;
+    vm_frame_t *frames;
+    int frame_count, frame_capacity;
+    prop_cache_t *prop_caches;  /* one per property read call site */
+    int prop_cache_count;
+} vm_stack_t;
+
+typedef struct COMPILER {
+    program_t *prog;
+    function_t *func;
+    bytecode_t *bc;
+    const char **slot_names;
+    int slot_capacity;
+    int depth;
+    int failed;
+} compiler_t;
+
+int script_engine = ENGINE_VM;
+
+static int slot_find(compiler_t *cc, const char *name);
+static int slot_add(compiler_t *cc, const char *name);
+static void collect_set_names(compiler_t *cc, list_t *list);
+static int emit(compiler_t *cc, int op, int a, int b);
+static void emit_patch(compiler_t *cc, int at, int target);
+static int add_constant(compiler_t *cc, svalue_t value);
+static int add_function(compiler_t *cc, function_t *func);
+static void stack_change(compiler_t *cc, int amount);
+static void compile_fail(compiler_t *cc, const char *reason, const char *detail);
+static void compile_expr(compiler_t *cc, list_t *expr, int tail);
+static void compile_global(compiler_t *cc, const char *name);
+static void compile_call(compiler_t *cc, list_t *list, int tail);
+static void vm_reserve(vm_stack_t *vm, int base, function_t *func);
+static void vm_reserve_sites(vm_stack_t *vm, bytecode_t *bc);
+static vm_frame_t *vm_push_frame(vm_stack_t *vm, function_t *func, int base,
+                                 svalue_t *args, int arg_count);
+static void vm_bind_args(vm_stack_t *vm, vm_frame_t *frame, svalue_t *args, int arg_count);
+static void vm_clear_frame(vm_stack_t *vm, vm_frame_t *frame, int sp);
+static void vm_unwind(gamedata_t *gd, vm_stack_t *vm, int entry, int sp);
+static svalue_t vm_execute(gamedata_t *gd, vm_stack_t *vm, int entry, int suspendable);
+
+
+/* ****************************************************************************
+ * Compiler
+ * ****************************************************************************/
+
+int slot_find(compiler_t *cc, const char *name) {
+    for (int i = 0; i < cc->bc->slot_count; ++i) {
+        if (strcmp(cc->slot_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int slot_add(compiler_t *cc, const char *name) {
+    int slot = slot_find(cc, name);
+    if (slot >= 0) {
+        return slot;
+    }
+    if (cc->bc->slot_count >= cc->slot_capacity) {
+        cc->slot_capacity = cc->slot_capacity ? cc->slot_capacity * 2 : 8;
+        cc->slot_names = realloc(cc->slot_names, sizeof(const char*) * cc->slot_capacity);
+    }
+    cc->slot_names[cc->bc->slot_count] = name;
+    return cc->bc->slot_count++;
+}
+
+/* Locals created with set are given slots up front so that every reference
+ * to them compiles to a slot access. A reference made before the local has
+ * been set falls back to the global of the same name, as it would when the
+ * tree walker finds nothing in the local symbol table. */
+void collect_set_names(compiler_t *cc, list_t *list) {
+    if (!list || list->type != T_LIST) {
+        return;
+    }
+    list_t *head = list->child;
+    if (head && head->type == T_ATOM && strcmp(head->text, "set") == 0
+            && head->next && head->next->type == T_STRING) {
+        slot_add(cc, head->next->text);
+    }
+    for (list_t *iter = list->child; iter; iter = iter->next) {
+        collect_set_names(cc, iter);
+    }
+}
+
+int emit(compiler_t *cc, int op, int a, int b) {
+    bytecode_t *bc = cc->bc;
+    if (bc->length + 3 > bc->capacity) {
+        bc->capacity = bc->capacity ? bc->capacity * 2 : 32;
+        bc->code = realloc(bc->code, sizeof(int) * bc->capacity);
+    }
+    int at = bc->length;
+    bc->code[bc->length++] = op;
+    if (op_info[op].operands > 0) bc->code[bc->length++] = a;
+    if (op_info[op].operands > 1) bc->code[bc->length++] = b;
+    return at;
+}
+
+/* Point the jump target of the instruction at 'at' to 'target'. */
+void emit_patch(compiler_t *cc, int at, int target) {
+    int op = cc->bc->code[at];
+    cc->bc->code[at + op_info[op].operands] = target;
+}
+
+/* Constants are shared by every session running the program, possibly on
+ * several threads at once, so the bytecode owns them outright and the VM
+ * only ever borrows them: a constant never has its reference count touched. */
+int add_constant(compiler_t *cc, svalue_t value) {
+    bytecode_t *bc = cc->bc;
+    if (bc->constant_count >= bc->constant_capacity) {
+        bc->constant_capacity = bc->constant_capacity ? bc->constant_capacity * 2 : 8;
+        bc->constants = realloc(bc->constants, sizeof(svalue_t) * bc->constant_capacity);
+        bc->constant_owned = realloc(bc->constant_owned, bc->constant_capacity);
+    }
+    bc->constant_owned[bc->constant_count] = FALSE;
+    if (value_is_heap(value) && value.d.list->refs > 0) {
+        value.d.list->refs = 0;
+        bc->constant_owned[bc->constant_count] = TRUE;
+    }
+    bc->constants[bc->constant_count] = value;
+    return bc->constant_count++;
+}
+
+int add_function(compiler_t *cc, function_t *func) {
+    bytecode_t *bc = cc->bc;
+    for (int i = 0; i < bc->function_count; ++i) {
+        if (bc->functions[i] == func) {
+            return i;
+        }
+    }
+    if (bc->function_count >= bc->function_capacity) {
+        bc->function_capacity = bc->function_capacity ? bc->function_capacity * 2 : 4;
+        bc->functions = realloc(bc->functions, sizeof(function_t*) * bc->function_capacity);
+    }
+    bc->functions[bc->function_count] = func;
+    return bc->function_count++;
+}
+
+void stack_change(compiler_t *cc, int amount) {
+    cc->depth += amount;
+    if (cc->depth > cc->bc->max_stack) {
+        cc->bc->max_stack = cc->depth;
+    }
+}
+
+void compile_fail(compiler_t *cc, const char *reason, const char *detail) {
+    if (!cc->failed) {
+        TRACE(TRACE_LOADER, TRACE_INFO, "vm_compile: %s left to the tree walker (%s%s%s)\n",
+              cc->func->name, reason, detail ? " " : "", detail ? detail : "");
+    }
+    cc->failed = TRUE;
+}
+
+/* An expression is in tail position when its value becomes the function's
+ * result with nothing left to do afterwards: the body itself, either branch
+ * of an if in tail position, or the last form of a proc in tail position. */
+void compile_expr(compiler_t *cc, list_t *expr, int tail) {
+    int slot;
+    switch(expr->type) {
+        case T_STRING:
+        case T_INTEGER:
+        case T_VOCAB:
+            emit(cc, OP_CONST, add_constant(cc, value_from_list(expr)), 0);
+            stack_change(cc, 1);
+            break;
+        case T_ATOM:
+            slot = slot_find(cc, expr->text);
+            if (slot >= 0 && slot < cc->bc->arg_slot_count) {
+                emit(cc, OP_LOAD, slot, 0);
+                stack_change(cc, 1);
+            } else if (slot >= 0) {
+                int jump = emit(cc, OP_LOAD_OR, slot, 0);
+                compile_global(cc, expr->text);
+                emit_patch(cc, jump, cc->bc->length);
+            } else {
+                compile_global(cc, expr->text);
+            }
+            break;
+        case T_LIST:
+            compile_call(cc, expr, tail);
+            break;
+        default:
+            compile_fail(cc, "unsupported value type", NULL);
+    }
+}
+
+/* The program's symbol table does not change once loading is complete, so
+ * globals can be resolved at compile time. */
+void compile_global(compiler_t *cc, const char *name) {
+    symbol_t *symbol = symbol_get(cc->prog->symbols, name);
+    stack_change(cc, 1);
+    if (!symbol) {
+        emit(cc, OP_UNDEFINED, add_constant(cc, value_string(name)), 0);
+        return;
+    }
+    switch(symbol->type) {
+        case SYM_LIST:
+            emit(cc, OP_CONST, add_constant(cc, value_from_list(symbol->d.ptr)), 0);
+            break;
+        case SYM_OBJECT:
+            emit(cc, OP_OBJECT, ((object_t*)symbol->d.ptr)->id, 0);
+            break;
+        case SYM_FUNCTION:
+            emit(cc, OP_CONST, add_constant(cc, value_function(symbol->d.ptr)), 0);
+            break;
+        case SYM_PROPERTY:
+        case SYM_CONSTANT:
+            emit(cc, OP_CONST, add_constant(cc, value_int(symbol->d.value)), 0);
+            break;
+        default:
+            compile_fail(cc, "unhandled symbol type for", name);
+    }
+}
+
+void compile_call(compiler_t *cc, list_t *list, int tail) {
+    if (!list->child) {
+        emit(cc, OP_CONST, add_constant(cc, value_list(list_create())), 0);
+        stack_change(cc, 1);
+        return;
+    }
+    if (list->child->type != T_ATOM) {
+        compile_fail(cc, "list does not start with atom", NULL);
+        return;
+    }
+    const char *name = list->child->text;
+    list_t *args = list->child->next;
+    int arg_count = 0;
+    for (list_t *iter = args; iter; iter = iter->next) {
+        ++arg_count;
+    }
+
+    symbol_t *user_func = symbol_get(cc->prog->symbols, name);
+    if (user_func) {
+        if (user_func->type != SYM_FUNCTION) {
+            compile_fail(cc, "call to non-function", name);
+            return;
+        }
+        for (list_t *iter = args; iter; iter = iter->next) {
+            compile_expr(cc, iter, FALSE);
+        }
+        emit(cc, tail ? OP_TAIL_CALL : OP_CALL, add_function(cc, user_func->d.ptr), arg_count);
+        stack_change(cc, 1 - arg_count);
+        return;
+    }
+
+    int builtin = builtin_lookup(name);
+    if (builtin < 0) {
+        compile_fail(cc, "call to unknown function", name);
+        return;
+    }
+
+    if (strcmp(name, "if") == 0) {
+        if (!args) {
+            compile_fail(cc, "if without condition", NULL);
+            return;
+        }
+        compile_expr(cc, args, FALSE);
+        int to_else = emit(cc, OP_JUMP_FALSE, 0, 0);
+        stack_change(cc, -1);
+        if (args->next) {
+            compile_expr(cc, args->next, tail);
+        } else {
+            emit(cc, OP_CONST, add_constant(cc, value_true()), 0);
+            stack_change(cc, 1);
+        }
+        int to_end = emit(cc, OP_JUMP, 0, 0);
+        stack_change(cc, -1);
+        emit_patch(cc, to_else, cc->bc->length);
+        if (args->next && args->next->next) {
+            compile_expr(cc, args->next->next, tail);
+        } else {
+            emit(cc, OP_CONST, add_constant(cc, value_false()), 0);
+            stack_change(cc, 1);
+        }
+        emit_patch(cc, to_end, cc->bc->length);
+    } else if (strcmp(name, "quote") == 0) {
+        if (arg_count > 1) {
+            compile_fail(cc, "quote with extra arguments", NULL);
+            return;
+        }
+        emit(cc, OP_CONST, add_constant(cc, args ? value_from_list(args) : value_list(list_create())), 0);
+        stack_change(cc, 1);
+    } else if (strcmp(name, "proc") == 0 && args) {
+        for (list_t *iter = args; iter; iter = iter->next) {
+            compile_expr(cc, iter, tail && !iter->next);
+            if (iter->next) {
+                emit(cc, OP_POP, 0, 0);
+                stack_change(cc, -1);
+            }
+        }
+    } else if (strcmp(name, "set") == 0) {
+        if (!args || args->type != T_STRING || !args->next) {
+            compile_fail(cc, "set without literal name and value", NULL);
+            return;
+        }
+        compile_expr(cc, args->next, FALSE);
+        for (list_t *iter = args->next->next; iter; iter = iter->next) {
+            compile_expr(cc, iter, FALSE);
+            emit(cc, OP_POP, 0, 0);
+            stack_change(cc, -1);
+        }
+        emit(cc, OP_STORE, slot_find(cc, args->text), 0);
+    } else if (!builtin_evaluates_args(builtin)) {
+        compile_fail(cc, "builtin takes unevaluated arguments", name);
+    } else {
+        for (list_t *iter = args; iter; iter = iter->next) {
+            compile_expr(cc, iter, FALSE);
+        }
+        if (arg_count == 2 && (strcmp(name, "prop-get") == 0 || strcmp(name, "prop-has") == 0
+                               || strcmp(name, "prop-true") == 0)) {
+            emit(cc, OP_PROP, builtin, cc->prog->prop_cache_count++);
+            cc->bc->site_limit = cc->prog->prop_cache_count;
+        } else if (arg_count == 2 && arith_lookup(name) >= 0) {
+            emit(cc, OP_ARITH, builtin, arith_lookup(name));
+        } else {
+            emit(cc, OP_BUILTIN, builtin, arg_count);
+        }
+        stack_change(cc, 1 - arg_count);
+    }
+}
+
+/**
+Compile a script function to bytecode. Functions using constructs the
+compiler does not handle are left without code and continue to run in the
+tree walker.
+
+Returns true if the function was compiled; returns false otherwise.
+*/
+int vm_compile(program_t *prog, function_t *func) {
+    compiler_t cc;
+    memset(&cc, 0, sizeof(compiler_t));
+    cc.prog = prog;
+    cc.func = func;
+    cc.bc = calloc(sizeof(bytecode_t), 1);
+
+    for (list_t *arg = func->arg_list->child; arg; arg = arg->next) {
+        ++cc.bc->param_count;
+    }
+    cc.bc->param_slots = calloc(sizeof(int), cc.bc->param_count + 1);
+    int counter = 0;
+    for (list_t *arg = func->arg_list->child; arg; arg = arg->next) {
+        cc.bc->param_slots[counter++] = slot_add(&cc, arg->text);
+    }
+    /* parameters are always bound, so they occupy the first slots */
+    cc.bc->arg_slot_count = cc.bc->slot_count;
+    collect_set_names(&cc, func->body);
+
+    if (func->body && func->body->type == T_LIST) {
+        compile_expr(&cc, func->body, TRUE);
+    } else {
+        compile_fail(&cc, "body is not a list", NULL);
+    }
+    emit(&cc, OP_RETURN, 0, 0);
+
+    free(cc.slot_names);
+    if (cc.failed) {
+        vm_free(cc.bc);
+        return FALSE;
+    }
+    func->code = cc.bc;
+    return TRUE;
+}
+
+/**
+Compile every function in a program that has not already been compiled.
+
+Returns the number of functions that have code. If function_count is not
+NULL, it receives the total number of functions.
+*/
+int vm_compile_program(program_t *prog, int *function_count) {
+    int compiled = 0, total = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = prog->symbols->buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type != SYM_FUNCTION) {
+                continue;
+            }
+            function_t *func = symbol->d.ptr;
+            ++total;
+            if (func->code || vm_compile(prog, func)) {
+                ++compiled;
+            }
+        }
+    }
+    if (function_count) {
+        *function_count = total;
+    }
+    return compiled;
+}
+
+void vm_free(bytecode_t *code) {
+    if (!code) return;
+    for (int i = 0; i < code->constant_count; ++i) {
+        if (code->constant_owned[i]) {
+            list_free(code->constants[i].d.list);
+        }
+    }
+    free(code->constants);
+    free(code->constant_owned);
+    free(code->functions);
+    free(code->param_slots);
+    free(code->code);
+    free(code);
+}
+
+/**
+Write a readable listing of a function's bytecode.
+*/
+void vm_dump(FILE *dest, function_t *func) {
+    bytecode_t *bc = function_current(func)->code;
+    if (!bc) {
+        fprintf(dest, "%s: not compiled\n", func->name);
+        return;
+    }
+    fprintf(dest, "%s: %d slots, stack %d, %d constants\n", func->name,
+            bc->slot_count, bc->max_stack, bc->constant_count);
+    int pc = 0;
+    while (pc < bc->length) {
+        int op = bc->code[pc];
+        fprintf(dest, "%5d  %-10s", pc, op_info[op].name);
+        if (op == OP_CONST) {
+            fprintf(dest, " ");
+            dump_value(dest, bc->constants[bc->code[pc + 1]]);
+        } else if (op == OP_CALL || op == OP_TAIL_CALL) {
+            fprintf(dest, " %s/%d", bc->functions[bc->code[pc + 1]]->name, bc->code[pc + 2]);
+        } else if (op == OP_BUILTIN) {
+            fprintf(dest, " %s/%d", builtin_name(bc->code[pc + 1]), bc->code[pc + 2]);
+        } else if (op == OP_PROP) {
+            fprintf(dest, " %s site %d", builtin_name(bc->code[pc + 1]), bc->code[pc + 2]);
+        } else if (op == OP_ARITH) {
+            fprintf(dest, " %s", builtin_name(bc->code[pc + 1]));
+        } else {
+            for (int i = 1; i <= op_info[op].operands; ++i) {
+                fprintf(dest, " %d", bc->code[pc + i]);
+            }
+        }
+        fprintf(dest, "\n");
+        pc += 1 + op_info[op].operands;
+    }
+}
+
+
+/* ****************************************************************************
+ * Interpreter
+ * ****************************************************************************/
+
+/* Make sure the value stack has room for a frame of the given function
+ * starting at base. The value array may move, so callers must reload any
+ * pointers into it afterwards. */
+void vm_reserve(vm_stack_t *vm, int base, function_t *func) {
+    int needed = base + func->code->slot_count + func->code->max_stack + 1;
+    if (needed > vm->value_capacity) {
+        while (needed > vm->value_capacity) {
+            vm->value_capacity = vm->value_capacity ? vm->value_capacity * 2 : 256;
+        }
+        vm->values = realloc(vm->values, sizeof(svalue_t) * vm->value_capacity);
+    }
+}
+
+/* Make sure the session has a property cache for every site a function
+ * uses. Functions compiled by a reload use new sites, so this is checked
+ * whenever a call is made rather than once per run. */
+void vm_reserve_sites(vm_stack_t *vm, bytecode_t *bc) {
+    if (vm->prop_cache_count < bc->site_limit) {
+        vm->prop_caches = realloc(vm->prop_caches, sizeof(prop_cache_t) * bc->site_limit);
+        memset(&vm->prop_caches[vm->prop_cache_count], 0,
+               sizeof(prop_cache_t) * (bc->site_limit - vm->prop_cache_count));
+        vm->prop_cache_count = bc->site_limit;
+    }
+}
+
+/* Push a frame for a compiled function at base, binding its parameters
+ * from args (which the new frame takes ownership of). */
+vm_frame_t *vm_push_frame(vm_stack_t *vm, function_t *func, int base,
+                          svalue_t *args, int arg_count) {
+    if (vm->frame_count >= vm->frame_capacity) {
+        vm->frame_capacity = vm->frame_capacity ? vm->frame_capacity * 2 : 64;
+        vm->frames = realloc(vm->frames, sizeof(vm_frame_t) * vm->frame_capacity);
+    }
+    vm_frame_t *frame = &vm->frames[vm->frame_count++];
+    frame->func = func;
+    frame->pc = 0;
+    frame->base = base;
+    vm_bind_args(vm, frame, args, arg_count);
+    return frame;
+}
+
+/* (Re)initialise a frame's slots for frame->func and bind its arguments. */
+void vm_bind_args(vm_stack_t *vm, vm_frame_t *frame, svalue_t *args, int arg_count) {
+    bytecode_t *bc = frame->func->code;
+    vm_reserve(vm, frame->base, frame->func);
+    svalue_t *slots = &vm->values[frame->base];
+    for (int i = 0; i < bc->slot_count; ++i) {
+        slots[i].type = VM_UNSET;
+    }
+    for (int i = 0; i < bc->param_count; ++i) {
+        int slot = bc->param_slots[i];
+        if (slots[slot].type != VM_UNSET) value_free(slots[slot]);
+        slots[slot] = i < arg_count ? args[i] : value_false();
+    }
+    for (int i = bc->param_count; i < arg_count; ++i) {
+        value_free(args[i]);
+    }
+    frame->sp = frame->base + bc->slot_count;
+}
+
+/* Release everything a frame holds between its base and sp. */
+void vm_clear_frame(vm_stack_t *vm, vm_frame_t *frame, int sp) {
+    svalue_t *values = vm->values;
+    for (int i = frame->base; i < sp; ++i) {
+        if (values[i].type != VM_UNSET) value_free(values[i]);
+    }
+}
+
+void vm_stack_free(gamedata_t *gd) {
+    if (!gd->vm) return;
+    /* frames are left behind by a suspended run */
+    while (gd->vm->frame_count > 0) {
+        vm_frame_t *frame = &gd->vm->frames[--gd->vm->frame_count];
+        vm_clear_frame(gd->vm, frame, frame->sp);
+    }
+    free(gd->vm->values);
+    free(gd->vm->frames);
+    free(gd->vm->prop_caches);
+    free(gd->vm);
+    gd->vm = NULL;
+}
+
+/**
+Run a compiled function. The arguments belong to the caller.
+
+Script calls made by the function run on the session's frame stack rather
+than the C stack, and calls in tail position reuse the caller's frame, so
+recursion depth is limited only by memory. This may be called again while
+a function is already running (for example by a builtin that calls back
+into a script); the new frames go on top of the existing ones. The function
+must be a definition found by function_current.
+*/
+svalue_t vm_run_function(gamedata_t *gd, function_t *func, int argc, svalue_t *argv) {
+    if (!gd->vm) {
+        gd->vm = calloc(sizeof(vm_stack_t), 1);
+    }
+    vm_stack_t *vm = gd->vm;
+    vm_reserve_sites(vm, func->code);
+    int entry = vm->frame_count;
+    int base = entry > 0 ? vm->frames[entry - 1].sp : 0;
+    int suspendable = gd->budget.can_suspend && entry == 0;
+    gd->budget.can_suspend = FALSE;
+
+    svalue_t args[argc + 1];
+    for (int i = 0; i < argc; ++i) {
+        args[i] = value_copy(argv[i]);
+    }
+    vm_push_frame(vm, func, base, args, argc);
+    if (gd->profiling) {
+        profile_enter_function(gd, func);
+    }
+    return vm_execute(gd, vm, entry, suspendable);
+}
+
+/**
+Continue a run that was suspended at the end of a scheduler slice. It may
+be suspended again, in which case the session's budget says so and the
+returned value is meaningless.
+*/
+svalue_t vm_resume(gamedata_t *gd) {
+    gd->budget.suspended = FALSE;
+    return vm_execute(gd, gd->vm, 0, TRUE);
+}
+
+/* Drop the running frame, whose stack top is sp, and every frame above
+ * entry, as when a run is abandoned. */
+void vm_unwind(gamedata_t *gd, vm_stack_t *vm, int entry, int sp) {
+    vm_clear_frame(vm, &vm->frames[vm->frame_count - 1], sp);
+    if (gd->profiling) {
+        profile_exit(gd);
+    }
+    while (--vm->frame_count > entry) {
+        vm_frame_t *frame = &vm->frames[vm->frame_count - 1];
+        vm_clear_frame(vm, frame, frame->sp);
+        if (gd->profiling) {
+            profile_exit(gd);
+        }
+    }
+}
+
+/* Run frames until the frame at index entry returns. A suspendable run
+ * saves its state and returns when its scheduler slice is over. */
+svalue_t vm_execute(gamedata_t *gd, vm_stack_t *vm, int entry, int suspendable) {
+    vm_frame_t *frame = &vm->frames[vm->frame_count - 1];
+    bytecode_t *bc = frame->func->code;
+    const int *code = bc->code;
+    svalue_t *values = vm->values;
+    svalue_t *slots = &values[frame->base];
+    int pc = frame->pc, sp = frame->sp;
+    svalue_t value;
+
+    TRACE(TRACE_INTERPRETER, TRACE_DEBUG, "vm_execute: %s\n", frame->func->name);
+    while (1) {
+        if (gd->budget.countdown-- <= 0) {
+            int status = budget_check(gd, frame->func->name, suspendable);
+            if (status == BUDGET_SUSPEND) {
+                frame->pc = pc;
+                frame->sp = sp;
+                return value_false();
+            } else if (status == BUDGET_ABORT) {
+                vm_unwind(gd, vm, entry, sp);
+                return value_false();
+            }
+        }
+        switch(code[pc]) {
+            case OP_CONST:
+                values[sp++] = value_copy(bc->constants[code[pc + 1]]);
+                pc += 2;
+                break;
+            case OP_OBJECT:
+                values[sp++] = value_object(gd->objects[code[pc + 1]]);
+                pc += 2;
+                break;
+            case OP_LOAD:
+                values[sp++] = value_copy(slots[code[pc + 1]]);
+                pc += 2;
+                break;
+            case OP_LOAD_OR:
+                if (slots[code[pc + 1]].type != VM_UNSET) {
+                    values[sp++] = value_copy(slots[code[pc + 1]]);
+                    pc = code[pc + 2];
+                } else {
+                    pc += 3;
+                }
+                break;
+            case OP_STORE:
+                if (slots[code[pc + 1]].type != VM_UNSET) value_free(slots[code[pc + 1]]);
+                slots[code[pc + 1]] = values[--sp];
+                values[sp++] = value_true();
+                pc += 2;
+                break;
+            case OP_UNDEFINED:
+                gd_debug_out(gd, "list_evaluate: undefined value %s\n",
+                             bc->constants[code[pc + 1]].d.list->text);
+                values[sp++] = value_false();
+                pc += 2;
+                break;
+            case OP_POP:
+                value_free(values[--sp]);
+                pc += 1;
+                break;
+            case OP_JUMP:
+                pc = code[pc + 1];
+                break;
+            case OP_JUMP_FALSE:
+                value = values[--sp];
+                if (value_is_true(value)) {
+                    pc += 2;
+                } else {
+                    pc = code[pc + 1];
+                }
+                value_free(value);
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                function_t *callee = function_current(bc->functions[code[pc + 1]]);
+                int count = code[pc + 2];
+                svalue_t args[count + 1];
+                sp -= count;
+                memcpy(args, &values[sp], sizeof(svalue_t) * count);
+                if (!callee->code) {
+                    frame->pc = pc;
+                    frame->sp = sp;
+                    value = list_run_function(gd, callee, count, args);
+                    for (int i = 0; i < count; ++i) {
+                        value_free(args[i]);
+                    }
+                    frame = &vm->frames[vm->frame_count - 1];
+                    values = vm->values;
+                    slots = &values[frame->base];
+                    values[sp++] = value;
+                    pc += 3;
+                    break;
+                }
+                vm_reserve_sites(vm, callee->code);
+                if (gd->profiling) {
+                    /* a tail call leaves the caller as it enters the callee */
+                    if (code[pc] == OP_TAIL_CALL) {
+                        profile_exit(gd);
+                    }
+                    profile_enter_function(gd, callee);
+                }
+                if (code[pc] == OP_TAIL_CALL) {
+                    vm_clear_frame(vm, frame, sp);
+                    frame->func = callee;
+                    vm_bind_args(vm, frame, args, count);
+                } else {
+                    frame->pc = pc + 3;
+                    frame->sp = sp;
+                    frame = vm_push_frame(vm, callee, sp, args, count);
+                }
+                bc = callee->code;
+                code = bc->code;
+                values = vm->values;
+                slots = &values[frame->base];
+                pc = 0;
+                sp = frame->sp;
+                break; }
+            case OP_BUILTIN: {
+                int count = code[pc + 2];
+                svalue_t args[count + 1];
+                sp -= count;
+                memcpy(args, &values[sp], sizeof(svalue_t) * count);
+                frame->pc = pc;
+                frame->sp = sp;
+                value = builtin_call(gd, code[pc + 1], count, args);
+                for (int i = 0; i < count; ++i) {
+                    value_free(args[i]);
+                }
+                frame = &vm->frames[vm->frame_count - 1];
+                values = vm->values;
+                slots = &values[frame->base];
+                values[sp++] = value;
+                pc += 3;
+                break; }
+            case OP_PROP: {
+                /* property reads never call back into scripts, so nothing
+                 * on the stack can move */
+                svalue_t args[2];
+                sp -= 2;
+                args[0] = values[sp];
+                args[1] = values[sp + 1];
+                gd->prop_site = &vm->prop_caches[code[pc + 2]];
+                value = builtin_call(gd, code[pc + 1], 2, args);
+                gd->prop_site = NULL;
+                value_free(args[0]);
+                value_free(args[1]);
+                values[sp++] = value;
+                pc += 3;
+                break; }
+            case OP_ARITH: {
+                svalue_t args[2];
+                int result;
+                if (values[sp - 2].type == T_INTEGER && values[sp - 1].type == T_INTEGER
+                        && !gd->profiling
+                        && arith_binary(code[pc + 2], values[sp - 2].d.number,
+                                        values[sp - 1].d.number, &result)) {
+                    values[sp - 2] = value_int(result);
+                    --sp;
+                    pc += 3;
+                    break;
+                }
+                /* anything else goes through the builtin, which reports
+                 * errors; it never calls back into scripts */
+                sp -= 2;
+                args[0] = values[sp];
+                args[1] = values[sp + 1];
+                value = builtin_call(gd, code[pc + 1], 2, args);
+                value_free(args[0]);
+                value_free(args[1]);
+                values[sp++] = value;
+                pc += 3;
+                break; }
+            case OP_RETURN:
+                value = values[--sp];
+                vm_clear_frame(vm, frame, sp);
+                if (gd->profiling) {
+                    profile_exit(gd);
+                }
+                if (--vm->frame_count == entry) {
+                    return value;
+                }
+                frame = &vm->frames[vm->frame_count - 1];
+                bc = frame->func->code;
+                code = bc->code;
+                slots = &values[frame->base];
+                pc = frame->pc;
+                sp = frame->sp;
+                values[sp++] = value;
+                break;
+            default:
+                gd_debug_out(gd, "vm_execute: bad opcode %d in %s\n", code[pc], frame->func->name);
+                vm_unwind(gd, vm, entry, sp);
+                return value_false();
+        }
+    }
+}
+
+
+/* ****************************************************************************
+ * Differential check against the tree walker
+ * ****************************************************************************/
+
+typedef struct CHECK_SESSION {
+    gamedata_t *gd;
+    char *output, *log;
+    size_t output_length, log_length;
+} check_session_t;
+
+/* Compare two outputs, treating any pair of pointers ("0x" followed by hex
+ * digits) as equal since the two sessions allocate their objects apart. */
+static int check_same(const char *a, const char *b) {
+    while (*a && *b) {
+        if (a[0] == '0' && a[1] == 'x' && b[0] == '0' && b[1] == 'x') {
+            a += 2;
+            b += 2;
+            while (isxdigit((unsigned char)*a)) ++a;
+            while (isxdigit((unsigned char)*b)) ++b;
+            continue;
+        }
+        if (*a != *b) {
+            return FALSE;
+        }
+        ++a;
+        ++b;
+    }
+    return *a == *b;
+}
+
+static void check_turn(check_session_t *session, int engine, const char *command) {
+    gamedata_t *gd = session->gd;
+    script_engine = engine;
+    gd->out = open_memstream(&session->output, &session->output_length);
+    gd->log = open_memstream(&session->log, &session->log_length);
+    game_turn(gd, command);
+    fclose(gd->out);
+    fclose(gd->log);
+    gd->out = stdout;
+    gd->log = NULL;
+}
+
+/**
+Play the commands in a file through two sessions of the same program, one
+running scripts in the tree walker and one in the VM, and report every turn
+whose output or debug log differs.
+
+Returns true if both engines behaved identically; returns false otherwise.
+*/
+int vm_check_file(program_t *prog, const char *filename) {
+    char *buffer = read_file(filename);
+    if (!buffer) {
+        fprintf(stderr, "Could not read command file '%s'.\n", filename);
+        return FALSE;
+    }
+
+    int function_count = 0;
+    int compiled = vm_compile_program(prog, &function_count);
+    check_session_t tree = { session_create(prog) };
+    check_session_t vm = { session_create(prog) };
+    int saved_engine = script_engine;
+    if (!tree.gd || !vm.gd) {
+        if (tree.gd) session_free(tree.gd);
+        if (vm.gd) session_free(vm.gd);
+        free(buffer);
+        return FALSE;
+    }
+
+    int turns = 0, mismatches = 0;
+    char *line = buffer;
+    while (*line && !tree.gd->quit_game && !vm.gd->quit_game) {
+        char *end = strchr(line, '\n');
+        if (end) *end = 0;
+        ++turns;
+        check_turn(&tree, ENGINE_TREE, line);
+        check_turn(&vm, ENGINE_VM, line);
+        if (!check_same(tree.output, vm.output) || !check_same(tree.log, vm.log)) {
+            ++mismatches;
+            printf("vm-check: turn %d differs: %s\n", turns, line);
+            printf("--- tree walker ---\n%s%s--- vm ---\n%s%s-----\n",
+                   tree.output, tree.log, vm.output, vm.log);
+        }
+        free(tree.output);
+        free(tree.log);
+        free(vm.output);
+        free(vm.log);
+        if (!end) break;
+        line = end + 1;
+    }
+    script_engine = saved_engine;
+
+    printf("vm-check: %d of %d functions compiled, %d turns, %d differed\n",
+           compiled, function_count, turns, mismatches);
+    session_free(tree.gd);
+    session_free(vm.gd);
+    free(buffer);
+    return mismatches == 0;
+}
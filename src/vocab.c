@@ -1,121 +1,340 @@
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "parse.h"
 
-typedef struct VOCAB {
-    char *word;
-    struct VOCAB *prev;
-    struct VOCAB *next;
-} vocab_t;
+#define FUZZY_MAX_LENGTH 64
 
-static char **vocab = NULL;
-static unsigned vocab_size = 0;
-static vocab_t *vocab_list = NULL;
+struct VOCABULARY {
+    char **words;
+    unsigned size;
 
-void vocab_dump() {
-    printf("Vocabulary (%d words):", vocab_size);
-    if (!vocab) {
-        printf(" none!\n");
+    char **raw;
+    unsigned raw_count, raw_capacity;
+
+    /* Typo correction index, built by vocab_build. Word numbers are sorted
+     * by length so that only words of a plausible length are compared. */
+    unsigned *by_length;
+    unsigned length_start[FUZZY_MAX_LENGTH + 2];
+    unsigned *letter_masks;
+};
+
+static int vocab_compare(const void *a, const void *b);
+static unsigned letter_mask(const char *word);
+static int popcount32(unsigned value);
+static int edit_distance_within(const uint64_t *peq, int pattern_length,
+                                const char *text, int text_length, int limit);
+
+vocabulary_t *vocab_create() {
+    vocabulary_t *vocab = calloc(sizeof(vocabulary_t), 1);
+    return vocab;
+}
+
+void vocab_free(vocabulary_t *vocab) {
+    if (!vocab) return;
+    for (unsigned i = 0; i < vocab->size; ++i) {
+        free(vocab->words[i]);
+    }
+    for (unsigned i = 0; i < vocab->raw_count; ++i) {
+        free(vocab->raw[i]);
+    }
+    free(vocab->words);
+    free(vocab->raw);
+    free(vocab->by_length);
+    free(vocab->letter_masks);
+    free(vocab);
+}
+
+void vocab_dump(FILE *dest, vocabulary_t *vocab) {
+    fprintf(dest, "Vocabulary (%d words):", vocab->size);
+    if (!vocab->words) {
+        fprintf(dest, " none!\n");
         return;
     }
 
-    for (int i = 0; i < vocab_size; ++i) {
+    for (int i = 0; i < vocab->size; ++i) {
         if (i != 0) {
-            putchar(',');
-            if (i == vocab_size - 1) {
-                printf(" and");
+            fputc(',', dest);
+            if (i == vocab->size - 1) {
+                fprintf(dest, " and");
             }
         }
-        printf(" '%s'", vocab[i]);
+        fprintf(dest, " '%s'", vocab->words[i]);
     }
-    printf("\n");
+    fprintf(dest, "\n");
 }
 
-void vocab_raw_add(const char *the_word) {
-    vocab_t *word = calloc(sizeof(vocab_t), 1);
-    word->word = str_dupl(the_word);
-    ++vocab_size;
-
-    if (!vocab_list) {
-        vocab_list = word;
-        return;
+/**
+Add a word to the vocabulary being loaded. Words are only collected here;
+sorting and removing duplicates is left to vocab_build.
+*/
+void vocab_raw_add(vocabulary_t *vocab, const char *the_word) {
+    if (vocab->raw_count >= vocab->raw_capacity) {
+        vocab->raw_capacity = vocab->raw_capacity ? vocab->raw_capacity * 2 : 64;
+        vocab->raw = realloc(vocab->raw, sizeof(char*) * vocab->raw_capacity);
     }
+    vocab->raw[vocab->raw_count++] = str_dupl(the_word);
+}
 
-    if (strcmp(the_word, vocab_list->word) < 0) {
-        word->next = vocab_list;
-        vocab_list = word;
-        return;
+/**
+Get one of the words collected by a vocabulary being loaded, in the order
+they were added.
+
+Returns the word, or NULL if index is past the last word.
+*/
+const char *vocab_raw_word(vocabulary_t *vocab, unsigned index) {
+    return index < vocab->raw_count ? vocab->raw[index] : NULL;
+}
+
+/**
+Move the words collected by one vocabulary being loaded into another, leaving
+the source with none.
+*/
+void vocab_merge(vocabulary_t *vocab, vocabulary_t *from) {
+    for (unsigned i = 0; i < from->raw_count; ++i) {
+        if (vocab->raw_count >= vocab->raw_capacity) {
+            vocab->raw_capacity = vocab->raw_capacity ? vocab->raw_capacity * 2 : 64;
+            vocab->raw = realloc(vocab->raw, sizeof(char*) * vocab->raw_capacity);
+        }
+        vocab->raw[vocab->raw_count++] = from->raw[i];
     }
-    if (strcmp(the_word, vocab_list->word) == 0) {
-        free(word->word);
-        free(word);
-        --vocab_size;
-        return;
+    from->raw_count = 0;
+}
+
+int vocab_compare(const void *a, const void *b) {
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+/**
+Finish loading the vocabulary: sort the collected words, drop duplicates,
+and build the index used by vocab_suggest.
+*/
+void vocab_build(vocabulary_t *vocab) {
+    qsort(vocab->raw, vocab->raw_count, sizeof(char*), vocab_compare);
+    vocab->words = calloc(sizeof(char*), vocab->raw_count+1);
+    vocab->size = 0;
+    for (unsigned i = 0; i < vocab->raw_count; ++i) {
+        if (vocab->size > 0 && strcmp(vocab->words[vocab->size - 1], vocab->raw[i]) == 0) {
+            free(vocab->raw[i]);
+        } else {
+            vocab->words[vocab->size++] = vocab->raw[i];
+        }
     }
+    free(vocab->raw);
+    vocab->raw = NULL;
+    vocab->raw_count = vocab->raw_capacity = 0;
 
-    vocab_t *cur = vocab_list;
-    while (cur->next) {
-        if (strcmp(the_word, cur->next->word) < 0) {
-            word->next = cur->next;
-            cur->next = word;
-            return;
+    /* counting sort of word numbers by length; words too long for the
+     * bit-parallel matcher are left out of the index */
+    unsigned counts[FUZZY_MAX_LENGTH + 2] = { 0 };
+    vocab->letter_masks = calloc(sizeof(unsigned), vocab->size + 1);
+    for (unsigned i = 0; i < vocab->size; ++i) {
+        size_t length = strlen(vocab->words[i]);
+        if (length <= FUZZY_MAX_LENGTH) {
+            ++counts[length];
         }
-        if (strcmp(the_word, cur->next->word) == 0) {
-            free(word->word);
-            free(word);
-            --vocab_size;
-            return;
+        vocab->letter_masks[i] = letter_mask(vocab->words[i]);
+    }
+    vocab->length_start[0] = 0;
+    for (int i = 0; i <= FUZZY_MAX_LENGTH; ++i) {
+        vocab->length_start[i + 1] = vocab->length_start[i] + counts[i];
+    }
+    vocab->by_length = calloc(sizeof(unsigned), vocab->length_start[FUZZY_MAX_LENGTH + 1] + 1);
+    unsigned fill[FUZZY_MAX_LENGTH + 1];
+    memcpy(fill, vocab->length_start, sizeof(fill));
+    for (unsigned i = 0; i < vocab->size; ++i) {
+        size_t length = strlen(vocab->words[i]);
+        if (length <= FUZZY_MAX_LENGTH) {
+            vocab->by_length[fill[length]++] = i;
+        }
+    }
+}
+
+/**
+Look up a word in the built vocabulary by binary search. vocab_build sorts
+the words and drops duplicates, so each word is found at its word number.
+
+Returns the index of the word or -1 if it is not in the vocabulary.
+*/
+int vocab_index(vocabulary_t *vocab, const char *word) {
+    if (!vocab->words) return -1;
+    int low = 0, high = (int)vocab->size - 1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        int cmp = strcmp(vocab->words[mid], word);
+        if (cmp == 0) {
+            return mid;
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
         }
-        cur = cur->next;
     }
-    cur->next = word;
+    return -1;
+}
+
+/**
+Add a built vocabulary to a game image.
+
+Returns the vocabulary's offset in the image.
+*/
+size_t vocab_write_image(image_writer_t *w, vocabulary_t *vocab) {
+    size_t offset = image_alloc(w, vocab, sizeof(vocabulary_t));
+    size_t words = image_alloc(w, NULL, sizeof(char*) * (vocab->size + 1));
+    for (unsigned i = 0; i < vocab->size; ++i) {
+        image_pointer(w, words + sizeof(char*) * i, image_string(w, vocab->words[i]));
+    }
+    image_pointer(w, offset + offsetof(vocabulary_t, words), words);
+    image_pointer(w, offset + offsetof(vocabulary_t, raw), 0);
+    image_pointer(w, offset + offsetof(vocabulary_t, by_length),
+                  image_alloc_flat(w, vocab->by_length,
+                                   sizeof(unsigned) * (vocab->length_start[FUZZY_MAX_LENGTH + 1] + 1)));
+    image_pointer(w, offset + offsetof(vocabulary_t, letter_masks),
+                  image_alloc_flat(w, vocab->letter_masks, sizeof(unsigned) * (vocab->size + 1)));
+    vocabulary_t *copy = image_at(w, offset);
+    copy->raw_count = copy->raw_capacity = 0;
+    return offset;
 }
 
-void vocab_build() {
-    vocab = calloc(sizeof(char*), vocab_size+1);
-    vocab_t *cur = vocab_list;
-    for (unsigned i = 0; i < vocab_size; ++i) {
-        vocab[i] = cur->word;
-        cur = cur->next;
+int vocab_is_built(vocabulary_t *vocab) {
+    return vocab->words != NULL;
+}
+
+unsigned letter_mask(const char *word) {
+    unsigned mask = 0;
+    for (; *word; ++word) {
+        mask |= 1u << ((unsigned char)*word % 32);
     }
-    vocab_raw_free(0);
+    return mask;
 }
 
-void vocab_raw_free(int free_words) {
-    vocab_t *vocab = vocab_list;
-    while (vocab) {
-        vocab_t *next = vocab->next;
-        if (free_words) {
-            free(vocab->word);
+int popcount32(unsigned value) {
+#ifdef __GNUC__
+    return __builtin_popcount(value);
+#else
+    int count = 0;
+    while (value) {
+        value &= value - 1;
+        ++count;
+    }
+    return count;
+#endif
+}
+
+/**
+Compute the edit distance between a pattern (given as its Peq bit vectors)
+and a text using Myers' bit-parallel algorithm, one machine word per text
+character. Gives up as soon as the distance must exceed limit.
+
+Returns the edit distance, or limit + 1 if it is greater than limit.
+*/
+int edit_distance_within(const uint64_t *peq, int pattern_length,
+                         const char *text, int text_length, int limit) {
+    uint64_t pv = ~(uint64_t)0, mv = 0;
+    uint64_t high_bit = (uint64_t)1 << (pattern_length - 1);
+    int score = pattern_length;
+
+    for (int j = 0; j < text_length; ++j) {
+        uint64_t eq = peq[(unsigned char)text[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & high_bit) {
+            ++score;
+        } else if (mh & high_bit) {
+            --score;
         }
-        free(vocab);
-        vocab = next;
+        /* each remaining text character can lower the score by at most one */
+        if (score - (text_length - j - 1) > limit) {
+            return limit + 1;
+        }
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
     }
+    return score;
 }
 
-int vocab_index(const char *word) {
-    if (!vocab) return -1;
-    for (int i = 0; vocab[i] != 0; ++i) {
-        if (strcmp(vocab[i], word) == 0) {
-            return i;
+/**
+Find the vocabulary word closest to a misspelled word, allowing at most
+max_distance insertions, deletions, or substitutions. Only words whose
+length is within max_distance of the input are compared, and words whose
+letters differ too much to be within range are skipped before running the
+bit-parallel distance calculation.
+
+Returns the word number of the unique closest word and stores its distance
+in *distance (if not NULL). Returns -1 if no word is close enough or if
+several words are equally close.
+*/
+int vocab_suggest(vocabulary_t *vocab, const char *word, int max_distance, int *distance) {
+    int length = strlen(word);
+    if (!vocab->by_length || length == 0 || length > FUZZY_MAX_LENGTH) {
+        return -1;
+    }
+
+    uint64_t peq[256] = { 0 };
+    for (int i = 0; i < length; ++i) {
+        peq[(unsigned char)word[i]] |= (uint64_t)1 << i;
+    }
+    unsigned mask = letter_mask(word);
+
+    int best = -1, best_distance = max_distance + 1, best_count = 0;
+    int min_length = length - max_distance < 1 ? 1 : length - max_distance;
+    int max_length = length + max_distance > FUZZY_MAX_LENGTH ? FUZZY_MAX_LENGTH : length + max_distance;
+    for (int len = min_length; len <= max_length; ++len) {
+        int limit = best_distance < max_distance ? best_distance : max_distance;
+        if (abs(len - length) > limit) {
+            continue;
+        }
+        for (unsigned i = vocab->length_start[len]; i < vocab->length_start[len + 1]; ++i) {
+            unsigned word_no = vocab->by_length[i];
+            /* an edit changes the presence of at most two letters */
+            if (popcount32(mask ^ vocab->letter_masks[word_no]) > 2 * limit) {
+                continue;
+            }
+            int d = edit_distance_within(peq, length, vocab->words[word_no], len, limit);
+            if (d < best_distance) {
+                best = word_no;
+                best_distance = d;
+                best_count = 1;
+                limit = d;
+            } else if (d == best_distance) {
+                ++best_count;
+            }
         }
     }
-    return -1;
+
+    if (best < 0 || best_count > 1) {
+        return -1;
+    }
+    if (distance) {
+        *distance = best_distance;
+    }
+    return best;
 }
 
-int vocab_is_built() {
-    return vocab != NULL;
+/**
+Get the text of a vocabulary word.
+*/
+const char *vocab_word(vocabulary_t *vocab, int word_no) {
+    if (!vocab->words || word_no < 0 || word_no >= vocab->size) {
+        return NULL;
+    }
+    return vocab->words[word_no];
 }
 
 
-int action_add(gamedata_t *gd, action_t *action) {
-    if (!gd->actions) {
-        gd->actions = action;
+int action_add(program_t *prog, action_t *action) {
+    if (!prog->actions) {
+        prog->actions = action;
     } else {
-        action->next = gd->actions;
-        gd->actions = action;
+        action->next = prog->actions;
+        prog->actions = action;
     }
     return 1;
 }
@@ -0,0 +1,304 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parse.h"
+
+/* The world generator writes the source for a synthetic world of any size,
+ * for measuring how loading and playing scale. A world is loaded on top of
+ * the game: its rooms lead back to the entryway, the world verb leads to
+ * them, and it uses the game's room prototype and library functions. Everything in it is worked out
+ * from room and item numbers, so a spec always gives the same source.
+ *
+ * The world is written to a directory of its own, as a file of
+ * definitions (prototypes, functions and grammar) and files of rooms,
+ * together with a manifest that lists the game's files and then these. */
+
+#define WORLD_MAX_NAME 64
+
+static unsigned world_hash(unsigned n);
+static void world_word(char *buffer, char first, int number);
+static char *world_path(const char *dir, const char *name);
+static int world_write_defs(const world_spec_t *spec, const char *filename);
+static int world_write_rooms(const world_spec_t *spec, const char *filename, int first, int end);
+static int world_write_manifest(const world_spec_t *spec, const char *filename, int file_count);
+
+/**
+Fill in a world spec for a world of about the given number of objects,
+in rooms of ten items nested three deep.
+*/
+void world_spec_default(world_spec_t *spec, int objects) {
+    spec->items_per_room = 10;
+    spec->depth = 3;
+    spec->rooms = objects / (spec->items_per_room + 1);
+    if (spec->rooms < 1) spec->rooms = 1;
+    spec->vocab_size = objects / 20 > 16 ? objects / 20 : 16;
+    spec->prototypes = 8;
+    spec->grammar_lines = 20;
+    spec->functions = spec->rooms / 10 > 4 ? spec->rooms / 10 : 4;
+    spec->rooms_per_file = 100;
+}
+
+/**
+Change a world spec from text of the form "rooms=100,items=10", naming any
+of rooms, items, depth, vocab, prototypes, grammar, functions and per-file.
+
+Returns false, leaving the spec partly changed, if the text can't be used.
+*/
+int world_spec_parse(world_spec_t *spec, const char *text) {
+    static const struct {
+        const char *name;
+        size_t offset;
+        int minimum;
+    } fields[] = {
+        { "rooms",      offsetof(world_spec_t, rooms),          1 },
+        { "items",      offsetof(world_spec_t, items_per_room), 0 },
+        { "depth",      offsetof(world_spec_t, depth),          1 },
+        { "vocab",      offsetof(world_spec_t, vocab_size),     1 },
+        { "prototypes", offsetof(world_spec_t, prototypes),     0 },
+        { "grammar",    offsetof(world_spec_t, grammar_lines),  0 },
+        { "functions",  offsetof(world_spec_t, functions),      0 },
+        { "per-file",   offsetof(world_spec_t, rooms_per_file), 1 },
+        { NULL }
+    };
+
+    while (*text) {
+        const char *equals = strchr(text, '=');
+        if (!equals) {
+            return FALSE;
+        }
+        int i = 0;
+        while (fields[i].name && (strlen(fields[i].name) != (size_t)(equals - text)
+                                  || strncmp(fields[i].name, text, equals - text) != 0)) {
+            ++i;
+        }
+        char *end;
+        long value = strtol(equals + 1, &end, 10);
+        if (!fields[i].name || end == equals + 1 || (*end && *end != ',')
+                || value < fields[i].minimum || value > 100000000) {
+            return FALSE;
+        }
+        *(int*)((char*)spec + fields[i].offset) = value;
+        text = *end ? end + 1 : end;
+    }
+    return TRUE;
+}
+
+/**
+Write a world to a directory, which is made if needed.
+
+Returns the name of the world's manifest, which the caller must free, or
+NULL if the world could not be written.
+*/
+char *world_generate(const world_spec_t *spec, const char *dir) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        debug_out("world_generate: could not make directory %s\n", dir);
+        return NULL;
+    }
+
+    char name[WORLD_MAX_NAME];
+    char *filename = world_path(dir, "world-defs.dat");
+    int success = world_write_defs(spec, filename);
+    free(filename);
+
+    int file_count = (spec->rooms + spec->rooms_per_file - 1) / spec->rooms_per_file;
+    for (int i = 0; i < file_count && success; ++i) {
+        sprintf(name, "world-%d.dat", i);
+        filename = world_path(dir, name);
+        int first = i * spec->rooms_per_file;
+        int end = first + spec->rooms_per_file < spec->rooms
+                ? first + spec->rooms_per_file : spec->rooms;
+        success = world_write_rooms(spec, filename, first, end);
+        free(filename);
+    }
+
+    char *manifest = world_path(dir, "world.manifest");
+    if (!success || !world_write_manifest(spec, manifest, file_count)) {
+        free(manifest);
+        return NULL;
+    }
+    return manifest;
+}
+
+/* Scramble a number, for choosing things that should look random. */
+unsigned world_hash(unsigned n) {
+    n ^= n >> 16;
+    n *= 0x45d9f3b;
+    n ^= n >> 16;
+    return n;
+}
+
+/* Make the word for a number: a letter, then the number in letters. */
+void world_word(char *buffer, char first, int number) {
+    *buffer++ = first;
+    do {
+        *buffer++ = 'a' + number % 26;
+        number /= 26;
+    } while (number > 0);
+    *buffer = 0;
+}
+
+char *world_path(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/* Write the prototypes the items are made from, the functions, and the
+ * grammar that runs them, along with the world verb that takes the player
+ * to the first room. */
+int world_write_defs(const world_spec_t *spec, const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        debug_out("world_generate: could not write %s\n", filename);
+        return FALSE;
+    }
+
+    for (int i = 0; i < spec->prototypes; ++i) {
+        fprintf(fp, "(object - world-proto-%d -\n"
+                    "    description \"An ordinary thing of kind %d.\"\n"
+                    "    kind %d)\n",
+                i, i, i);
+    }
+
+    for (int i = 0; i < spec->functions; ++i) {
+        fprintf(fp, "(function world-fn-%d (noun)\n"
+                    "    (if (prop-true noun #is-container)\n"
+                    "        (proc\n"
+                    "            (say \"Inside \")\n"
+                    "            (print-name noun)\n"
+                    "            (say \" you find \")\n"
+                    "            (do-list-horz noun)\n"
+                    "            (say \".\\n\"))\n"
+                    "        (if (lt (prop-get noun #weight) %d)\n"
+                    "            (say \"It is light enough.\\n\")\n"
+                    "            (say \"It is too heavy.\\n\"))))\n",
+                i, i % 10);
+    }
+
+    /* the game's rooms don't lead to the world, so it gets a verb */
+    fprintf(fp, "(function world-enter ()\n"
+                "    (proc\n"
+                "        (object-move player world-room-0)\n"
+                "        (print-location)))\n"
+                "(action world-enter <world>)\n");
+
+    char verb[WORLD_MAX_NAME];
+    for (int i = 0; i < spec->grammar_lines; ++i) {
+        world_word(verb, 'v', i);
+        if (spec->functions > 0) {
+            fprintf(fp, "(action world-fn-%d <%s> noun)\n", i % spec->functions, verb);
+        } else {
+            fprintf(fp, "(action verb-examine <%s> noun)\n", verb);
+        }
+    }
+
+    int success = !ferror(fp);
+    return fclose(fp) == 0 && success;
+}
+
+/* Write the rooms numbered from first up to end, with their items. */
+int world_write_rooms(const world_spec_t *spec, const char *filename, int first, int end) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        debug_out("world_generate: could not write %s\n", filename);
+        return FALSE;
+    }
+
+    char noun[WORLD_MAX_NAME], adjective[WORLD_MAX_NAME];
+    for (int room = first; room < end; ++room) {
+        fprintf(fp, "(object room world-room-%d -\n"
+                    "    name \"Room %d\"\n"
+                    "    description \"A featureless room, one of many just like it.\"\n",
+                room, room);
+        if (room > 0) {
+            fprintf(fp, "    south world-room-%d\n", room - 1);
+        } else {
+            fprintf(fp, "    south entryway\n");
+        }
+        if (room + 1 < spec->rooms) {
+            fprintf(fp, "    north world-room-%d\n", room + 1);
+        }
+        fprintf(fp, ")\n");
+
+        for (int j = 0; j < spec->items_per_room; ++j) {
+            int item = room * spec->items_per_room + j;
+            unsigned hash = world_hash(item);
+            char prototype[WORLD_MAX_NAME] = "-";
+            if (spec->prototypes > 0) {
+                sprintf(prototype, "world-proto-%u", hash % spec->prototypes);
+            }
+            fprintf(fp, "(object %s world-item-%d ", prototype, item);
+            if (j % spec->depth == 0) {
+                fprintf(fp, "world-room-%d\n", room);
+            } else {
+                fprintf(fp, "world-item-%d\n", item - 1);
+            }
+
+            /* two different words, if there are two */
+            int noun_word = hash % spec->vocab_size;
+            world_word(noun, 'z', noun_word);
+            world_word(adjective, 'z', spec->vocab_size > 1
+                       ? (noun_word + 1 + world_hash(hash) % (spec->vocab_size - 1)) % spec->vocab_size
+                       : noun_word);
+            fprintf(fp, "    name \"%s %s\"\n"
+                        "    vocab ( <%s> <%s> )\n"
+                        "    weight %u",
+                    adjective, noun, adjective, noun, hash % 20);
+            if ((j + 1) % spec->depth != 0 && j + 1 < spec->items_per_room) {
+                fprintf(fp, "\n    is-container 1\n    is-open 1");
+            }
+            fprintf(fp, ")\n");
+        }
+    }
+
+    int success = !ferror(fp);
+    return fclose(fp) == 0 && success;
+}
+
+/* Write the manifest: the game's own files, named so that they can be found
+ * from the world's directory, then the world's. */
+int world_write_manifest(const world_spec_t *spec, const char *filename, int file_count) {
+    char **game_files = read_manifest(load_manifest);
+    if (!game_files) {
+        return FALSE;
+    }
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        cwd[0] = 0;
+    }
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        debug_out("world_generate: could not write %s\n", filename);
+    } else {
+        fprintf(fp, "// A synthetic world of %d rooms of %d items, made by -generate.\n",
+                spec->rooms, spec->items_per_room);
+        for (int i = 0; game_files[i]; ++i) {
+            if (game_files[i][0] == '/') {
+                fprintf(fp, "%s\n", game_files[i]);
+            } else {
+                fprintf(fp, "%s/%s\n", cwd, game_files[i]);
+            }
+        }
+        fprintf(fp, "world-defs.dat\n");
+        for (int i = 0; i < file_count; ++i) {
+            fprintf(fp, "world-%d.dat\n", i);
+        }
+    }
+    for (int i = 0; game_files[i]; ++i) {
+        free(game_files[i]);
+    }
+    free(game_files);
+
+    if (!fp) {
+        return FALSE;
+    }
+    int success = !ferror(fp);
+    return fclose(fp) == 0 && success;
+}